@@ -0,0 +1,52 @@
+#!/bin/sh
+# Commands per second and reactor system calls per command of server_good.c
+# with each event backend (-b), at 1k and 10k connections driven by loadgen.
+# Chat is left out of the mix: its fan-out grows with the square of the clients.
+# Usage: ./bench_backends.sh [seconds] [commands per client per second] [port]
+
+SECONDS_RUN=${1:-10}
+RATE=${2:-1}
+PORT=${3:-9200}
+
+gcc -O2 -pthread server_good.c -o server_bench || exit 1
+gcc -O2 -pthread loadgen.c board_client.c -o loadgen_bench -lm || exit 1
+# Both ends of 10k connections need a descriptor each, in their own processes
+ulimit -n "$(ulimit -Hn)" 2> /dev/null
+[ "$(ulimit -n)" = unlimited ] || [ "$(ulimit -n)" -gt 10100 ] || echo "warning: fd limit $(ulimit -n) is too low for 10k connections"
+
+syscalls() {
+    curl -s "http://127.0.0.1:$1/metrics" | awk '$1 == "board_syscalls_total" { print $2 }'
+}
+
+for CLIENTS in 1000 10000; do
+    for BACKEND in poll epoll uring; do
+        METRICS=$((PORT + 1))
+        ./server_bench -b "$BACKEND" -t 4 -l error -M "$METRICS" "$PORT" > /dev/null &
+        SERVER=$!
+        sleep 0.5
+        if ! kill -0 "$SERVER" 2> /dev/null; then
+            echo "backend=$BACKEND is not available here"
+            PORT=$((PORT + 2))
+            continue
+        fi
+        BEFORE=$(syscalls "$METRICS")
+        ./loadgen_bench -c "$CLIENTS" -t 4 -d "$SECONDS_RUN" -r "$RATE" -m 90:10:0 127.0.0.1 "$PORT" > loadgen.out
+        AFTER=$(syscalls "$METRICS")
+        awk -v backend="$BACKEND" -v clients="$CLIENTS" -v calls=$((AFTER - BEFORE)) '
+            /^connections=/ {
+                for (i = 1; i <= NF; i++) {
+                    split($i, field, "=")
+                    value[field[1]] = field[2] + 0
+                }
+                sent = value["frames_sent"]
+                printf "backend=%-5s clients=%-5d commands/s=%-9.0f syscalls=%-9d syscalls/command=%.2f disconnects=%d\n",
+                       backend, clients, sent / value["elapsed"], calls, (sent > 0 ? calls / sent : 0), value["disconnects"]
+            }
+            $1 == "draw" { printf "    draw p50 %s ms, p99 %s ms\n", $4, $5 }' loadgen.out
+        kill "$SERVER"
+        wait "$SERVER" 2> /dev/null
+        PORT=$((PORT + 2))
+    done
+done
+
+rm -f server_bench loadgen_bench loadgen.out
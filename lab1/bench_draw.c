@@ -0,0 +1,173 @@
+/*
+ * Draw throughput benchmark for server_good.c
+ *
+ * Opens <clients> connections on one libboardclient loop (board_client.h)
+ * and has every client draw <draws> cells in its own row band, keeping up
+ * to [pipeline] draws in flight (default 1: wait for the DRAW_ACK before
+ * the next stroke). Prints the total draw rate so runs against
+ * `server -t 1`, `-t 2`, `-t 4`... can be compared (see bench_threads.sh).
+ *
+ * Build: gcc -O2 bench_draw.c board_client.c -o bench_draw
+ */
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "board_client.h"
+
+#define CANVAS_WIDTH 81
+#define CANVAS_HEIGHT 21
+
+int draws_per_client;
+int pipeline_depth = 1;
+int running_clients;
+
+typedef struct
+{
+    int id;
+    BoardClient *client;
+    int joined;
+    int sent;
+    long completed;
+} BenchClient;
+
+double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Keep pipeline_depth draws in flight until all of them are sent
+void send_draws(BenchClient *bench)
+{
+    // Each client stays within one row so draws spread across board shards
+    int y = bench->id % CANVAS_HEIGHT;
+    while (bench->sent < draws_per_client && bench->sent - bench->completed < pipeline_depth)
+    {
+        board_client_send_draw(bench->client, bench->sent % CANVAS_WIDTH, y, 'a' + bench->id % 26);
+        bench->sent++;
+    }
+}
+
+void handle_event(const BoardEvent *event, void *context)
+{
+    BenchClient *bench = (BenchClient *)event->client->user;
+    (void)context;
+
+    if (event->type == BOARD_EVENT_CLOSED)
+    {
+        fprintf(stderr, "Client %d: connection failed\n", bench->id);
+        running_clients--;
+        return;
+    }
+    if (event->type != BOARD_EVENT_FRAME)
+    {
+        return;
+    }
+    switch (event->frame)
+    {
+    case FRAME_SNAPSHOT:
+    case FRAME_SNAPSHOT_RLE:
+    case FRAME_REGION:
+    case FRAME_REGION_RLE:
+        // The join board comes last in the welcome; start drawing then
+        if (!bench->joined)
+        {
+            bench->joined = 1;
+            send_draws(bench);
+        }
+        break;
+    case FRAME_DRAW_ACK:
+        bench->completed++;
+        if (bench->completed == draws_per_client)
+        {
+            board_client_close(bench->client);
+            running_clients--;
+        }
+        else
+        {
+            send_draws(bench);
+        }
+        break;
+    default:
+        break; // Deltas from everyone's drawing
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 5 && argc != 6)
+    {
+        fprintf(stderr, "USAGE: %s <ip> <port> <clients> <draws per client> [pipeline]\n", argv[0]);
+        exit(1);
+    }
+
+    int client_count = atoi(argv[3]);
+    draws_per_client = atoi(argv[4]);
+    if (argc == 6)
+    {
+        pipeline_depth = atoi(argv[5]);
+    }
+    if (client_count < 1 || draws_per_client < 1 || pipeline_depth < 1)
+    {
+        fprintf(stderr, "Client, draw and pipeline counts must be positive\n");
+        exit(1);
+    }
+
+    struct sockaddr_in servaddr;
+    memset(&servaddr, 0, sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_port = htons(atoi(argv[2]));
+    if (inet_pton(AF_INET, argv[1], &servaddr.sin_addr) <= 0)
+    {
+        fprintf(stderr, "Invalid address: %s\n", argv[1]);
+        exit(1);
+    }
+
+    BoardLoop *loop = board_loop_create(handle_event, NULL);
+    BenchClient *clients = calloc(client_count, sizeof(BenchClient));
+    if (loop == NULL || clients == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    double start = now_seconds();
+    for (int i = 0; i < client_count; i++)
+    {
+        char username[16];
+        clients[i].id = i;
+        clients[i].client = board_client_connect(loop, (struct sockaddr *)&servaddr, sizeof(servaddr));
+        if (clients[i].client == NULL)
+        {
+            fprintf(stderr, "Client %d: connection failed\n", i);
+            continue;
+        }
+        clients[i].client->user = &clients[i];
+        snprintf(username, sizeof(username), "bench%d", i);
+        board_client_hello(clients[i].client, username, HELLO_FLAG_RLE | HELLO_FLAG_DRAW_ACK);
+        running_clients++;
+    }
+    while (running_clients > 0 && board_loop_poll_events(loop, -1) >= 0)
+    {
+    }
+
+    long total = 0;
+    for (int i = 0; i < client_count; i++)
+    {
+        total += clients[i].completed;
+    }
+    double elapsed = now_seconds() - start;
+
+    printf("clients=%d pipeline=%d draws=%ld elapsed=%.3fs throughput=%.0f draws/s\n",
+           client_count, pipeline_depth, total, elapsed, total / elapsed);
+    board_loop_destroy(loop);
+    free(clients);
+    return 0;
+}
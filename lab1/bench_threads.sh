@@ -0,0 +1,24 @@
+#!/bin/sh
+# Draw throughput of server_good.c for an increasing number of reactor threads.
+# Usage: ./bench_threads.sh [clients] [draws per client] [port] [pipeline]
+
+CLIENTS=${1:-32}
+DRAWS=${2:-2000}
+PORT=${3:-9100}
+PIPELINE=${4:-1}
+
+gcc -O2 -pthread server_good.c -o server_bench || exit 1
+gcc -O2 bench_draw.c board_client.c -o bench_draw || exit 1
+
+for THREADS in 1 2 4 8; do
+    ./server_bench -t "$THREADS" "$PORT" > /dev/null &
+    SERVER=$!
+    sleep 0.5
+    printf "threads=%s " "$THREADS"
+    ./bench_draw 127.0.0.1 "$PORT" "$CLIENTS" "$DRAWS" "$PIPELINE"
+    kill "$SERVER"
+    wait "$SERVER" 2> /dev/null
+    PORT=$((PORT + 1))
+done
+
+rm -f server_bench bench_draw
@@ -0,0 +1,1104 @@
+/*
+ * libboardclient: connections, framing, canvas and draw prediction for
+ * clients of server_good.c (see board_client.h)
+ *
+ * Linux waits with epoll, so a loop with thousands of connections only
+ * touches the ones that are ready; elsewhere poll() over all of them.
+ */
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#include "board_client.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // Callers on systems without it ignore SIGPIPE themselves
+#endif
+
+#define READ_CHUNK 16384          // Free space kept for each recv()
+#define KEEP_INPUT (256 * 1024)   // Larger receive buffers are freed once empty, after a big snapshot
+#define SEND_BATCH (64 * 1024)    // Queued bytes that go out before the next poll
+#define MAX_EVENTS 256
+#define MAX_USERNAME 14
+
+struct BoardLoop
+{
+    BoardEventHandler handler;
+    void *context;
+    BoardClient *clients;
+    size_t client_count;
+    BoardClient *due;       // Clients with output queued or a close to report
+    BoardClient *graveyard; // Freed during a poll; released at its end
+    int polling;
+    int events;             // Reported during this poll
+    int watched[BOARD_MAX_WATCHED]; // -1 for a free slot
+    int always_ready[BOARD_MAX_WATCHED]; // Regular files, which epoll refuses and poll() calls readable
+    unsigned char *decoded; // Cells of the last _RLE frame
+    size_t decoded_capacity;
+#ifdef __linux__
+    int epoll_fd;
+#else
+    struct pollfd *fds;
+    BoardClient **fd_clients; // NULL for a watched descriptor
+    size_t fds_capacity;
+#endif
+};
+
+static void report(BoardLoop *loop, BoardEvent *event)
+{
+    loop->events++;
+    loop->handler(event, loop->context);
+}
+
+// Have the next poll look at the client
+static void mark_due(BoardClient *client)
+{
+    if (!client->due)
+    {
+        client->due = 1;
+        client->next_due = client->loop->due;
+        client->loop->due = client;
+    }
+}
+
+// Tell the poller what to wait for on the client's socket
+static void update_interest(BoardClient *client, int add)
+{
+#ifdef __linux__
+    struct epoll_event event;
+    event.events = client->state == BOARD_CLIENT_CONNECTING || client->want_write ? EPOLLOUT : 0;
+    if (client->state == BOARD_CLIENT_CONNECTED)
+    {
+        event.events |= EPOLLIN;
+    }
+    event.data.ptr = client;
+    epoll_ctl(client->loop->epoll_fd, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, client->fd, &event);
+#else
+    (void)client;
+    (void)add; // The poll() set is rebuilt every time
+#endif
+}
+
+static void close_socket(BoardClient *client)
+{
+    if (client->state == BOARD_CLIENT_CLOSED)
+    {
+        return;
+    }
+#ifdef __linux__
+    epoll_ctl(client->loop->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+#endif
+    close(client->fd);
+    client->fd = -1;
+    client->state = BOARD_CLIENT_CLOSED;
+    client->out_offset = client->out_length = 0;
+}
+
+// Close the connection because of error (0: the server hung up); reported at the end of the poll
+static void fail(BoardClient *client, int error)
+{
+    if (client->state == BOARD_CLIENT_CLOSED)
+    {
+        return;
+    }
+    close_socket(client);
+    client->error = error;
+    mark_due(client);
+}
+
+/* Canvas */
+
+int board_canvas_position(const BoardCanvas *canvas, int x, int y, int *row, int *column)
+{
+    long long from_left = (long long)x - canvas->x;
+    long long from_top = (long long)canvas->y + canvas->height - 1 - y; // Rows start from the top
+
+    if (from_left < 0 || from_left >= canvas->width || from_top < 0 || from_top >= canvas->height)
+    {
+        return 0;
+    }
+    *column = (int)from_left;
+    *row = (int)from_top;
+    return 1;
+}
+
+// Copy the part of a width x height block of cells, top row first, with its bottom-left cell at left, bottom
+static void canvas_fill(BoardCanvas *canvas, long long left, long long bottom, uint32_t width, uint32_t height,
+                        const unsigned char *cells)
+{
+    long long from = left > canvas->x ? left : canvas->x;
+    long long to = left + width < (long long)canvas->x + canvas->width ? left + width : (long long)canvas->x + canvas->width;
+
+    if (from >= to)
+    {
+        return;
+    }
+    for (uint32_t source_row = 0; source_row < height; source_row++)
+    {
+        long long y = bottom + height - 1 - source_row;
+        long long row = (long long)canvas->y + canvas->height - 1 - y;
+        if (row >= 0 && row < canvas->height)
+        {
+            memcpy(canvas->confirmed + row * canvas->width + (from - canvas->x),
+                   cells + (size_t)source_row * width + (from - left), to - from);
+        }
+    }
+}
+
+// Forget settled predictions and rebuild the shown cells: confirmed cells, then the pending draws in order
+static void reconcile(BoardClient *client)
+{
+    BoardCanvas *canvas = &client->canvas;
+    int kept = 0;
+    int row, column;
+
+    if (canvas->width > 0)
+    {
+        memcpy(canvas->cells, canvas->confirmed, (size_t)canvas->width * canvas->height);
+    }
+    for (int i = 0; i < client->prediction_count; i++)
+    {
+        BoardPrediction *prediction = &client->predictions[i];
+        int visible = board_canvas_position(canvas, prediction->draw.x, prediction->draw.y, &row, &column);
+        // Settled once a board update that includes the draw has covered its cell, or the cell already
+        // shows it. Out of view nothing is drawn and no DELTA for it will come.
+        if (prediction->acked && (prediction->covered || !visible ||
+                                  canvas->confirmed[row * canvas->width + column] == prediction->draw.symbol))
+        {
+            continue;
+        }
+        if (visible)
+        {
+            canvas->cells[row * canvas->width + column] = prediction->draw.symbol;
+        }
+        client->predictions[kept++] = *prediction;
+    }
+    client->prediction_count = kept;
+}
+
+/*
+ * Note which acked predictions a board update numbered seq has covered:
+ * width x height cells from left, bottom. The ack's seq is only a lower
+ * bound, since one tick can go out as several DELTAs, each for part of the
+ * board, and the others may carry a later seq without the draw's cell. Only
+ * a frame from that seq on that covers the cell is sure to include the draw.
+ */
+static void mark_covered(BoardClient *client, uint64_t seq, long long left, long long bottom, uint32_t width,
+                         uint32_t height)
+{
+    for (int i = 0; i < client->prediction_count; i++)
+    {
+        BoardPrediction *prediction = &client->predictions[i];
+        if (prediction->acked && seq >= prediction->seq && prediction->draw.x >= left &&
+            prediction->draw.x < left + width && prediction->draw.y >= bottom && prediction->draw.y < bottom + height)
+        {
+            prediction->covered = 1;
+        }
+    }
+}
+
+/*
+ * Cells of a SNAPSHOT or REGION payload after its header_size byte header:
+ * the payload itself, or for the _RLE frames the decoded copy. NULL if the
+ * payload is truncated or does not decode to width * height cells.
+ */
+static const unsigned char *board_cells(BoardLoop *loop, const unsigned char *payload, uint32_t length,
+                                        uint32_t header_size, uint32_t width, uint32_t height, int compressed)
+{
+    uint64_t count = (uint64_t)width * height;
+
+    if (!compressed)
+    {
+        return count <= length - header_size ? payload + header_size : NULL;
+    }
+    if (count > MAX_FRAME_PAYLOAD)
+    {
+        return NULL; // Only frames that could also go out uncompressed are encoded
+    }
+    if (count > loop->decoded_capacity)
+    {
+        unsigned char *grown = realloc(loop->decoded, count);
+        if (grown == NULL)
+        {
+            return NULL;
+        }
+        loop->decoded = grown;
+        loop->decoded_capacity = count;
+    }
+    if (rle_decode(loop->decoded, count, payload + header_size, length - header_size) < 0)
+    {
+        return NULL;
+    }
+    return loop->decoded;
+}
+
+// Apply a SNAPSHOT, REGION or their _RLE forms
+static void apply_board(BoardClient *client, const unsigned char *payload, uint32_t length, int region, int compressed)
+{
+    BoardCanvas *canvas = &client->canvas;
+    uint32_t header_size = region ? REGION_HEADER_SIZE : SNAPSHOT_HEADER_SIZE;
+
+    if (length < header_size)
+    {
+        return;
+    }
+    uint64_t seq = get_u64(payload);
+    // Coordinates stay unsigned until canvas_fill() has clipped them
+    uint32_t left = region ? get_u32(payload + 8) : 0;
+    uint32_t bottom = region ? get_u32(payload + 12) : 0;
+    uint32_t width = get_u32(payload + (region ? 16 : 8));
+    uint32_t height = get_u32(payload + (region ? 20 : 12));
+    const unsigned char *cells = board_cells(client->loop, payload, length, header_size, width, height, compressed);
+
+    if (cells == NULL)
+    {
+        return; // Truncated or damaged
+    }
+    canvas_fill(canvas, left, bottom, width, height, cells);
+    mark_covered(client, seq, left, bottom, width, height);
+    canvas->seq = seq;
+    canvas->resyncing = 0;
+}
+
+static void apply_delta(BoardClient *client, const unsigned char *payload, uint32_t length)
+{
+    BoardCanvas *canvas = &client->canvas;
+
+    if (length < DELTA_HEADER_SIZE)
+    {
+        return;
+    }
+    uint64_t seq = get_u64(payload);
+    uint16_t runs = get_u16(payload + 8);
+
+    if (canvas->resyncing || seq <= canvas->seq)
+    {
+        return; // Waiting for the region that replaces the canvas, or already in the last one
+    }
+    uint32_t offset = DELTA_HEADER_SIZE;
+    for (uint16_t r = 0; r < runs && offset + DELTA_RUN_HEADER_SIZE <= length; r++)
+    {
+        uint16_t run_length = get_u16(payload + offset + 8);
+        if (offset + DELTA_RUN_HEADER_SIZE + run_length > length)
+        {
+            break;
+        }
+        canvas_fill(canvas, get_u32(payload + offset), get_u32(payload + offset + 4), run_length, 1,
+                    payload + offset + DELTA_RUN_HEADER_SIZE);
+        mark_covered(client, seq, get_u32(payload + offset), get_u32(payload + offset + 4), run_length, 1);
+        offset += DELTA_RUN_HEADER_SIZE + run_length;
+    }
+    canvas->seq = seq;
+}
+
+// Settle the prediction a DRAW_ACK answers; fills *draw and returns 1 if there was one
+static int settle_draw(BoardClient *client, const unsigned char *payload, uint32_t length, BoardDraw *draw)
+{
+    if (length < DRAW_ACK_SIZE)
+    {
+        return 0;
+    }
+    uint32_t id = get_u32(payload);
+    for (int i = 0; i < client->prediction_count; i++)
+    {
+        BoardPrediction *prediction = &client->predictions[i];
+        if (prediction->id != id)
+        {
+            continue;
+        }
+        *draw = prediction->draw;
+        if (payload[4] == DRAW_ACK_APPLIED)
+        {
+            prediction->acked = 1;
+            prediction->seq = get_u64(payload + 5);
+        }
+        else
+        {
+            // Later draws to the same cell must still land on top, so keep send order
+            memmove(prediction, prediction + 1, (client->prediction_count - i - 1) * sizeof(BoardPrediction));
+            client->prediction_count--;
+        }
+        reconcile(client);
+        return 1;
+    }
+    return 0;
+}
+
+/* Frames */
+
+static void handle_frame(BoardClient *client, uint8_t type, const unsigned char *payload, uint32_t length)
+{
+    BoardCanvas *canvas = &client->canvas;
+    BoardEvent event = {BOARD_EVENT_FRAME, client, type, payload, length, NULL, -1};
+    BoardDraw draw;
+
+    switch (type)
+    {
+    case FRAME_HELLO_ACK:
+        client->flags = length >= 2 ? payload[1] : 0;
+        if (length >= HELLO_ACK_SIZE)
+        {
+            client->board_width = (int)get_u32(payload + 2);
+            client->board_height = (int)get_u32(payload + 6);
+        }
+        break;
+    case FRAME_SNAPSHOT:
+    case FRAME_SNAPSHOT_RLE:
+    case FRAME_REGION:
+    case FRAME_REGION_RLE:
+        if (type == FRAME_REGION || type == FRAME_REGION_RLE)
+        {
+            if (client->views_pending > 0)
+            {
+                client->views_pending--;
+            }
+        }
+        if (canvas->width > 0)
+        {
+            apply_board(client, payload, length, type == FRAME_REGION || type == FRAME_REGION_RLE,
+                        type == FRAME_SNAPSHOT_RLE || type == FRAME_REGION_RLE);
+            reconcile(client);
+        }
+        break;
+    case FRAME_DELTA:
+        if (canvas->width > 0)
+        {
+            apply_delta(client, payload, length);
+            reconcile(client);
+        }
+        break;
+    case FRAME_CLEAR:
+        if (canvas->width > 0 && length >= 8)
+        {
+            memset(canvas->confirmed, ' ', (size_t)canvas->width * canvas->height);
+            canvas->seq = get_u64(payload);
+            mark_covered(client, canvas->seq, 0, 0, UINT32_MAX, UINT32_MAX); // The whole board
+            canvas->resyncing = 0;
+            reconcile(client);
+        }
+        break;
+    case FRAME_DRAW_ACK:
+        if (settle_draw(client, payload, length, &draw))
+        {
+            event.draw = &draw;
+        }
+        break;
+    default:
+        break;
+    }
+    report(client->loop, &event);
+}
+
+// Make room for at least need more bytes, moving a partial frame to the front before growing
+static int reserve_input(BoardClient *client, size_t need)
+{
+    if (client->in_capacity - client->in_end >= need)
+    {
+        return 0;
+    }
+    if (client->in_start > 0)
+    {
+        memmove(client->in, client->in + client->in_start, client->in_end - client->in_start);
+        client->in_end -= client->in_start;
+        client->in_start = 0;
+    }
+    if (client->in_capacity - client->in_end >= need)
+    {
+        return 0;
+    }
+    size_t capacity = client->in_capacity == 0 ? READ_CHUNK : client->in_capacity;
+    while (capacity - client->in_end < need)
+    {
+        capacity *= 2;
+    }
+    unsigned char *grown = realloc(client->in, capacity);
+    if (grown == NULL)
+    {
+        return -1;
+    }
+    client->in = grown;
+    client->in_capacity = capacity;
+    return 0;
+}
+
+/*
+ * Read everything the socket has and handle the frames it completes. A frame
+ * whose header has arrived gets room for all of it, so a large snapshot is
+ * read in a few big recv() calls.
+ */
+static void receive(BoardClient *client)
+{
+    while (client->state == BOARD_CLIENT_CONNECTED)
+    {
+        size_t need = READ_CHUNK;
+        size_t pending = client->in_end - client->in_start;
+        if (pending >= FRAME_HEADER_SIZE)
+        {
+            uint32_t length = get_u32(client->in + client->in_start + 1);
+            if (length > MAX_FRAME_PAYLOAD)
+            {
+                fail(client, EPROTO); // Before a bad length can size the buffer
+                return;
+            }
+            size_t frame_size = FRAME_HEADER_SIZE + (size_t)length;
+            if (frame_size > pending && frame_size - pending > need)
+            {
+                need = frame_size - pending;
+            }
+        }
+        if (reserve_input(client, need) < 0)
+        {
+            fail(client, ENOMEM);
+            return;
+        }
+
+        ssize_t received = recv(client->fd, client->in + client->in_end, client->in_capacity - client->in_end, 0);
+        if (received == 0 || (received < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK))
+        {
+            fail(client, received == 0 ? 0 : errno);
+            return;
+        }
+        if (received < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        client->bytes_received += received;
+        client->in_end += received;
+
+        // The handler may close the client; then the rest is dropped
+        while (client->state == BOARD_CLIENT_CONNECTED && client->in_end - client->in_start >= FRAME_HEADER_SIZE)
+        {
+            const unsigned char *frame = client->in + client->in_start;
+            uint32_t length = get_u32(frame + 1);
+            if (length > MAX_FRAME_PAYLOAD)
+            {
+                fail(client, EPROTO);
+                return;
+            }
+            if (client->in_end - client->in_start < FRAME_HEADER_SIZE + length)
+            {
+                break; // Wait for the rest of the frame
+            }
+            client->in_start += FRAME_HEADER_SIZE + length;
+            handle_frame(client, frame[0], frame + FRAME_HEADER_SIZE, length);
+        }
+    }
+    if (client->in_start == client->in_end)
+    {
+        client->in_start = client->in_end = 0;
+        if (client->in_capacity > KEEP_INPUT)
+        {
+            free(client->in);
+            client->in = NULL;
+            client->in_capacity = 0;
+        }
+    }
+}
+
+// Send as much of the queue as the socket takes, and wait for room if it is full
+static void send_queued(BoardClient *client)
+{
+    int was_waiting = client->want_write;
+
+    if (client->state != BOARD_CLIENT_CONNECTED)
+    {
+        return; // Goes out once connected
+    }
+    while (client->out_offset < client->out_length)
+    {
+        ssize_t sent = send(client->fd, client->out + client->out_offset, client->out_length - client->out_offset,
+                            MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            break;
+        }
+        if (sent < 0)
+        {
+            fail(client, errno);
+            return;
+        }
+        client->out_offset += sent;
+    }
+    if (client->out_offset == client->out_length)
+    {
+        client->out_offset = client->out_length = 0;
+    }
+    client->want_write = client->out_length > 0;
+    if (client->want_write != was_waiting)
+    {
+        update_interest(client, 0);
+    }
+}
+
+int board_client_send_frame(BoardClient *client, uint8_t type, const void *payload, uint32_t length)
+{
+    if (client->state == BOARD_CLIENT_CLOSED)
+    {
+        return -1;
+    }
+    if (client->out_capacity - client->out_length < FRAME_HEADER_SIZE + length && client->out_offset > 0)
+    {
+        memmove(client->out, client->out + client->out_offset, client->out_length - client->out_offset);
+        client->out_length -= client->out_offset;
+        client->out_offset = 0;
+    }
+    if (client->out_capacity - client->out_length < FRAME_HEADER_SIZE + length)
+    {
+        size_t capacity = client->out_capacity == 0 ? 4096 : client->out_capacity;
+        while (capacity - client->out_length < FRAME_HEADER_SIZE + length)
+        {
+            capacity *= 2;
+        }
+        unsigned char *grown = realloc(client->out, capacity);
+        if (grown == NULL)
+        {
+            fail(client, ENOMEM);
+            return -1;
+        }
+        client->out = grown;
+        client->out_capacity = capacity;
+    }
+    put_frame_header(client->out + client->out_length, type, length);
+    if (length > 0)
+    {
+        memcpy(client->out + client->out_length + FRAME_HEADER_SIZE, payload, length);
+    }
+    client->out_length += FRAME_HEADER_SIZE + length;
+    if (client->out_length - client->out_offset >= SEND_BATCH)
+    {
+        send_queued(client);
+    }
+    else
+    {
+        mark_due(client);
+    }
+    return client->state == BOARD_CLIENT_CLOSED ? -1 : 0;
+}
+
+int board_client_flush(BoardClient *client)
+{
+    send_queued(client);
+    return client->state == BOARD_CLIENT_CLOSED ? -1 : 0;
+}
+
+int board_client_hello(BoardClient *client, const char *username, uint8_t flags)
+{
+    unsigned char hello[2 + MAX_USERNAME];
+    size_t length = strlen(username) < MAX_USERNAME ? strlen(username) : MAX_USERNAME;
+
+    hello[0] = PROTOCOL_VERSION;
+    hello[1] = flags;
+    memcpy(hello + 2, username, length);
+    return board_client_send_frame(client, FRAME_HELLO, hello, 2 + length);
+}
+
+long board_client_send_draw(BoardClient *client, int x, int y, char symbol)
+{
+    unsigned char payload[DRAW_ID_SIZE];
+    BoardCanvas *canvas = &client->canvas;
+    int row, column;
+
+    put_u32(payload, x);
+    put_u32(payload + 4, y);
+    payload[8] = symbol;
+    if (!(client->flags & HELLO_FLAG_DRAW_ACK))
+    {
+        return board_client_send_frame(client, FRAME_DRAW, payload, 9);
+    }
+
+    uint32_t id = client->next_id++;
+    if (client->next_id == 0)
+    {
+        client->next_id = 1;
+    }
+    put_u32(payload + 9, id);
+    if (board_client_send_frame(client, FRAME_DRAW, payload, DRAW_ID_SIZE) < 0)
+    {
+        return -1;
+    }
+    // Show it now, if there is a canvas to show it on
+    if (canvas->width > 0 && client->predictions == NULL)
+    {
+        client->predictions = malloc(BOARD_MAX_PREDICTIONS * sizeof(BoardPrediction));
+    }
+    if (canvas->width > 0 && client->predictions != NULL && client->prediction_count < BOARD_MAX_PREDICTIONS)
+    {
+        BoardPrediction *prediction = &client->predictions[client->prediction_count++];
+        prediction->id = id;
+        prediction->draw.x = x;
+        prediction->draw.y = y;
+        prediction->draw.symbol = symbol;
+        prediction->acked = 0;
+        prediction->seq = 0;
+        prediction->covered = 0;
+        if (board_canvas_position(canvas, x, y, &row, &column))
+        {
+            canvas->cells[row * canvas->width + column] = symbol;
+        }
+    }
+    return id;
+}
+
+int board_client_send_batch(BoardClient *client, const BoardDraw *draws, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        if (board_client_send_draw(client, draws[i].x, draws[i].y, draws[i].symbol) < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int board_client_subscribe(BoardClient *client, int x, int y, int width, int height)
+{
+    BoardCanvas *canvas = &client->canvas;
+    unsigned char payload[16];
+
+    if (client->state == BOARD_CLIENT_CLOSED)
+    {
+        return -1;
+    }
+    if (width <= 0 || height <= 0)
+    {
+        free(canvas->cells);
+        free(canvas->confirmed);
+        memset(canvas, 0, sizeof(*canvas));
+        reconcile(client);
+        return board_client_send_frame(client, FRAME_VIEW, NULL, 0);
+    }
+    int moved = x != canvas->x || y != canvas->y;
+    if (width != canvas->width || height != canvas->height)
+    {
+        size_t size = (size_t)width * height;
+        char *cells = malloc(size);
+        char *confirmed = malloc(size);
+        if (cells == NULL || confirmed == NULL)
+        {
+            free(cells);
+            free(confirmed);
+            fail(client, ENOMEM);
+            return -1;
+        }
+        free(canvas->cells);
+        free(canvas->confirmed);
+        canvas->cells = cells;
+        canvas->confirmed = confirmed;
+        canvas->width = width;
+        canvas->height = height;
+        moved = 1;
+    }
+    if (moved)
+    {
+        // The REGION reply refills it
+        canvas->x = x;
+        canvas->y = y;
+        canvas->resyncing = 1;
+        memset(canvas->confirmed, ' ', (size_t)width * height);
+        reconcile(client);
+    }
+    put_u32(payload, x);
+    put_u32(payload + 4, y);
+    put_u32(payload + 8, width);
+    put_u32(payload + 12, height);
+    client->views_pending++;
+    return board_client_send_frame(client, FRAME_VIEW, payload, sizeof(payload));
+}
+
+int board_client_send_line(BoardClient *client, const char *line)
+{
+    return board_client_send_frame(client, line[0] == '/' ? FRAME_COMMAND : FRAME_CHAT, line, strlen(line));
+}
+
+/* Connections */
+
+BoardClient *board_client_connect(BoardLoop *loop, const struct sockaddr *address, socklen_t length)
+{
+    BoardClient *client = calloc(1, sizeof(BoardClient));
+    int one = 1;
+
+    if (client == NULL)
+    {
+        return NULL;
+    }
+    client->fd = socket(address->sa_family, SOCK_STREAM, 0);
+    if (client->fd < 0)
+    {
+        free(client);
+        return NULL;
+    }
+    fcntl(client->fd, F_SETFL, fcntl(client->fd, F_GETFL, 0) | O_NONBLOCK);
+    // Commands are batched here already
+    setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    client->loop = loop;
+    client->state = BOARD_CLIENT_CONNECTING;
+    client->next_id = 1;
+    client->next = loop->clients;
+    if (loop->clients != NULL)
+    {
+        loop->clients->prev = client;
+    }
+    loop->clients = client;
+    loop->client_count++;
+    update_interest(client, 1);
+    if (connect(client->fd, address, length) < 0 && errno != EINPROGRESS)
+    {
+        fail(client, errno); // Reported by the next poll like any other failure
+    }
+    return client;
+}
+
+void board_client_close(BoardClient *client)
+{
+    close_socket(client);
+    client->close_reported = 1;
+}
+
+void board_client_free(BoardClient *client)
+{
+    BoardLoop *loop = client->loop;
+
+    board_client_close(client);
+    for (BoardClient **link = &loop->due; *link != NULL; link = &(*link)->next_due)
+    {
+        if (*link == client)
+        {
+            *link = client->next_due;
+            break;
+        }
+    }
+    if (client->prev != NULL)
+    {
+        client->prev->next = client->next;
+    }
+    else
+    {
+        loop->clients = client->next;
+    }
+    if (client->next != NULL)
+    {
+        client->next->prev = client->prev;
+    }
+    loop->client_count--;
+    if (loop->polling)
+    {
+        // Events for it may still be waiting in this poll's batch
+        client->next = loop->graveyard;
+        loop->graveyard = client;
+        return;
+    }
+    free(client->in);
+    free(client->out);
+    free(client->predictions);
+    free(client->canvas.cells);
+    free(client->canvas.confirmed);
+    free(client);
+}
+
+/* Loop */
+
+BoardLoop *board_loop_create(BoardEventHandler handler, void *context)
+{
+    BoardLoop *loop = calloc(1, sizeof(BoardLoop));
+
+    if (loop == NULL)
+    {
+        return NULL;
+    }
+    loop->handler = handler;
+    loop->context = context;
+    for (int i = 0; i < BOARD_MAX_WATCHED; i++)
+    {
+        loop->watched[i] = -1;
+    }
+#ifdef __linux__
+    loop->epoll_fd = epoll_create1(0);
+    if (loop->epoll_fd < 0)
+    {
+        free(loop);
+        return NULL;
+    }
+#endif
+    return loop;
+}
+
+static void release_graveyard(BoardLoop *loop)
+{
+    while (loop->graveyard != NULL)
+    {
+        BoardClient *client = loop->graveyard;
+        loop->graveyard = client->next;
+        free(client->in);
+        free(client->out);
+        free(client->predictions);
+        free(client->canvas.cells);
+        free(client->canvas.confirmed);
+        free(client);
+    }
+}
+
+void board_loop_destroy(BoardLoop *loop)
+{
+    while (loop->clients != NULL)
+    {
+        board_client_free(loop->clients);
+    }
+    release_graveyard(loop);
+#ifdef __linux__
+    close(loop->epoll_fd);
+#else
+    free(loop->fds);
+    free(loop->fd_clients);
+#endif
+    free(loop->decoded);
+    free(loop);
+}
+
+int board_loop_watch(BoardLoop *loop, int fd)
+{
+    for (int i = 0; i < BOARD_MAX_WATCHED; i++)
+    {
+        if (loop->watched[i] < 0)
+        {
+#ifdef __linux__
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.ptr = &loop->watched[i];
+            if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+            {
+                if (errno != EPERM)
+                {
+                    return -1;
+                }
+                loop->always_ready[i] = 1;
+            }
+#endif
+            loop->watched[i] = fd;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void board_loop_unwatch(BoardLoop *loop, int fd)
+{
+    for (int i = 0; i < BOARD_MAX_WATCHED; i++)
+    {
+        if (loop->watched[i] == fd)
+        {
+#ifdef __linux__
+            if (!loop->always_ready[i])
+            {
+                epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            }
+#endif
+            loop->watched[i] = -1;
+            loop->always_ready[i] = 0;
+        }
+    }
+}
+
+// Send queued output and report closes
+static void service_due(BoardLoop *loop)
+{
+    while (loop->due != NULL)
+    {
+        BoardClient *client = loop->due;
+        loop->due = client->next_due;
+        client->due = 0;
+        if (client->state == BOARD_CLIENT_CLOSED && !client->close_reported)
+        {
+            BoardEvent event = {BOARD_EVENT_CLOSED, client, 0, NULL, 0, NULL, -1};
+            client->close_reported = 1;
+            report(loop, &event);
+        }
+        else
+        {
+            send_queued(client);
+        }
+    }
+}
+
+// The client's socket is ready
+static void client_ready(BoardClient *client, int readable, int writable, int failed)
+{
+    if (client->state == BOARD_CLIENT_CONNECTING)
+    {
+        int error = 0;
+        socklen_t size = sizeof(error);
+        if (!writable && !failed)
+        {
+            return;
+        }
+        if (getsockopt(client->fd, SOL_SOCKET, SO_ERROR, &error, &size) < 0)
+        {
+            error = errno;
+        }
+        if (error != 0 || failed)
+        {
+            fail(client, error != 0 ? error : ECONNREFUSED);
+            return;
+        }
+        BoardEvent event = {BOARD_EVENT_CONNECTED, client, 0, NULL, 0, NULL, -1};
+        client->state = BOARD_CLIENT_CONNECTED;
+        update_interest(client, 0);
+        report(client->loop, &event);
+        send_queued(client); // The HELLO and whatever else was queued meanwhile
+        return;
+    }
+    if (writable)
+    {
+        send_queued(client);
+    }
+    if (client->state == BOARD_CLIENT_CONNECTED && (readable || failed))
+    {
+        receive(client);
+    }
+}
+
+static void watched_ready(BoardLoop *loop, int fd)
+{
+    BoardEvent event = {BOARD_EVENT_READABLE, NULL, 0, NULL, 0, NULL, fd};
+    report(loop, &event);
+}
+
+int board_loop_poll_events(BoardLoop *loop, int timeout_ms)
+{
+    int count;
+
+    loop->events = 0;
+    loop->polling = 1;
+    service_due(loop);
+    if (loop->events > 0)
+    {
+        timeout_ms = 0; // Let the caller see those first
+    }
+
+#ifdef __linux__
+    struct epoll_event events[MAX_EVENTS];
+    for (int i = 0; i < BOARD_MAX_WATCHED; i++)
+    {
+        if (loop->watched[i] >= 0 && loop->always_ready[i])
+        {
+            timeout_ms = 0;
+        }
+    }
+    count = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, timeout_ms);
+    for (int i = 0; i < count; i++)
+    {
+        int *slot = (int *)events[i].data.ptr;
+        if (slot >= loop->watched && slot < loop->watched + BOARD_MAX_WATCHED)
+        {
+            if (*slot >= 0)
+            {
+                watched_ready(loop, *slot);
+            }
+            continue;
+        }
+        BoardClient *client = (BoardClient *)events[i].data.ptr;
+        if (client->state != BOARD_CLIENT_CLOSED)
+        {
+            client_ready(client, (events[i].events & EPOLLIN) != 0, (events[i].events & EPOLLOUT) != 0,
+                         (events[i].events & (EPOLLERR | EPOLLHUP)) != 0);
+        }
+    }
+    for (int i = 0; count >= 0 && i < BOARD_MAX_WATCHED; i++)
+    {
+        if (loop->watched[i] >= 0 && loop->always_ready[i])
+        {
+            watched_ready(loop, loop->watched[i]);
+        }
+    }
+#else
+    size_t needed = loop->client_count + BOARD_MAX_WATCHED;
+    nfds_t used = 0;
+    if (needed > loop->fds_capacity)
+    {
+        struct pollfd *fds = realloc(loop->fds, needed * sizeof(struct pollfd));
+        if (fds != NULL)
+        {
+            loop->fds = fds;
+        }
+        BoardClient **owners = realloc(loop->fd_clients, needed * sizeof(BoardClient *));
+        if (owners != NULL)
+        {
+            loop->fd_clients = owners;
+        }
+        if (fds == NULL || owners == NULL)
+        {
+            loop->polling = 0;
+            return -1;
+        }
+        loop->fds_capacity = needed;
+    }
+    for (BoardClient *client = loop->clients; client != NULL; client = client->next)
+    {
+        if (client->state == BOARD_CLIENT_CLOSED)
+        {
+            continue;
+        }
+        loop->fds[used].fd = client->fd;
+        loop->fds[used].events = client->state == BOARD_CLIENT_CONNECTING ? POLLOUT
+                                                                          : POLLIN | (client->want_write ? POLLOUT : 0);
+        loop->fd_clients[used++] = client;
+    }
+    for (int i = 0; i < BOARD_MAX_WATCHED; i++)
+    {
+        if (loop->watched[i] >= 0)
+        {
+            loop->fds[used].fd = loop->watched[i];
+            loop->fds[used].events = POLLIN;
+            loop->fd_clients[used++] = NULL;
+        }
+    }
+    count = poll(loop->fds, used, timeout_ms);
+    for (nfds_t i = 0; count > 0 && i < used; i++)
+    {
+        short revents = loop->fds[i].revents;
+        BoardClient *client = loop->fd_clients[i];
+        if (revents == 0)
+        {
+            continue;
+        }
+        if (client == NULL)
+        {
+            watched_ready(loop, loop->fds[i].fd);
+        }
+        else if (client->state != BOARD_CLIENT_CLOSED)
+        {
+            client_ready(client, (revents & POLLIN) != 0, (revents & POLLOUT) != 0,
+                         (revents & (POLLERR | POLLHUP | POLLNVAL)) != 0);
+        }
+    }
+#endif
+    if (count < 0 && errno != EINTR)
+    {
+        loop->polling = 0;
+        release_graveyard(loop);
+        return -1;
+    }
+
+    service_due(loop); // Replies the handler queued, and connections that broke
+    loop->polling = 0;
+    release_graveyard(loop);
+    return loop->events;
+}
@@ -0,0 +1,206 @@
+/*
+ * libboardclient: the client side of the binary protocol (board_protocol.h)
+ * without any terminal I/O, for client_good.c, bots and the load tools
+ *
+ * A BoardLoop drives any number of connections on the thread that calls
+ * board_loop_poll_events(); nothing in it blocks and there is no global
+ * state, so a program may run one loop per thread. Connections are opened
+ * with board_client_connect() and everything sent is queued and goes out
+ * when the loop next polls, several commands in one send().
+ *
+ *     BoardLoop *loop = board_loop_create(on_event, NULL);
+ *     BoardClient *client = board_client_connect(loop, (struct sockaddr *)&address, sizeof(address));
+ *     board_client_hello(client, "bot", HELLO_FLAG_RLE | HELLO_FLAG_DRAW_ACK);
+ *     board_client_subscribe(client, 0, 0, 81, 21);
+ *     board_client_send_draw(client, 5, 5, '#');
+ *     while (board_loop_poll_events(loop, -1) >= 0)
+ *         ;
+ *
+ * Every frame from the server is reported to the loop's handler, after the
+ * library has applied it to the connection's canvas. The canvas exists once
+ * the client subscribes to an area of the board: it then holds that area as
+ * the server last described it, plus the draws still waiting for their
+ * DRAW_ACK (see HELLO_FLAG_DRAW_ACK), which are shown right away and dropped
+ * or rolled back as the acks and board updates arrive.
+ *
+ * Other descriptors, such as a terminal or a timer, can wait in the same
+ * poll with board_loop_watch().
+ *
+ * Build: add board_client.c to the program, e.g.
+ *     gcc -O2 client_good.c board_client.c -o client_good
+ */
+
+#ifndef BOARD_CLIENT_H
+#define BOARD_CLIENT_H
+
+#include <sys/socket.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "board_protocol.h"
+
+#define BOARD_MAX_PREDICTIONS 256 // Draws beyond this many unanswered ones only show once the server has them
+#define BOARD_MAX_WATCHED 8
+
+typedef enum
+{
+    BOARD_CLIENT_CONNECTING,
+    BOARD_CLIENT_CONNECTED,
+    BOARD_CLIENT_CLOSED
+} BoardClientState;
+
+typedef enum
+{
+    BOARD_EVENT_CONNECTED, // The connection is up; anything queued is on its way
+    BOARD_EVENT_FRAME,     // A frame from the server, already applied to the canvas
+    BOARD_EVENT_CLOSED,    // Connecting failed, the server hung up or the connection broke
+    BOARD_EVENT_READABLE   // A descriptor added with board_loop_watch() is ready
+} BoardEventType;
+
+// One cell to draw
+typedef struct
+{
+    int x;
+    int y;
+    char symbol;
+} BoardDraw;
+
+/*
+ * The area a client subscribed to. cells is what to show: the confirmed
+ * cells with the pending draws on top. Both grids are width * height cells,
+ * top row first, 0 or ' ' where nothing was drawn.
+ */
+typedef struct
+{
+    int x;       // Board coordinates of the bottom-left cell
+    int y;
+    int width;   // 0 until board_client_subscribe()
+    int height;
+    char *cells;
+    char *confirmed;
+    uint64_t seq;  // Board update the confirmed cells reflect; deltas outside the area are skipped, so it may jump
+    int resyncing; // The area moved and its REGION has not arrived yet
+} BoardCanvas;
+
+// A draw shown before the server has answered
+typedef struct
+{
+    uint32_t id;  // Sent with the DRAW, echoed by its DRAW_ACK
+    BoardDraw draw;
+    int acked;
+    uint64_t seq; // From the DRAW_ACK: the draw is in the first board update from this one on that covers its cell
+    int covered;  // Such an update has been applied
+} BoardPrediction;
+
+typedef struct BoardLoop BoardLoop;
+
+// The fields are for reading; only board_client.c changes them
+typedef struct BoardClient
+{
+    BoardLoop *loop;
+    int fd;
+    BoardClientState state;
+    int error;          // errno behind BOARD_EVENT_CLOSED, 0 if the server hung up
+    uint8_t flags;      // HELLO_FLAG_* the server agreed to
+    int board_width;    // From the HELLO_ACK, 0 before it
+    int board_height;
+    int views_pending;  // VIEW requests not yet answered with a REGION
+    uint64_t bytes_received;
+    void *user;         // Free for the caller
+
+    BoardCanvas canvas;
+    BoardPrediction *predictions; // Allocated with the first numbered draw
+    int prediction_count;
+    uint32_t next_id;
+
+    unsigned char *in;
+    size_t in_start; // First byte not yet handled
+    size_t in_end;   // One past the last byte received
+    size_t in_capacity;
+    unsigned char *out;
+    size_t out_offset; // First byte not yet sent
+    size_t out_length;
+    size_t out_capacity;
+    int want_write;    // Waiting for room in the socket
+
+    struct BoardClient *next;     // All of the loop's clients
+    struct BoardClient *prev;
+    struct BoardClient *next_due; // Clients with output queued or a close to report
+    int due;
+    int close_reported;
+} BoardClient;
+
+typedef struct
+{
+    BoardEventType type;
+    BoardClient *client;          // NULL for BOARD_EVENT_READABLE
+    uint8_t frame;                // BOARD_EVENT_FRAME: its FRAME_* type
+    const unsigned char *payload; // and payload, valid until the handler returns
+    uint32_t length;
+    const BoardDraw *draw;        // FRAME_DRAW_ACK: the draw it answers, NULL if unknown
+    int fd;                       // BOARD_EVENT_READABLE
+} BoardEvent;
+
+typedef void (*BoardEventHandler)(const BoardEvent *event, void *context);
+
+// A loop whose events go to handler; NULL if out of memory or descriptors
+BoardLoop *board_loop_create(BoardEventHandler handler, void *context);
+
+// Close every connection and free the loop with all of its clients
+void board_loop_destroy(BoardLoop *loop);
+
+/*
+ * Send what is queued, wait up to timeout_ms (-1: no limit) for the
+ * connections and watched descriptors, and hand every resulting event to
+ * the handler. Returns the number of events, or -1 if waiting failed.
+ */
+int board_loop_poll_events(BoardLoop *loop, int timeout_ms);
+
+// Report BOARD_EVENT_READABLE whenever fd has input; -1 if too many are watched
+int board_loop_watch(BoardLoop *loop, int fd);
+void board_loop_unwatch(BoardLoop *loop, int fd);
+
+// Start connecting; failure shows up as BOARD_EVENT_CLOSED. NULL if no socket could be made.
+BoardClient *board_client_connect(BoardLoop *loop, const struct sockaddr *address, socklen_t length);
+
+// Close the connection without a BOARD_EVENT_CLOSED; the client stays readable until freed
+void board_client_close(BoardClient *client);
+
+// Close and free a client, also from the handler
+void board_client_free(BoardClient *client);
+
+/*
+ * Everything below only queues frames; they go out at the next poll, or
+ * right away with board_client_flush(). Each returns -1 if the client is
+ * closed or the frame could not be queued (the connection is then closed
+ * and reported), otherwise 0.
+ */
+
+// Join with a username (at most 14 bytes are used) and the HELLO_FLAG_* to ask for
+int board_client_hello(BoardClient *client, const char *username, uint8_t flags);
+
+// Draw one cell. Returns its id if the server will answer with a DRAW_ACK, 0 if it answers with text.
+long board_client_send_draw(BoardClient *client, int x, int y, char symbol);
+
+// Draw several cells in one go, in order
+int board_client_send_batch(BoardClient *client, const BoardDraw *draws, size_t count);
+
+/*
+ * Receive only the changes inside width x height cells from x, y, and keep
+ * them in client->canvas. The REGION answering it refills the canvas. A
+ * width or height of 0 ends the subscription and drops the canvas.
+ */
+int board_client_subscribe(BoardClient *client, int x, int y, int width, int height);
+
+// A text line: chat, or a command when it starts with '/'
+int board_client_send_line(BoardClient *client, const char *line);
+
+// Any frame, for commands without a helper
+int board_client_send_frame(BoardClient *client, uint8_t type, const void *payload, uint32_t length);
+
+// Send what is queued now, as far as the socket takes it; the rest goes out as it drains
+int board_client_flush(BoardClient *client);
+
+// Where board cell x, y sits in the canvas; 0 if it is outside, and row and column are left alone
+int board_canvas_position(const BoardCanvas *canvas, int x, int y, int *row, int *column);
+
+#endif
@@ -0,0 +1,99 @@
+/*
+ * Print the board kept in a server_good.c board file (-m) without talking
+ * to the server
+ *
+ * Maps the file read-only and prints [w]x[h] cells starting at (x, y), top
+ * row first like /show, followed by the sequence number it reflects. The
+ * defaults cover the bottom-left corner that clients see first.
+ *
+ * Build: gcc -O2 board_dump.c -o board_dump
+ * Usage: ./board_dump <board file> [x y w h]
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "board_map.h"
+
+#define DEFAULT_VIEW_WIDTH 81
+#define DEFAULT_VIEW_HEIGHT 21
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2 && argc != 6)
+    {
+        fprintf(stderr, "USAGE: %s <board file> [x y w h]\n", argv[0]);
+        exit(1);
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) < 0 || (size_t)info.st_size < sizeof(BoardMapHeader))
+    {
+        fprintf(stderr, "Cannot open board file %s\n", argv[1]);
+        exit(1);
+    }
+    unsigned char *map = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        perror(argv[1]);
+        exit(1);
+    }
+
+    const BoardMapHeader *header = (const BoardMapHeader *)map;
+    uint64_t tile_count = (uint64_t)header->tiles_across * header->tiles_down;
+    if (memcmp(header->magic, BOARD_MAP_MAGIC, 4) != 0 || header->version != BOARD_MAP_VERSION ||
+        header->tile_size != BOARD_MAP_TILE || (uint64_t)info.st_size != board_map_size(tile_count))
+    {
+        fprintf(stderr, "%s is not a board file\n", argv[1]);
+        exit(1);
+    }
+
+    int width = header->width;
+    int height = header->height;
+    int x = 0, y = 0;
+    int w = width < DEFAULT_VIEW_WIDTH ? width : DEFAULT_VIEW_WIDTH;
+    int h = height < DEFAULT_VIEW_HEIGHT ? height : DEFAULT_VIEW_HEIGHT;
+    if (argc == 6)
+    {
+        x = atoi(argv[2]);
+        y = atoi(argv[3]);
+        w = atoi(argv[4]);
+        h = atoi(argv[5]);
+        if (x < 0 || y < 0 || w < 1 || h < 1 || w > width - x || h > height - y)
+        {
+            fprintf(stderr, "The area must lie within the %dx%d board\n", width, height);
+            exit(1);
+        }
+    }
+
+    const unsigned char *present = map + BOARD_MAP_PAGE;
+    const char *cells = (const char *)map + header->data_offset;
+    char *line = malloc(w + 1);
+    uint64_t seq = atomic_load(&((BoardMapHeader *)map)->seq);
+    for (int row = y + h - 1; row >= y; row--)
+    {
+        for (int i = 0; i < w; i++)
+        {
+            int cx = x + i;
+            size_t tile = (size_t)(row / BOARD_MAP_TILE) * header->tiles_across + cx / BOARD_MAP_TILE;
+            // Reading a hole would only return zeros, but skipping it keeps the file sparse in the page cache
+            char cell = present[tile] ? cells[tile * BOARD_MAP_TILE_BYTES + (row % BOARD_MAP_TILE) * BOARD_MAP_TILE +
+                                              cx % BOARD_MAP_TILE]
+                                      : 0;
+            line[i] = cell == 0 ? ' ' : cell;
+        }
+        line[w] = '\0';
+        printf("%s\n", line);
+    }
+    printf("seq %llu, %dx%d board\n", (unsigned long long)seq, width, height);
+
+    free(line);
+    munmap(map, info.st_size);
+    return 0;
+}
@@ -0,0 +1,58 @@
+/*
+ * Memory-mapped board file kept by `server_good -m <file>`
+ *
+ * The server's tiles live directly in this file, so a restarted server maps
+ * it and carries on without loading anything, and other programs can map
+ * it read-only to look at the live board (see board_dump.c).
+ *
+ * Layout, in the byte order of the machine that wrote it:
+ *
+ *     BoardMapHeader                 at 0, padded to BOARD_MAP_PAGE
+ *     u8 present[tiles_across * tiles_down]   1 once a tile has been written
+ *     tile cells                     at data_offset, BOARD_MAP_TILE_BYTES per
+ *                                    tile in row major tile order; each tile
+ *                                    is tile_size rows of tile_size cells
+ *
+ * A cell is 0 when empty. Tiles that were never drawn in stay holes in the
+ * sparse file. seq is the sequence number of the last change; readers can
+ * compare it before and after a read to notice concurrent updates.
+ */
+
+#ifndef BOARD_MAP_H
+#define BOARD_MAP_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BOARD_MAP_MAGIC "BMAP"
+#define BOARD_MAP_VERSION 1
+#define BOARD_MAP_PAGE 4096
+#define BOARD_MAP_TILE 64
+#define BOARD_MAP_TILE_BYTES (BOARD_MAP_TILE * BOARD_MAP_TILE)
+
+typedef struct
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t tile_size;
+    uint32_t tiles_across;
+    uint32_t tiles_down;
+    uint32_t reserved;
+    uint64_t data_offset;
+    _Atomic uint64_t seq;
+} BoardMapHeader;
+
+static inline uint64_t board_map_data_offset(uint64_t tile_count)
+{
+    return (BOARD_MAP_PAGE + tile_count + BOARD_MAP_PAGE - 1) / BOARD_MAP_PAGE * BOARD_MAP_PAGE;
+}
+
+static inline uint64_t board_map_size(uint64_t tile_count)
+{
+    return board_map_data_offset(tile_count) + tile_count * BOARD_MAP_TILE_BYTES;
+}
+
+#endif
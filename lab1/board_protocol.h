@@ -0,0 +1,251 @@
+/*
+ * Binary wire protocol shared by server_good.c and client_good.c
+ *
+ * Every frame is a 5 byte header followed by the payload:
+ *
+ *     u8  type
+ *     u32 payload length (big endian)
+ *
+ * A binary client opens the connection with a FRAME_HELLO. Its type byte is
+ * never printable, so the server can tell binary clients from telnet users by
+ * the very first byte and keeps accepting plain text commands from the latter.
+ *
+ * Payloads (all integers big endian):
+ *   HELLO     c->s  u8 version, u8 flags (HELLO_FLAG_*), username
+ *   HELLO_ACK s->c  u8 version, u8 flags the server agreed to, u32 board width, u32 board height
+ *   DRAW      c->s  u32 x, u32 y, u8 symbol[, u32 id]; with an id (HELLO_FLAG_DRAW_ACK)
+ *                   the reply is a DRAW_ACK instead of text
+ *   SHOW      c->s  (empty) for the whole board, or u32 x, u32 y, u32 w, u32 h for a viewport
+ *   RESET     c->s  (empty)
+ *   CHAT      both  text ("user: text" when sent by the server)
+ *   COMMAND   c->s  any other text command line, e.g. "/help"
+ *   VIEW      c->s  u32 x, u32 y, u32 w, u32 h: only send changes in this area
+ *                   (answered with its REGION); empty to get every change again
+ *   TEXT      s->c  server replies and notices
+ *   SNAPSHOT  s->c  u64 seq, u32 width, u32 height, width*height cells, top row first
+ *   DELTA     s->c  u64 seq, u16 runs, then per run u32 x, u32 y, u16 len, len cells
+ *   REGION    s->c  u64 seq, u32 x, u32 y, u32 w, u32 h, w*h cells, top row first
+ *   CLEAR     s->c  u64 seq; the board was reset and is too big to resend
+ *   SNAPSHOT_RLE s->c  SNAPSHOT header, then the cells run-length encoded
+ *   REGION_RLE   s->c  REGION header, then the cells run-length encoded
+ *   DRAW_ACK  s->c  u32 id, u8 status (DRAW_ACK_*), u64 seq: the draw goes out
+ *                   under this seq or a later one; the first update from
+ *                   this seq on that covers its cell includes it
+ *
+ * The _RLE frames replace SNAPSHOT and REGION for clients whose HELLO set
+ * HELLO_FLAG_RLE. Boards are mostly empty cells, so a join or /show shrinks
+ * from width*height bytes to a few hundred. Encoding (PackBits with a long
+ * run escape), repeated until the cell count is reached:
+ *
+ *     0x00-0x7F  n + 1 literal cells follow
+ *     0x80-0xFE  the next cell repeated n - 0x80 + 3 times
+ *     0xFF       u32 count, then the cell repeated count times
+ *
+ * Boards larger than one frame never get a SNAPSHOT; clients ask for the
+ * part they display with a SHOW viewport and receive a REGION.
+ *
+ * A client with a VIEW only receives the DELTAs that touch it, so gaps in
+ * its sequence numbers are expected and do not mean anything was lost.
+ *
+ * HELLO_FLAG_DRAW_ACK lets a client show its draws before the server has
+ * seen them: it numbers each DRAW, and the DRAW_ACK tells it whether the
+ * draw stood and from which update on to look for it. The seq is a lower
+ * bound: a tick that changes several parts of the board goes out as one
+ * DELTA per part, each with its own seq, so an update with that seq or a
+ * later one may still be about some other part.
+ */
+
+#ifndef BOARD_PROTOCOL_H
+#define BOARD_PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PROTOCOL_VERSION 1
+#define PROTOCOL_MIN_VERSION 1
+
+#define FRAME_HEADER_SIZE 5
+#define MAX_FRAME_PAYLOAD (1 << 20)
+
+#define FRAME_DRAW 0x01
+#define FRAME_SHOW 0x02
+#define FRAME_RESET 0x03
+#define FRAME_CHAT 0x04
+#define FRAME_COMMAND 0x05
+#define FRAME_VIEW 0x06
+#define FRAME_TEXT 0x10
+#define FRAME_SNAPSHOT 0x11
+#define FRAME_DELTA 0x12
+#define FRAME_REGION 0x13
+#define FRAME_CLEAR 0x14
+#define FRAME_SNAPSHOT_RLE 0x15
+#define FRAME_REGION_RLE 0x16
+#define FRAME_DRAW_ACK 0x17
+#define FRAME_HELLO 0xB0
+#define FRAME_HELLO_ACK 0xB1
+
+#define SNAPSHOT_HEADER_SIZE 16 // seq, width, height
+#define DELTA_HEADER_SIZE 10    // seq, run count
+#define DELTA_RUN_HEADER_SIZE 10 // x, y, len
+#define REGION_HEADER_SIZE 24    // seq, x, y, width, height
+#define HELLO_ACK_SIZE 10        // version, flags, width, height
+#define DRAW_ID_SIZE 13          // DRAW with an id: x, y, symbol, id
+#define DRAW_ACK_SIZE 13         // id, status, seq
+
+#define HELLO_FLAG_RLE 0x01 // Client decodes SNAPSHOT_RLE and REGION_RLE
+#define HELLO_FLAG_DRAW_ACK 0x02 // Client numbers its DRAWs and wants DRAW_ACKs
+
+#define DRAW_ACK_APPLIED 0
+#define DRAW_ACK_REJECTED 1 // Outside the board, or the symbol is not a printable character
+
+#define RLE_MIN_RUN 3
+#define RLE_SHORT_RUN (0xFE - 0x80 + RLE_MIN_RUN) // Longest run with a one byte header
+#define RLE_MAX_LITERAL 128
+// Largest encoding of n cells: all literals
+#define rle_bound(n) ((n) + ((n) + RLE_MAX_LITERAL - 1) / RLE_MAX_LITERAL)
+
+static inline void put_u16(unsigned char *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static inline void put_u32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static inline void put_u64(unsigned char *p, uint64_t v)
+{
+    put_u32(p, v >> 32);
+    put_u32(p + 4, (uint32_t)v);
+}
+
+static inline uint16_t get_u16(const unsigned char *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline uint32_t get_u32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline uint64_t get_u64(const unsigned char *p)
+{
+    return (uint64_t)get_u32(p) << 32 | get_u32(p + 4);
+}
+
+// Write a frame header; the payload follows at p + FRAME_HEADER_SIZE
+static inline void put_frame_header(unsigned char *p, uint8_t type, uint32_t length)
+{
+    p[0] = type;
+    put_u32(p + 1, length);
+}
+
+// Run-length encode count cells into out, which holds rle_bound(count) bytes; returns the encoded length
+static inline size_t rle_encode(unsigned char *out, const unsigned char *cells, size_t count)
+{
+    size_t length = 0, i = 0, literal_start = 0;
+
+    while (i <= count)
+    {
+        size_t run = 1;
+        while (i < count && i + run < count && cells[i + run] == cells[i])
+        {
+            run++;
+        }
+        // Flush pending literals before a run worth encoding, and at the end
+        if (i == count || run >= RLE_MIN_RUN)
+        {
+            while (literal_start < i)
+            {
+                size_t n = i - literal_start < RLE_MAX_LITERAL ? i - literal_start : RLE_MAX_LITERAL;
+                out[length++] = (unsigned char)(n - 1);
+                for (size_t k = 0; k < n; k++)
+                {
+                    out[length++] = cells[literal_start + k];
+                }
+                literal_start += n;
+            }
+        }
+        if (i == count)
+        {
+            break;
+        }
+        if (run >= RLE_MIN_RUN)
+        {
+            if (run <= RLE_SHORT_RUN)
+            {
+                out[length++] = (unsigned char)(0x80 + run - RLE_MIN_RUN);
+            }
+            else
+            {
+                out[length++] = 0xFF;
+                put_u32(out + length, (uint32_t)run);
+                length += 4;
+            }
+            out[length++] = cells[i];
+            i += run;
+            literal_start = i;
+        }
+        else
+        {
+            i += run;
+        }
+    }
+    return length;
+}
+
+// Decode exactly count cells; returns 0, or -1 if the input is malformed or the wrong size
+static inline int rle_decode(unsigned char *cells, size_t count, const unsigned char *in, size_t length)
+{
+    size_t filled = 0, offset = 0;
+
+    while (offset < length)
+    {
+        unsigned char control = in[offset++];
+        size_t n;
+        if (control < 0x80)
+        {
+            n = (size_t)control + 1;
+            if (n > length - offset || n > count - filled)
+            {
+                return -1;
+            }
+            for (size_t k = 0; k < n; k++)
+            {
+                cells[filled++] = in[offset++];
+            }
+            continue;
+        }
+        if (control == 0xFF)
+        {
+            if (length - offset < 4)
+            {
+                return -1;
+            }
+            n = get_u32(in + offset);
+            offset += 4;
+        }
+        else
+        {
+            n = (size_t)control - 0x80 + RLE_MIN_RUN;
+        }
+        if (offset >= length || n > count - filled)
+        {
+            return -1;
+        }
+        for (size_t k = 0; k < n; k++)
+        {
+            cells[filled++] = in[offset];
+        }
+        offset++;
+    }
+    return filled == count ? 0 : -1;
+}
+
+#endif
@@ -1,57 +1,211 @@
 // fix the client.c file so that the board is 80 in x and 20 in y and the commands first take x, not y
 
-#ifdef _WIN32
-#include <winsock2.h>
-#else
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <sys/select.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/timerfd.h>
 #endif
+#include <errno.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include "board_client.h"
 
 #define BUFFER_SIZE 4096
+#define REDRAW_DELAY_MS 30 // Board frames arriving this close together get one redraw
+#define RENDER_BUFFER_SIZE 32768 // Fits a redraw that changes every cell
+#define SCREEN_STATUS_ROW 1
+#define SCREEN_GRID_ROW 3 // Terminal row of the top grid row, inside a border
+#define SCREEN_MESSAGES_ROW (SCREEN_GRID_ROW + CANVAS_HEIGHT + 1) // First row of the scrolling message area
 #define CANVAS_WIDTH 81
 #define CANVAS_HEIGHT 21
 #define MAX_USERNAME_LENGTH 15
 
-// Structure to represent the local drawing canvas
+// The connection, its canvas (the CANVAS_WIDTH x CANVAS_HEIGHT view onto a
+// board that may be much larger) and the draws shown before the server has them
+BoardLoop *loop;
+BoardClient *server;
+int script_mode = 0;    // --script: no prompts or screen redraws, commands go out as fast as they are read
+int running = 1;
+int connected = 0;
+
+// Input is read in chunks and split into lines here
+typedef struct
+{
+    int fd;                 // stdin or the --script file
+    char line[BUFFER_SIZE]; // The line being assembled
+    size_t length;
+    int have_username;      // The first line is the username, as in an interactive session
+    int open;               // Watched by the loop; 0 after the end of input
+    int paused;             // Not read while the server is slow to take what was sent
+} InputReader;
+
+InputReader input;
+
+/*
+ * The screen: a status line and the bordered canvas at the top, and below
+ * them a scrolling region where messages and the prompt are printed as
+ * before. The renderer keeps a front copy of what the terminal shows and
+ * compares the canvas cells (the back copy) against it, so a redraw only moves
+ * the cursor to the cells that changed. All of it goes out in one write().
+ */
 typedef struct
 {
-    char grid[CANVAS_HEIGHT][CANVAS_WIDTH];
-} Canvas;
+    char front[CANVAS_HEIGHT][CANVAS_WIDTH]; // Cells as the terminal shows them
+    char status[128];                        // and the status line
+    int valid;                               // 0: the next redraw repaints everything
+    char out[RENDER_BUFFER_SIZE];            // The redraw being built
+    size_t length;
+} Renderer;
+
+Renderer renderer;
+
+// The redraw timer: a timerfd on Linux, otherwise a deadline that bounds the poll() timeout
+int redraw_timer_fd = -1;
+long long redraw_deadline = -1; // Monotonic milliseconds, -1 when not armed
+
+void render_append(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(renderer.out + renderer.length, sizeof(renderer.out) - renderer.length, format, args);
+    va_end(args);
+    if (written > 0)
+    {
+        renderer.length += (size_t)written < sizeof(renderer.out) - renderer.length ? (size_t)written
+                                                                                     : sizeof(renderer.out) - renderer.length - 1;
+    }
+}
+
+int terminal_rows()
+{
+    struct winsize size;
+    if (ioctl(1, TIOCGWINSZ, &size) == 0 && size.ws_row > SCREEN_MESSAGES_ROW)
+    {
+        return size.ws_row;
+    }
+    return SCREEN_MESSAGES_ROW + 20;
+}
+
+// Give the whole terminal back to ordinary scrolling output
+void render_finish()
+{
+    char reset[32];
+    int length = snprintf(reset, sizeof(reset), "\x1b[r\x1b[%d;1H\n", terminal_rows());
+    fflush(stdout);
+    if (write(1, reset, length) < 0)
+    {
+        return; // Nothing left to do about it at exit
+    }
+}
 
-Canvas canvas;
-int s_socket;           // Server socket
-int should_display = 0; // Flag to control board display
+// What a board cell looks like on the terminal
+char screen_cell(char cell)
+{
+    if (cell == 0)
+    {
+        return ' ';
+    }
+    return (unsigned char)cell < 32 || cell == 127 ? '?' : cell;
+}
 
-// Initialize the canvas with spaces
-void init_canvas()
+// Bring the terminal in line with the canvas
+void render_canvas()
 {
-    for (int y = 0; y < CANVAS_HEIGHT; y++)
+    static int finish_registered = 0;
+    const BoardCanvas *canvas = &server->canvas;
+    char status[sizeof(renderer.status)];
+    int cursor_row = -1, cursor_column = -1;
+
+    snprintf(status, sizeof(status), "Board %dx%d, view at %d %d, update %llu%s", server->board_width,
+             server->board_height, canvas->x, canvas->y, (unsigned long long)canvas->seq,
+             canvas->resyncing ? " (loading)" : "");
+    renderer.length = 0;
+    if (!renderer.valid)
     {
+        // Clear everything, draw the border and leave the rows below it to scroll
+        render_append("\x1b[r\x1b[2J\x1b[%d;1H+", SCREEN_GRID_ROW - 1);
         for (int x = 0; x < CANVAS_WIDTH; x++)
         {
-            canvas.grid[y][x] = ' ';
+            render_append("-");
         }
+        render_append("+");
+        for (int row = 0; row < CANVAS_HEIGHT; row++)
+        {
+            render_append("\x1b[%d;1H|\x1b[%d;%dH|", SCREEN_GRID_ROW + row, SCREEN_GRID_ROW + row, CANVAS_WIDTH + 2);
+        }
+        render_append("\x1b[%d;1H+", SCREEN_GRID_ROW + CANVAS_HEIGHT);
+        for (int x = 0; x < CANVAS_WIDTH; x++)
+        {
+            render_append("-");
+        }
+        render_append("+\x1b[%d;%dr\x1b[%d;1H", SCREEN_MESSAGES_ROW, terminal_rows(), SCREEN_MESSAGES_ROW);
+        memset(renderer.front, 0, sizeof(renderer.front)); // Never a screen cell, so every cell is drawn
+        renderer.status[0] = '\0';
+        if (!finish_registered)
+        {
+            atexit(render_finish);
+            finish_registered = 1;
+        }
+    }
+
+    render_append("\x1b" "7"); // Save the cursor, which belongs to the message area
+    for (int row = 0; row < CANVAS_HEIGHT; row++)
+    {
+        for (int x = 0; x < CANVAS_WIDTH; x++)
+        {
+            char cell = screen_cell(canvas->width == CANVAS_WIDTH ? canvas->cells[row * CANVAS_WIDTH + x] : ' ');
+            if (cell == renderer.front[row][x])
+            {
+                continue;
+            }
+            if (cursor_row != row || cursor_column != x)
+            {
+                render_append("\x1b[%d;%dH", SCREEN_GRID_ROW + row, x + 2);
+            }
+            render_append("%c", cell);
+            renderer.front[row][x] = cell;
+            cursor_row = row;
+            cursor_column = x + 1;
+        }
+    }
+    if (strcmp(status, renderer.status) != 0)
+    {
+        render_append("\x1b[%d;1H\x1b[2K%s", SCREEN_STATUS_ROW, status);
+        strcpy(renderer.status, status);
     }
+    render_append("\x1b" "8");
+
+    // Messages printed through stdio must reach the terminal first
+    fflush(stdout);
+    if (write(1, renderer.out, renderer.length) < 0)
+    {
+        perror("write");
+    }
+    renderer.valid = 1;
 }
 
+// Repaint the screen and list the commands in the message area
 void client_info_display()
 {
-#ifdef _WIN32
-    system("cls");
-#else
-    system("clear");
-#endif
+    renderer.valid = 0;
+    render_canvas();
 
     printf("\nCommands: /draw x y symbol (e.g., '/draw 5 10 #' to draw)\n");
-    printf("         /show (show board)\n");
+    printf("         /drawmany symbol x y [x y ...] (draw several cells at once)\n");
+    printf("         /line x0 y0 x1 y1 symbol, /rect x0 y0 x1 y1 symbol [filled]\n");
+    printf("         /fill x y symbol (flood fill the region at x y)\n");
+    printf("         /show [x y] (show board, or move the view to x y)\n");
+    printf("         /undo, /redo (revert or restore your last command)\n");
+    printf("         /history [seq [x y w h]] (show the board as it was at update seq)\n");
+    printf("         /stats (server counters and command latencies)\n");
     printf("         /reset (reset board)\n");
     printf("         /help (show commands)\n");
     printf("         /exit (to exit)\n");
@@ -59,91 +213,389 @@ void client_info_display()
     fflush(stdout);
 }
 
+long long monotonic_millis()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Redraw the screen REDRAW_DELAY_MS from now unless a redraw is already due
+void schedule_redraw()
+{
+    if (redraw_deadline >= 0)
+    {
+        return;
+    }
+    redraw_deadline = monotonic_millis() + REDRAW_DELAY_MS;
+#ifdef __linux__
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_nsec = REDRAW_DELAY_MS * 1000000L;
+    timerfd_settime(redraw_timer_fd, 0, &spec, NULL);
+#endif
+}
+
+// poll() timeout: none with a timerfd, which wakes poll() itself
+int redraw_timeout()
+{
+#ifdef __linux__
+    return -1;
+#else
+    if (redraw_deadline < 0)
+    {
+        return -1;
+    }
+    long long remaining = redraw_deadline - monotonic_millis();
+    return remaining > 0 ? (int)remaining : 0;
+#endif
+}
+
+void redraw_if_due()
+{
+#ifdef __linux__
+    uint64_t expirations;
+    if (read(redraw_timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+    {
+        return;
+    }
+#else
+    if (redraw_deadline < 0 || monotonic_millis() < redraw_deadline)
+    {
+        return;
+    }
+#endif
+    redraw_deadline = -1;
+    if (renderer.valid)
+    {
+        render_canvas();
+    }
+}
+
+void prompt()
+{
+    if (!script_mode)
+    {
+        printf("Enter command: ");
+        fflush(stdout);
+    }
+}
 
 
-// Update the local canvas based on server update
-void update_local_canvas(char *board_string)
+
+// Subscribe to the view at x, y: the server answers with its cells and from
+// then on only sends the changes that touch it
+void request_viewport(int x, int y)
 {
-    int index = 0;
-    for (int y = 0; y < CANVAS_HEIGHT; y++)
+    board_client_subscribe(server, x, y, CANVAS_WIDTH, CANVAS_HEIGHT);
+}
+
+// Send a command to the server, using dedicated frames for the common ones
+void send_command_to_server(char *command)
+{
+    int x, y;
+    char symbol;
+    int consumed = 0;
+
+    if (sscanf(command, "/draw %d %d %c%n", &x, &y, &symbol, &consumed) == 3 && command[consumed] == '\0')
     {
-        for (int x = 0; x < CANVAS_WIDTH; x++)
+        // With DRAW_ACKs it is on the canvas already: show it now, not a round trip later
+        if (board_client_send_draw(server, x, y, symbol) > 0 && renderer.valid)
         {
-            if (index < strlen(board_string))
+            render_canvas();
+        }
+    }
+    else if (strcmp(command, "/show") == 0)
+    {
+        request_viewport(server->canvas.x, server->canvas.y);
+    }
+    else if (sscanf(command, "/show %d %d%n", &x, &y, &consumed) == 2 && command[consumed] == '\0')
+    {
+        request_viewport(x, y); // Move the view; the canvas is refilled by the REGION reply
+    }
+    else if (strcmp(command, "/reset") == 0)
+    {
+        board_client_send_frame(server, FRAME_RESET, NULL, 0);
+    }
+    else
+    {
+        board_client_send_line(server, command);
+    }
+    if (!script_mode)
+    {
+        printf("\nClient sent: %s\n", command);
+    }
+}
+
+// React to one complete frame from the server; the library has applied it to the canvas already
+void handle_frame(uint8_t type, const unsigned char *payload, uint32_t length, const BoardDraw *draw)
+{
+    switch (type)
+    {
+    case FRAME_HELLO_ACK:
+        if (length >= 1)
+        {
+            printf("Using protocol version %d\n", payload[0]);
+        }
+        if (length >= HELLO_ACK_SIZE)
+        {
+            printf("Board is %d x %d\n", server->board_width, server->board_height);
+        }
+        if (!script_mode)
+        {
+            schedule_redraw();
+        }
+        break;
+    case FRAME_SNAPSHOT:
+    case FRAME_SNAPSHOT_RLE:
+    case FRAME_REGION:
+    case FRAME_REGION_RLE:
+    case FRAME_DELTA:
+    case FRAME_CLEAR:
+    case FRAME_DRAW_ACK:
+        if (type == FRAME_DRAW_ACK && draw != NULL && length >= DRAW_ACK_SIZE && payload[4] == DRAW_ACK_REJECTED)
+        {
+            printf("\nDraw at %d %d was rejected.\n", draw->x, draw->y);
+            prompt();
+        }
+        if (!script_mode)
+        {
+            schedule_redraw();
+        }
+        break;
+    case FRAME_TEXT:
+    case FRAME_CHAT:
+        printf("\nServer says:\n %.*s\n", (int)length, payload); // Print other messages from the server
+        prompt();
+        break;
+    default:
+        break;
+    }
+}
+
+// Act on one line of input; returns 1 for /exit
+int handle_input_line(char *line)
+{
+    if (!input.have_username)
+    {
+        // Open the binary protocol with the username; a script reads the text replies to its draws
+        char username[MAX_USERNAME_LENGTH];
+        snprintf(username, sizeof(username), "%s", line);
+        board_client_hello(server, username, script_mode ? HELLO_FLAG_RLE : HELLO_FLAG_RLE | HELLO_FLAG_DRAW_ACK);
+        request_viewport(0, 0);
+        input.have_username = 1;
+        if (!script_mode)
+        {
+            client_info_display();
+        }
+        return 0;
+    }
+
+    if (strcmp(line, "/exit") == 0)
+    {
+        if (!script_mode)
+        {
+            printf("\nExiting...\n");
+        }
+        return 1;
+    }
+    else if (strcmp(line, "/show") == 0 && !script_mode)
+    {
+        send_command_to_server(line); // Still send /show to the server
+        client_info_display();        // Repaint immediately on local command
+    }
+    else
+    {
+        // Send the entire command to the server; board changes are drawn as they come back
+        send_command_to_server(line);
+        prompt();
+    }
+    return 0;
+}
+
+/*
+ * Read whatever input is available in one read() and act on every complete
+ * line; the resulting frames go out together when the loop next polls.
+ * Returns 0 at end of input, 1 after /exit, -1 on a read error and 2 otherwise.
+ */
+int read_input()
+{
+    char chunk[BUFFER_SIZE];
+    int read_size = read(input.fd, chunk, sizeof(chunk));
+
+    if (read_size < 0)
+    {
+        return errno == EAGAIN || errno == EINTR ? 2 : -1;
+    }
+    for (int i = 0; i < read_size; i++)
+    {
+        char ch = chunk[i];
+        if (ch == '\n')
+        {
+            input.line[input.length] = '\0';
+            input.length = 0;
+            if (handle_input_line(input.line))
             {
-                canvas.grid[y][x] = board_string[index++];
+                return 1;
             }
-            else
+        }
+        else if (ch == 127 || ch == 8)
+        { // Backspace from a terminal that is not line buffered
+            if (input.length > 0)
             {
-                return; // Prevent out-of-bounds access
+                input.length--;
             }
         }
-        if (index < strlen(board_string) && board_string[index] == '\n')
+        else if (ch != '\r' && input.length < BUFFER_SIZE - 1)
         {
-            index++;
+            input.line[input.length++] = ch;
         }
     }
+    if (read_size == 0)
+    {
+        // A last line without a newline still counts
+        if (input.length > 0)
+        {
+            input.line[input.length] = '\0';
+            input.length = 0;
+            if (handle_input_line(input.line))
+            {
+                return 1;
+            }
+        }
+        return 0;
+    }
+    return 2;
 }
 
-// Send a command to the server
-void send_command_to_server(char *command)
+void handle_input()
 {
-    send(s_socket, command, strlen(command), 0);
-    printf("\nClient sent: %s\n", command);
+    int status = read_input();
+    if (status == 1)
+    {
+        running = 0;
+    }
+    else if (status <= 0)
+    {
+        if (status < 0)
+        {
+            perror("read");
+        }
+        // Nothing more to send. The server answers in order, so the reply to
+        // one more view request means every command before it is done.
+        input.open = 0;
+        board_loop_unwatch(loop, input.fd);
+        if (input.have_username)
+        {
+            request_viewport(server->canvas.x, server->canvas.y);
+        }
+    }
+}
+
+// Everything the loop reports: the server's frames and the input and redraw timer becoming ready
+void handle_event(const BoardEvent *event, void *context)
+{
+    const char *address = (const char *)context;
+
+    switch (event->type)
+    {
+    case BOARD_EVENT_CONNECTED:
+        connected = 1;
+        if (!script_mode)
+        {
+            printf("Connected to server at %s\n", address);
+            // The username is the first line of input; the HELLO goes out once it is complete
+            printf("Enter your username: ");
+            fflush(stdout);
+        }
+        input.open = board_loop_watch(loop, input.fd) == 0;
+        if (!input.open)
+        {
+            perror("input");
+            running = 0;
+        }
+        break;
+    case BOARD_EVENT_FRAME:
+        handle_frame(event->frame, event->payload, event->length, event->draw);
+        break;
+    case BOARD_EVENT_CLOSED:
+        if (!connected)
+        {
+            fprintf(stderr, "Connection failed\n");
+            exit(1);
+        }
+        else if (event->client->error != 0)
+        {
+            fprintf(stderr, "Connection lost: %s\n", strerror(event->client->error));
+        }
+        else if (!script_mode)
+        {
+            printf("Server disconnected.\n");
+        }
+        running = 0;
+        break;
+    case BOARD_EVENT_READABLE:
+        if (event->fd == input.fd)
+        {
+            handle_input();
+        }
+        else if (event->fd == redraw_timer_fd)
+        {
+            redraw_if_due();
+        }
+        break;
+    }
 }
 
 // Set up non-blocking input
 void setup_nonblocking_input()
 {
-#ifdef _WIN32
-#else
     int flags = fcntl(0, F_GETFL, 0);
     fcntl(0, F_SETFL, flags | O_NONBLOCK);
-#endif
 }
 
 int main(int argc, char *argv[])
 {
-#ifdef _WIN32
-    WSADATA data;
-#endif
     unsigned int port;
     struct sockaddr_in servaddr; // Server address structure
-    printf("Connecting...\n");
-    fflush(stdout);
+    const char *script_path = NULL;
+    char address[64];
 
+    if (argc == 5 && strcmp(argv[1], "--script") == 0)
+    {
+        script_path = argv[2];
+        script_mode = 1;
+        argv += 2;
+        argc -= 2;
+    }
     if (argc != 3)
     {
-        fprintf(stderr, "USAGE: %s <ip> <port>\n", argv[0]);
+        fprintf(stderr, "USAGE: %s [--script file] <ip> <port>\n", argv[0]);
+        fprintf(stderr, "A script holds the username on its first line, then one command per line.\n");
         exit(1);
     }
-    printf("Connecting to server at %s:%s\n", argv[1], argv[2]);
-    fflush(stdout);
-
-    port = atoi(argv[2]);
-
-    if ((port < 1) || (port > 65535))
+    input.fd = 0;
+    if (script_path != NULL && strcmp(script_path, "-") != 0)
     {
-        fprintf(stderr, "Invalid port number: %s\n", argv[2]);
-        exit(1);
+        input.fd = open(script_path, O_RDONLY);
+        if (input.fd < 0)
+        {
+            perror(script_path);
+            exit(1);
+        }
     }
-
-    // Initialize Winsock for Windows
-#ifdef _WIN32
-    if (WSAStartup(MAKEWORD(2, 2), &data) != 0)
+    if (!script_mode)
     {
-        fprintf(stderr, "Failed to initialize Winsock\n");
-        exit(1);
+        printf("Connecting...\n");
+        printf("Connecting to server at %s:%s\n", argv[1], argv[2]);
+        fflush(stdout);
     }
-#endif
 
-    // Create socket
-    if ((s_socket = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    port = atoi(argv[2]);
+
+    if ((port < 1) || (port > 65535))
     {
-        fprintf(stderr, "Could not create socket\n");
-#ifdef _WIN32
-        WSACleanup();
-#endif
+        fprintf(stderr, "Invalid port number: %s\n", argv[2]);
         exit(1);
     }
 
@@ -156,191 +608,68 @@ int main(int argc, char *argv[])
     if (inet_pton(AF_INET, argv[1], &servaddr.sin_addr) <= 0)
     {
         fprintf(stderr, "Invalid address: %s\n", argv[1]);
-#ifdef _WIN32
-        closesocket(s_socket);
-        WSACleanup();
-#else
-        close(s_socket);
-#endif
         exit(1);
     }
+    snprintf(address, sizeof(address), "%s:%u", argv[1], port);
 
-    // Connect to server
-    if (connect(s_socket, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0)
+    // Connect to server; the input is read once the connection is up
+    loop = board_loop_create(handle_event, address);
+    server = loop == NULL ? NULL : board_client_connect(loop, (struct sockaddr *)&servaddr, sizeof(servaddr));
+    if (server == NULL)
     {
-        fprintf(stderr, "Connection failed\n");
-#ifdef _WIN32
-        closesocket(s_socket);
-        WSACleanup();
-#else
-        close(s_socket);
-#endif
+        fprintf(stderr, "Could not create socket\n");
         exit(1);
     }
 
-    printf("Connected to server at %s:%d\n", argv[1], port);
-
-    // Initialize canvas
-    init_canvas();
-
-    // Get username from the user
-    char username[MAX_USERNAME_LENGTH];
-    printf("Enter your username: ");
-    fgets(username, MAX_USERNAME_LENGTH, stdin);
-    username[strcspn(username, "\n")] = 0; // Remove trailing newline
-
-    // Send the username to the server
-    send(s_socket, username, strlen(username), 0);
+#ifdef __linux__
+    redraw_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (redraw_timer_fd < 0 || board_loop_watch(loop, redraw_timer_fd) < 0)
+    {
+        perror("timerfd_create");
+        exit(1);
+    }
+#endif
 
     // Set up non block
-    setup_nonblocking_input();
-
-    char buffer[BUFFER_SIZE];
-    char input_buffer[BUFFER_SIZE];
-    char *input_ptr = input_buffer;
-    input_buffer[0] = '\0';
-    int bytes_received;
-
-    bytes_received = recv(s_socket, buffer, BUFFER_SIZE - 1, 0);
-    if (bytes_received > 0)
+    if (input.fd == 0)
     {
-        buffer[bytes_received] = '\0';
-        printf("%s\n", buffer);
+        setup_nonblocking_input();
     }
 
-    client_info_display();
-
-    fd_set readfds;
-    struct timeval tv;
-
-    while (1)
+    // Sleep until the server, the input or the redraw timer has something: no periodic wakeups
+    while (running && (!connected || input.open || server->views_pending > 0))
     {
-        FD_ZERO(&readfds);
-        FD_SET(s_socket, &readfds);
-        FD_SET(0, &readfds); // stdin
-
-        // Set timeout for select
-        tv.tv_sec = 0;
-        tv.tv_usec = 100000; // 100ms
-
-        int activity = select(s_socket + 1, &readfds, NULL, NULL, &tv);
-
-        if (activity < 0)
+        if (board_loop_poll_events(loop, redraw_timeout()) < 0)
         {
-            fprintf(stderr, "Select error\n");
+            perror("poll");
             break;
         }
-
-        // Check for data from server
-        if (FD_ISSET(s_socket, &readfds))
+#ifndef __linux__
+        redraw_if_due();
+#endif
+        // Leave the input alone while the server is slow to take what was already sent
+        if (input.open && input.paused != server->want_write)
         {
-            bytes_received = recv(s_socket, buffer, BUFFER_SIZE - 1, 0);
-            if (bytes_received > 0)
-            {
-                buffer[bytes_received] = '\0';
-                // Check if the received data is a board update
-                if (strncmp(buffer, "BOARD:", 6) == 0)
-                {
-                    update_local_canvas(buffer + 6); // Update canvas without "BOARD:" prefix
-                    if (should_display)
-                    {
-                        client_info_display();
-                        should_display = 0; // Reset the flag
-                    }
-                }
-                else
-                {
-                    printf("\nServer says:\n %s\n", buffer); // Print other messages from the server
-                    printf("Enter command: ");
-                    fflush(stdout);
-                }
-            }
-            else if (bytes_received == 0)
+            input.paused = server->want_write;
+            if (input.paused)
             {
-                printf("Server disconnected.\n");
-                break;
+                board_loop_unwatch(loop, input.fd);
             }
             else
             {
-                perror("recv");
-                break;
+                board_loop_watch(loop, input.fd);
             }
         }
+    }
 
-        // Check for user input
-        if (FD_ISSET(0, &readfds))
-        {
-            char ch;
-            int read_size = read(0, &ch, 1);
-
-            if (read_size > 0)
-            {
-                if (ch == '\n')
-                {
-                    // Process command
-                    input_buffer[strlen(input_buffer)] = '\0'; // Ensure null termination
-                    if (strcmp(input_buffer, "/exit") == 0)
-                    {
-                        printf("\nExiting...\n");
-                        break;
-                    }
-                    else if (strcmp(input_buffer, "/show") == 0)
-                    {
-                        should_display = 1;                   // Set the flag to display the board
-                        send_command_to_server(input_buffer); // Still send /show to the server
-                        client_info_display();                // Display immediately on local command
-                    }
-                    else
-                    {
-                        // Send the entire command to the server
-                        send_command_to_server(input_buffer);
-                        // If the command was a draw command, we might want to display immediately
-                        if (strncmp(input_buffer, "/draw", 5) == 0)
-                        {
-                            should_display = 1; // Set flag to display after server confirms
-                        }
-                        printf("Enter command: ");
-                        fflush(stdout);
-                    }
-
-                    // Reset input buffer
-                    input_ptr = input_buffer;
-                    *input_ptr = '\0';
-                }
-                else if (ch == 127 || ch == 8)
-                { // Backspace
-                    if (input_ptr > input_buffer)
-                    {
-                        input_ptr--;
-                        *input_ptr = '\0';
-                        // Redraw input line with updated buffer
-                        printf("\rEnter command: %s \b", input_buffer);
-                        fflush(stdout);
-                    }
-                }
-                else
-                {
-                    // Add character to buffer if there's room
-                    if (input_ptr - input_buffer < BUFFER_SIZE - 1)
-                    {
-                        *input_ptr++ = ch;
-                        *input_ptr = '\0';
-                        // Echo character
-                        putchar(ch);
-                        fflush(stdout);
-                    }
-                }
-            }
-        }
+    // Commands typed just before /exit still go out
+    while (server->state == BOARD_CLIENT_CONNECTED && server->out_length > 0 && board_client_flush(server) == 0)
+    {
+        board_loop_poll_events(loop, 100);
     }
 
     // Clean up
-#ifdef _WIN32
-    closesocket(s_socket);
-    WSACleanup();
-#else
-    close(s_socket);
-#endif
+    board_loop_destroy(loop);
 
     return 0;
-}
\ No newline at end of file
+}
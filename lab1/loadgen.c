@@ -0,0 +1,1221 @@
+/*
+ * Load generator and session recorder for server_good.c
+ *
+ * Generate (default): opens <clients> binary protocol connections, spread
+ * over [threads] libboardclient loops (board_client.h). Every client joins, then keeps sending /draw,
+ * /show and chat at its own rate until the run ends:
+ *
+ *     ./loadgen -c 2000 -d 30 -r 5 -m 90:5:5 127.0.0.1 9000
+ *
+ * Record: accepts connections on a local port and relays them to the
+ * server, writing what each client sends to a file as
+ * "<milliseconds> <session> <line>" (the first line of a session is its
+ * username). Both telnet style and binary clients can be recorded:
+ *
+ *     ./loadgen -L 9001 -o session.log 127.0.0.1 9000
+ *
+ * Replay: plays a recorded file back, every session on its own connection,
+ * [speed] times faster than it was recorded:
+ *
+ *     ./loadgen -P session.log -s 10 127.0.0.1 9000
+ *
+ * At the end it prints, per command, how many completed, the rate, and the
+ * p50/p99/p99.9/max latency from when the command was due to its reply
+ * (chat: to the sender's own copy of the broadcast; chat-fanout: to every
+ * client's copy). Latency counts from when a command was due, not when it
+ * was written, so a server that stalls shows up in the percentiles instead
+ * of quietly slowing the generator down.
+ *
+ * Build: gcc -O2 -pthread loadgen.c board_client.c -o loadgen -lm
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "board_client.h"
+
+#define MAX_EVENTS 256
+#define READ_CHUNK 65536
+#define MAX_STATS 32
+#define HIST_SUB_BUCKETS 32 // Per power of two, about 3% resolution
+#define HIST_GROUPS 60
+#define DRAIN_SECONDS 2     // Wait this long for replies after the last command
+#define MAX_LINE 4096
+#define VIEW_WIDTH 81
+#define VIEW_HEIGHT 21
+
+typedef enum
+{
+    MODE_GENERATE,
+    MODE_RECORD,
+    MODE_REPLAY
+} Mode;
+
+typedef enum
+{
+    CONN_IDLE,       // Replay session waiting for its first line
+    CONN_CONNECTING, // HELLO queued
+    CONN_JOINING,    // HELLO sent, waiting for the join board
+    CONN_READY,
+    CONN_CLOSED
+} ConnState;
+
+// Log-linear latency histogram in microseconds
+typedef struct
+{
+    uint64_t counts[HIST_GROUPS * HIST_SUB_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} Histogram;
+
+typedef struct
+{
+    char name[24];
+    Histogram hist;
+} Stat;
+
+typedef struct
+{
+    Stat stats[MAX_STATS];
+    int count;
+} StatTable;
+
+// A command waiting for its reply
+typedef struct
+{
+    uint64_t due_us;
+    int stat;
+    int expects_board; // Answered by a SNAPSHOT or REGION (or an error text)
+} Pending;
+
+typedef struct
+{
+    Pending *items;
+    size_t head;
+    size_t count;
+    size_t capacity;
+} PendingQueue;
+
+// A recorded line, at_us after the recording started
+typedef struct
+{
+    uint64_t at_us;
+    char *text;
+} Line;
+
+typedef struct
+{
+    int id;
+    Line *lines; // lines[0] is the username
+    size_t count;
+    size_t capacity;
+} Session;
+
+typedef struct
+{
+    BoardClient *client;
+    int id;
+    ConnState state;
+    char username[16];
+    uint64_t connect_us;
+    uint32_t board_width;
+    uint32_t board_height;
+
+    PendingQueue replies;
+    PendingQueue chats;
+
+    uint64_t due_us;  // Next command (generate) or line (replay)
+    size_t heap_index;
+    Session *session; // Replay only
+    size_t next_line;
+} Conn;
+
+typedef struct
+{
+    pthread_t thread;
+    BoardLoop *loop;
+    Conn **conns;
+    size_t conn_count;
+    Conn **heap; // Min-heap of READY or IDLE connections by due_us
+    size_t heap_count;
+    uint64_t random_state;
+    StatTable stats;
+    uint64_t sent;
+    uint64_t bytes_in;
+    uint64_t disconnects;
+} Worker;
+
+// Settings
+Mode mode = MODE_GENERATE;
+struct sockaddr_in servaddr;
+int client_count = 100;
+int thread_count = 1;
+double duration = 10;
+double rate = 1;            // Commands per second per client
+int weights[3] = {90, 5, 5}; // draw, show, chat
+int poisson = 1;
+int hotspot = 0;
+double speed = 1;
+const char *record_path = NULL;
+const char *replay_path = NULL;
+int listen_port = 0;
+
+uint64_t start_us;
+uint64_t end_us; // No new commands after this
+
+Session *sessions;
+size_t session_count;
+
+uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t next_random(Worker *worker)
+{
+    // xorshift64*
+    worker->random_state ^= worker->random_state >> 12;
+    worker->random_state ^= worker->random_state << 25;
+    worker->random_state ^= worker->random_state >> 27;
+    return worker->random_state * 2685821657736338717ULL;
+}
+
+double uniform(Worker *worker)
+{
+    return ((next_random(worker) >> 11) + 0.5) / 9007199254740992.0;
+}
+
+/* Histograms */
+
+int hist_index(uint64_t value)
+{
+    if (value < HIST_SUB_BUCKETS)
+    {
+        return value;
+    }
+    int exponent = 63 - __builtin_clzll(value); // At least 5
+    int group = exponent - 4;
+    int index = group * HIST_SUB_BUCKETS + (int)(value >> (group - 1)) - HIST_SUB_BUCKETS;
+    return index < HIST_GROUPS * HIST_SUB_BUCKETS ? index : HIST_GROUPS * HIST_SUB_BUCKETS - 1;
+}
+
+// Highest value that falls in the bucket
+uint64_t hist_value(int index)
+{
+    int group = index / HIST_SUB_BUCKETS;
+    if (group == 0)
+    {
+        return index;
+    }
+    uint64_t sub = index % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS;
+    return ((sub + 1) << (group - 1)) - 1;
+}
+
+void hist_record(Histogram *hist, uint64_t value)
+{
+    hist->counts[hist_index(value)]++;
+    hist->total++;
+    if (value > hist->max)
+    {
+        hist->max = value;
+    }
+}
+
+void hist_merge(Histogram *into, const Histogram *from)
+{
+    for (int i = 0; i < HIST_GROUPS * HIST_SUB_BUCKETS; i++)
+    {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    if (from->max > into->max)
+    {
+        into->max = from->max;
+    }
+}
+
+uint64_t hist_percentile(const Histogram *hist, double percentile)
+{
+    uint64_t target = (uint64_t)ceil(hist->total * percentile / 100.0), seen = 0;
+    if (target == 0)
+    {
+        target = 1;
+    }
+    for (int i = 0; i < HIST_GROUPS * HIST_SUB_BUCKETS; i++)
+    {
+        seen += hist->counts[i];
+        if (seen >= target)
+        {
+            uint64_t value = hist_value(i);
+            return value < hist->max ? value : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+int stat_lookup(StatTable *table, const char *name)
+{
+    for (int i = 0; i < table->count; i++)
+    {
+        if (strcmp(table->stats[i].name, name) == 0)
+        {
+            return i;
+        }
+    }
+    if (table->count == MAX_STATS)
+    {
+        return MAX_STATS - 1; // Lump the rest together
+    }
+    snprintf(table->stats[table->count].name, sizeof(table->stats[0].name), "%s", name);
+    return table->count++;
+}
+
+void stat_record(Worker *worker, int stat, uint64_t due_us)
+{
+    uint64_t now = now_us();
+    hist_record(&worker->stats.stats[stat].hist, now > due_us ? now - due_us : 0);
+}
+
+/* Pending queues */
+
+int pending_push(PendingQueue *queue, uint64_t due_us, int stat, int expects_board)
+{
+    if (queue->count == queue->capacity)
+    {
+        size_t capacity = queue->capacity == 0 ? 16 : queue->capacity * 2;
+        Pending *grown = malloc(capacity * sizeof(Pending));
+        if (grown == NULL)
+        {
+            return -1;
+        }
+        for (size_t i = 0; i < queue->count; i++)
+        {
+            grown[i] = queue->items[(queue->head + i) % queue->capacity];
+        }
+        free(queue->items);
+        queue->items = grown;
+        queue->head = 0;
+        queue->capacity = capacity;
+    }
+    Pending *item = &queue->items[(queue->head + queue->count++) % queue->capacity];
+    item->due_us = due_us;
+    item->stat = stat;
+    item->expects_board = expects_board;
+    return 0;
+}
+
+Pending *pending_head(PendingQueue *queue)
+{
+    return queue->count == 0 ? NULL : &queue->items[queue->head];
+}
+
+void pending_pop(PendingQueue *queue)
+{
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+}
+
+/* Timer heap */
+
+void heap_swap(Worker *worker, size_t a, size_t b)
+{
+    Conn *conn = worker->heap[a];
+    worker->heap[a] = worker->heap[b];
+    worker->heap[b] = conn;
+    worker->heap[a]->heap_index = a;
+    worker->heap[b]->heap_index = b;
+}
+
+void heap_push(Worker *worker, Conn *conn)
+{
+    size_t i = worker->heap_count++;
+    worker->heap[i] = conn;
+    conn->heap_index = i;
+    while (i > 0 && worker->heap[(i - 1) / 2]->due_us > worker->heap[i]->due_us)
+    {
+        heap_swap(worker, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+Conn *heap_pop(Worker *worker)
+{
+    Conn *top = worker->heap[0];
+    size_t i = 0;
+    heap_swap(worker, 0, --worker->heap_count);
+    for (;;)
+    {
+        size_t smallest = i, left = 2 * i + 1, right = 2 * i + 2;
+        if (left < worker->heap_count && worker->heap[left]->due_us < worker->heap[smallest]->due_us)
+        {
+            smallest = left;
+        }
+        if (right < worker->heap_count && worker->heap[right]->due_us < worker->heap[smallest]->due_us)
+        {
+            smallest = right;
+        }
+        if (smallest == i)
+        {
+            break;
+        }
+        heap_swap(worker, i, smallest);
+        i = smallest;
+    }
+    return top;
+}
+
+/* Connections */
+
+void conn_close(Conn *conn)
+{
+    if (conn->state == CONN_CLOSED)
+    {
+        return;
+    }
+    if (conn->client != NULL)
+    {
+        board_client_close(conn->client);
+    }
+    conn->state = CONN_CLOSED;
+    conn->replies.count = 0;
+    conn->chats.count = 0;
+}
+
+// Queue one frame; the loop sends it at its next poll, together with anything else due
+void conn_send_frame(Worker *worker, Conn *conn, uint8_t type, const void *payload, uint32_t length)
+{
+    if (board_client_send_frame(conn->client, type, payload, length) == 0)
+    {
+        worker->sent++;
+    }
+}
+
+// Connect and queue the HELLO, which goes out as soon as the connection is up
+void conn_connect(Worker *worker, Conn *conn)
+{
+    conn->connect_us = now_us();
+    conn->client = board_client_connect(worker->loop, (struct sockaddr *)&servaddr, sizeof(servaddr));
+    if (conn->client == NULL)
+    {
+        worker->disconnects++;
+        conn->state = CONN_CLOSED;
+        return;
+    }
+    conn->client->user = conn;
+    conn->state = CONN_CONNECTING;
+    board_client_hello(conn->client, conn->username, 0);
+}
+
+uint32_t random_coordinate(Worker *worker, uint32_t size)
+{
+    if (!hotspot)
+    {
+        return next_random(worker) % size;
+    }
+    // Normal around the middle, sigma a sixteenth of the board (Box-Muller)
+    double normal = sqrt(-2 * log(uniform(worker))) * cos(2 * M_PI * uniform(worker));
+    double value = size / 2.0 + normal * size / 16.0;
+    return value < 0 ? 0 : value >= size ? size - 1 : (uint32_t)value;
+}
+
+double next_interval_us(Worker *worker)
+{
+    double mean = 1e6 / rate;
+    return poisson ? -log(uniform(worker)) * mean : mean;
+}
+
+// Generate mode: send one random command that was due at conn->due_us
+void send_generated(Worker *worker, Conn *conn)
+{
+    unsigned char payload[32];
+    uint64_t pick = next_random(worker) % (weights[0] + weights[1] + weights[2]);
+
+    if (pick < (uint64_t)weights[0])
+    {
+        pending_push(&conn->replies, conn->due_us, stat_lookup(&worker->stats, "draw"), 0);
+        if (board_client_send_draw(conn->client, random_coordinate(worker, conn->board_width),
+                                   random_coordinate(worker, conn->board_height), 'a' + conn->id % 26) >= 0)
+        {
+            worker->sent++;
+        }
+    }
+    else if (pick < (uint64_t)(weights[0] + weights[1]))
+    {
+        uint32_t w = conn->board_width < VIEW_WIDTH ? conn->board_width : VIEW_WIDTH;
+        uint32_t h = conn->board_height < VIEW_HEIGHT ? conn->board_height : VIEW_HEIGHT;
+        put_u32(payload, next_random(worker) % (conn->board_width - w + 1));
+        put_u32(payload + 4, next_random(worker) % (conn->board_height - h + 1));
+        put_u32(payload + 8, w);
+        put_u32(payload + 12, h);
+        pending_push(&conn->replies, conn->due_us, stat_lookup(&worker->stats, "show"), 1);
+        conn_send_frame(worker, conn, FRAME_SHOW, payload, 16);
+    }
+    else
+    {
+        // Receivers read the due time back out of the text for chat-fanout
+        int length = snprintf((char *)payload, sizeof(payload), "lg %llu", (unsigned long long)conn->due_us);
+        pending_push(&conn->chats, conn->due_us, stat_lookup(&worker->stats, "chat"), 0);
+        conn_send_frame(worker, conn, FRAME_CHAT, payload, length);
+    }
+}
+
+// Replay mode: send the session's next line; /exit ends the session
+void send_replayed(Worker *worker, Conn *conn)
+{
+    const char *text = conn->session->lines[conn->next_line++].text;
+    char name[24];
+
+    if (strcmp(text, "/exit") == 0)
+    {
+        conn_close(conn);
+        return;
+    }
+    if (text[0] == '/')
+    {
+        size_t word = strcspn(text + 1, " ");
+        snprintf(name, sizeof(name), "%.*s", (int)(word < 20 ? word : 20), text + 1);
+        int board = strcmp(name, "show") == 0 || strcmp(name, "view") == 0;
+        pending_push(&conn->replies, conn->due_us, stat_lookup(&worker->stats, name), board);
+        conn_send_frame(worker, conn, FRAME_COMMAND, text, strlen(text));
+    }
+    else
+    {
+        pending_push(&conn->chats, conn->due_us, stat_lookup(&worker->stats, "chat"), 0);
+        conn_send_frame(worker, conn, FRAME_CHAT, text, strlen(text));
+    }
+}
+
+// Put a connection back on the timer heap for its next command, if there is one
+void schedule(Worker *worker, Conn *conn)
+{
+    if (conn->state != CONN_READY)
+    {
+        return;
+    }
+    if (mode == MODE_GENERATE)
+    {
+        conn->due_us += (uint64_t)next_interval_us(worker);
+    }
+    else
+    {
+        if (conn->next_line == conn->session->count)
+        {
+            return;
+        }
+        conn->due_us = start_us + (uint64_t)(conn->session->lines[conn->next_line].at_us / speed);
+    }
+    if (conn->due_us < end_us)
+    {
+        heap_push(worker, conn);
+    }
+}
+
+void handle_frame(Worker *worker, Conn *conn, uint8_t type, const unsigned char *payload, uint32_t length)
+{
+    Pending *head = pending_head(&conn->replies);
+
+    switch (type)
+    {
+    case FRAME_HELLO_ACK:
+        conn->board_width = conn->client->board_width;
+        conn->board_height = conn->client->board_height;
+        break;
+    case FRAME_SNAPSHOT:
+    case FRAME_REGION:
+        if (conn->state == CONN_JOINING)
+        {
+            // The join board comes last in the welcome, so replies line up from here
+            stat_record(worker, stat_lookup(&worker->stats, "join"), conn->connect_us);
+            conn->state = CONN_READY;
+            if (mode == MODE_GENERATE)
+            {
+                conn->due_us = now_us();
+            }
+            else
+            {
+                conn->next_line = 1; // Past the username
+            }
+            schedule(worker, conn);
+        }
+        else if (head != NULL && head->expects_board)
+        {
+            stat_record(worker, head->stat, head->due_us);
+            pending_pop(&conn->replies);
+        }
+        break;
+    case FRAME_TEXT:
+        // Replies end in a newline; notices about other clients do not
+        if (conn->state == CONN_READY && head != NULL && length > 0 && payload[length - 1] == '\n')
+        {
+            stat_record(worker, head->stat, head->due_us);
+            pending_pop(&conn->replies);
+        }
+        break;
+    case FRAME_CHAT:
+    {
+        size_t name_length = strlen(conn->username);
+        const unsigned char *text = memmem(payload, length, ": ", 2);
+        Pending *chat = pending_head(&conn->chats);
+        if (text == NULL)
+        {
+            break;
+        }
+        if (chat != NULL && (size_t)(text - payload) == name_length && memcmp(payload, conn->username, name_length) == 0)
+        {
+            stat_record(worker, chat->stat, chat->due_us);
+            pending_pop(&conn->chats);
+        }
+        text += 2;
+        // Recorded chat may contain old timestamps, so only this run's own count
+        if (mode == MODE_GENERATE && payload + length - text > 3 && memcmp(text, "lg ", 3) == 0)
+        {
+            char due[24];
+            size_t digits = payload + length - text - 3 < 23 ? payload + length - text - 3 : 23;
+            memcpy(due, text + 3, digits);
+            due[digits] = '\0';
+            stat_record(worker, stat_lookup(&worker->stats, "chat-fanout"), strtoull(due, NULL, 10));
+        }
+        break;
+    }
+    default:
+        break; // Deltas and board clears from everyone's drawing
+    }
+}
+
+void handle_event(const BoardEvent *event, void *context)
+{
+    Worker *worker = (Worker *)context;
+    Conn *conn = (Conn *)event->client->user;
+
+    switch (event->type)
+    {
+    case BOARD_EVENT_CONNECTED:
+        conn->state = CONN_JOINING;
+        break;
+    case BOARD_EVENT_FRAME:
+        handle_frame(worker, conn, event->frame, event->payload, event->length);
+        break;
+    case BOARD_EVENT_CLOSED:
+        worker->disconnects++;
+        conn_close(conn);
+        break;
+    default:
+        break;
+    }
+}
+
+int outstanding(Worker *worker)
+{
+    for (size_t i = 0; i < worker->conn_count; i++)
+    {
+        Conn *conn = worker->conns[i];
+        if (conn->state != CONN_CLOSED && (conn->replies.count > 0 || conn->chats.count > 0))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void *run_worker(void *arg)
+{
+    Worker *worker = (Worker *)arg;
+
+    for (size_t i = 0; i < worker->conn_count; i++)
+    {
+        Conn *conn = worker->conns[i];
+        if (mode == MODE_GENERATE)
+        {
+            conn_connect(worker, conn);
+        }
+        else
+        {
+            heap_push(worker, conn); // Connects when its username line is due
+        }
+    }
+
+    for (;;)
+    {
+        uint64_t now = now_us();
+        if (now >= end_us + DRAIN_SECONDS * 1000000ULL || (now >= end_us && !outstanding(worker)))
+        {
+            break;
+        }
+        while (worker->heap_count > 0 && worker->heap[0]->due_us <= now)
+        {
+            Conn *conn = heap_pop(worker);
+            if (conn->state == CONN_IDLE)
+            {
+                conn_connect(worker, conn);
+                continue;
+            }
+            if (conn->state != CONN_READY)
+            {
+                continue;
+            }
+            if (mode == MODE_GENERATE)
+            {
+                send_generated(worker, conn);
+            }
+            else
+            {
+                send_replayed(worker, conn);
+            }
+            schedule(worker, conn);
+        }
+
+        int timeout = 100;
+        if (worker->heap_count > 0)
+        {
+            uint64_t wait = worker->heap[0]->due_us > now ? worker->heap[0]->due_us - now : 0;
+            timeout = wait / 1000 < 100 ? (int)((wait + 999) / 1000) : 100;
+        }
+        board_loop_poll_events(worker->loop, timeout);
+    }
+    for (size_t i = 0; i < worker->conn_count; i++)
+    {
+        if (worker->conns[i]->client != NULL)
+        {
+            worker->bytes_in += worker->conns[i]->client->bytes_received;
+        }
+    }
+    board_loop_destroy(worker->loop);
+    return NULL;
+}
+
+/* Replay files */
+
+Session *find_session(int id)
+{
+    for (size_t i = 0; i < session_count; i++)
+    {
+        if (sessions[i].id == id)
+        {
+            return &sessions[i];
+        }
+    }
+    Session *grown = realloc(sessions, (session_count + 1) * sizeof(Session));
+    if (grown == NULL)
+    {
+        return NULL;
+    }
+    sessions = grown;
+    memset(&sessions[session_count], 0, sizeof(Session));
+    sessions[session_count].id = id;
+    return &sessions[session_count++];
+}
+
+// Read "<ms> <session> <line>" records; returns the time of the last one in microseconds
+uint64_t load_recording(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    char line[MAX_LINE + 64];
+    uint64_t last = 0;
+
+    if (file == NULL)
+    {
+        perror(path);
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        unsigned long long ms;
+        int id, consumed;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (sscanf(line, "%llu %d %n", &ms, &id, &consumed) != 2)
+        {
+            continue;
+        }
+        Session *session = find_session(id);
+        if (session == NULL)
+        {
+            break;
+        }
+        if (session->count == session->capacity)
+        {
+            session->capacity = session->capacity == 0 ? 16 : session->capacity * 2;
+            session->lines = realloc(session->lines, session->capacity * sizeof(Line));
+        }
+        session->lines[session->count].at_us = ms * 1000;
+        session->lines[session->count++].text = strdup(line + consumed);
+        if (ms * 1000 > last)
+        {
+            last = ms * 1000;
+        }
+    }
+    fclose(file);
+    return last;
+}
+
+/* Record mode: a relay that writes down what clients send */
+
+typedef struct
+{
+    int client_fd;
+    int server_fd;
+    int session;
+    int binary; // -1 until the first byte says which protocol
+    unsigned char *in;
+    size_t in_length;
+    size_t in_capacity;
+} Relay;
+
+// One end of a relay, as registered with epoll
+typedef struct
+{
+    Relay *relay;
+    int from_client;
+} RelayEnd;
+
+FILE *record_file;
+uint64_t record_start_us;
+
+void record_line(Relay *relay, const char *text, size_t length)
+{
+    char line[MAX_LINE];
+    if (length >= sizeof(line))
+    {
+        length = sizeof(line) - 1;
+    }
+    for (size_t i = 0; i < length; i++)
+    {
+        line[i] = text[i] == '\n' || text[i] == '\r' ? ' ' : text[i];
+    }
+    line[length] = '\0';
+    fprintf(record_file, "%llu %d %s\n", (unsigned long long)((now_us() - record_start_us) / 1000), relay->session, line);
+    fflush(record_file);
+}
+
+// Write a binary frame from a client down as the text command it stands for
+void record_frame(Relay *relay, uint8_t type, const unsigned char *payload, uint32_t length)
+{
+    char line[96];
+    int n = -1;
+
+    switch (type)
+    {
+    case FRAME_HELLO:
+        if (length >= 2)
+        {
+            record_line(relay, (const char *)payload + 2, length - 2);
+        }
+        return;
+    case FRAME_CHAT:
+    case FRAME_COMMAND:
+        record_line(relay, (const char *)payload, length);
+        return;
+    case FRAME_DRAW:
+        // A numbered draw (DRAW_ID_SIZE) replays as a plain one; its id only matters to the client that sent it
+        if (length >= 9)
+        {
+            n = snprintf(line, sizeof(line), "/draw %u %u %c", get_u32(payload), get_u32(payload + 4), payload[8]);
+        }
+        break;
+    case FRAME_SHOW:
+    case FRAME_VIEW:
+        if (length >= 16)
+        {
+            n = snprintf(line, sizeof(line), "%s %u %u %u %u", type == FRAME_SHOW ? "/show" : "/view",
+                         get_u32(payload), get_u32(payload + 4), get_u32(payload + 8), get_u32(payload + 12));
+        }
+        else
+        {
+            n = snprintf(line, sizeof(line), "%s", type == FRAME_SHOW ? "/show" : "/view");
+        }
+        break;
+    case FRAME_RESET:
+        n = snprintf(line, sizeof(line), "/reset");
+        break;
+    }
+    if (n > 0)
+    {
+        record_line(relay, line, n);
+    }
+}
+
+void record_input(Relay *relay, const unsigned char *data, size_t length)
+{
+    if (relay->in_length + length > relay->in_capacity)
+    {
+        size_t capacity = relay->in_capacity == 0 ? 4096 : relay->in_capacity;
+        while (capacity < relay->in_length + length)
+        {
+            capacity *= 2;
+        }
+        relay->in = realloc(relay->in, capacity);
+        relay->in_capacity = capacity;
+    }
+    memcpy(relay->in + relay->in_length, data, length);
+    relay->in_length += length;
+    if (relay->binary < 0 && relay->in_length > 0)
+    {
+        relay->binary = relay->in[0] == FRAME_HELLO;
+    }
+
+    size_t offset = 0;
+    for (;;)
+    {
+        if (relay->binary)
+        {
+            if (relay->in_length - offset < FRAME_HEADER_SIZE)
+            {
+                break;
+            }
+            uint32_t size = get_u32(relay->in + offset + 1);
+            if (relay->in_length - offset < FRAME_HEADER_SIZE + size)
+            {
+                break;
+            }
+            record_frame(relay, relay->in[offset], relay->in + offset + FRAME_HEADER_SIZE, size);
+            offset += FRAME_HEADER_SIZE + size;
+        }
+        else
+        {
+            unsigned char *end = memchr(relay->in + offset, '\n', relay->in_length - offset);
+            if (end == NULL)
+            {
+                break;
+            }
+            size_t size = end - (relay->in + offset);
+            if (size > 0 && relay->in[offset + size - 1] == '\r')
+            {
+                size--;
+            }
+            record_line(relay, (const char *)relay->in + offset, size);
+            offset = end - relay->in + 1;
+        }
+    }
+    memmove(relay->in, relay->in + offset, relay->in_length - offset);
+    relay->in_length -= offset;
+}
+
+int write_all(int fd, const unsigned char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = send(fd, data, length, MSG_NOSIGNAL);
+        if (written <= 0)
+        {
+            return -1;
+        }
+        data += written;
+        length -= written;
+    }
+    return 0;
+}
+
+void run_recorder()
+{
+    struct sockaddr_in local;
+    struct epoll_event event, events[MAX_EVENTS];
+    unsigned char *buffer = malloc(READ_CHUNK);
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0), one = 1, next_session = 1;
+    int epoll_fd = epoll_create1(0);
+
+    record_file = fopen(record_path, "w");
+    if (record_file == NULL)
+    {
+        perror(record_path);
+        exit(1);
+    }
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    local.sin_port = htons(listen_port);
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(listen_fd, (struct sockaddr *)&local, sizeof(local)) < 0 || listen(listen_fd, 64) < 0)
+    {
+        perror("listen");
+        exit(1);
+    }
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+    record_start_us = now_us();
+    printf("Recording sessions on port %d to %s; Ctrl-C to stop.\n", listen_port, record_path);
+
+    for (;;)
+    {
+        int count = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        for (int i = 0; i < count; i++)
+        {
+            RelayEnd *end = (RelayEnd *)events[i].data.ptr;
+            if (events[i].events == 0)
+            {
+                continue; // Its relay was closed earlier in this batch
+            }
+            if (end == NULL)
+            {
+                int client_fd = accept(listen_fd, NULL, NULL);
+                int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+                if (client_fd < 0 || connect(server_fd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0)
+                {
+                    perror("relay");
+                    if (client_fd >= 0)
+                    {
+                        close(client_fd);
+                    }
+                    close(server_fd);
+                    continue;
+                }
+                setsockopt(server_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                Relay *relay = calloc(1, sizeof(Relay));
+                RelayEnd *ends = calloc(2, sizeof(RelayEnd));
+                relay->client_fd = client_fd;
+                relay->server_fd = server_fd;
+                relay->session = next_session++;
+                relay->binary = -1;
+                ends[0].relay = ends[1].relay = relay;
+                ends[0].from_client = 1;
+                event.events = EPOLLIN;
+                event.data.ptr = &ends[0];
+                epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event);
+                event.data.ptr = &ends[1];
+                epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &event);
+                continue;
+            }
+
+            Relay *relay = end->relay;
+            int from = end->from_client ? relay->client_fd : relay->server_fd;
+            int to = end->from_client ? relay->server_fd : relay->client_fd;
+            ssize_t received = recv(from, buffer, READ_CHUNK, 0);
+            if (received <= 0 || write_all(to, buffer, received) < 0)
+            {
+                if (relay->session > 0)
+                {
+                    record_line(relay, "/exit", 5);
+                }
+                // The other end's RelayEnd is freed with this one, so forget both fds first
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, relay->client_fd, NULL);
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, relay->server_fd, NULL);
+                close(relay->client_fd);
+                close(relay->server_fd);
+                // Later events in this batch may still point at the ends about to be freed
+                for (int j = i + 1; j < count; j++)
+                {
+                    RelayEnd *other = (RelayEnd *)events[j].data.ptr;
+                    if (other != NULL && other->relay == relay)
+                    {
+                        events[j].events = 0;
+                    }
+                }
+                free(relay->in);
+                free(end->from_client ? end : end - 1);
+                free(relay);
+                continue;
+            }
+            if (end->from_client)
+            {
+                record_input(relay, buffer, received);
+            }
+        }
+    }
+}
+
+/* Report */
+
+void print_report(Worker *workers, double elapsed)
+{
+    StatTable total;
+    uint64_t sent = 0, bytes_in = 0, disconnects = 0;
+
+    memset(&total, 0, sizeof(total));
+    for (int t = 0; t < thread_count; t++)
+    {
+        for (int i = 0; i < workers[t].stats.count; i++)
+        {
+            int index = stat_lookup(&total, workers[t].stats.stats[i].name);
+            hist_merge(&total.stats[index].hist, &workers[t].stats.stats[i].hist);
+        }
+        sent += workers[t].sent;
+        bytes_in += workers[t].bytes_in;
+        disconnects += workers[t].disconnects;
+    }
+
+    printf("connections=%d threads=%d elapsed=%.1fs frames_sent=%llu bytes_received=%llu disconnects=%llu\n",
+           client_count, thread_count, elapsed, (unsigned long long)sent, (unsigned long long)bytes_in,
+           (unsigned long long)disconnects);
+    printf("%-14s %10s %10s %9s %9s %9s %9s\n", "command", "count", "per sec", "p50 ms", "p99 ms", "p99.9 ms", "max ms");
+    for (int i = 0; i < total.count; i++)
+    {
+        const Histogram *hist = &total.stats[i].hist;
+        printf("%-14s %10llu %10.1f %9.3f %9.3f %9.3f %9.3f\n", total.stats[i].name,
+               (unsigned long long)hist->total, hist->total / elapsed, hist_percentile(hist, 50) / 1000.0,
+               hist_percentile(hist, 99) / 1000.0, hist_percentile(hist, 99.9) / 1000.0, hist->max / 1000.0);
+    }
+}
+
+void usage(const char *program)
+{
+    fprintf(stderr,
+            "USAGE: %s [options] <ip> <port>\n"
+            "  -c clients      connections to open (default 100)\n"
+            "  -t threads      event loops to spread them over (default 1)\n"
+            "  -d seconds      how long to send commands (default 10)\n"
+            "  -r rate         commands per second per client (default 1)\n"
+            "  -m d:s:c        draw:show:chat mix (default 90:5:5)\n"
+            "  -a poisson|fixed  gaps between a client's commands (default poisson)\n"
+            "  -x uniform|hotspot  where draws land (default uniform)\n"
+            "  -L port -o file record sessions relayed through a local port\n"
+            "  -P file [-s speed]  replay recorded sessions, speed times faster\n",
+            program);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:t:d:r:m:a:x:L:o:P:s:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            client_count = atoi(optarg);
+            break;
+        case 't':
+            thread_count = atoi(optarg);
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'm':
+            if (sscanf(optarg, "%d:%d:%d", &weights[0], &weights[1], &weights[2]) != 3 ||
+                weights[0] < 0 || weights[1] < 0 || weights[2] < 0 || weights[0] + weights[1] + weights[2] == 0)
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 'a':
+            poisson = strcmp(optarg, "fixed") != 0;
+            break;
+        case 'x':
+            hotspot = strcmp(optarg, "hotspot") == 0;
+            break;
+        case 'L':
+            mode = MODE_RECORD;
+            listen_port = atoi(optarg);
+            break;
+        case 'o':
+            record_path = optarg;
+            break;
+        case 'P':
+            mode = MODE_REPLAY;
+            replay_path = optarg;
+            break;
+        case 's':
+            speed = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2 || client_count < 1 || thread_count < 1 || duration <= 0 || rate <= 0 || speed <= 0 ||
+        (mode == MODE_RECORD && (record_path == NULL || listen_port < 1)))
+    {
+        usage(argv[0]);
+    }
+
+    memset(&servaddr, 0, sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_port = htons(atoi(argv[optind + 1]));
+    if (inet_pton(AF_INET, argv[optind], &servaddr.sin_addr) <= 0)
+    {
+        fprintf(stderr, "Invalid address: %s\n", argv[optind]);
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    if (mode == MODE_RECORD)
+    {
+        run_recorder();
+        return 0;
+    }
+
+    // Thousands of sockets need more than the usual 1024 descriptors
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    uint64_t last_line = 0;
+    if (mode == MODE_REPLAY)
+    {
+        last_line = load_recording(replay_path);
+        client_count = session_count;
+        if (client_count == 0)
+        {
+            fprintf(stderr, "No sessions in %s\n", replay_path);
+            exit(1);
+        }
+    }
+
+    Worker *workers = calloc(thread_count, sizeof(Worker));
+    Conn *conns = calloc(client_count, sizeof(Conn));
+    for (int t = 0; t < thread_count; t++)
+    {
+        workers[t].loop = board_loop_create(handle_event, &workers[t]);
+        if (workers[t].loop == NULL)
+        {
+            perror("board_loop_create");
+            exit(1);
+        }
+        workers[t].conns = calloc(client_count / thread_count + 1, sizeof(Conn *));
+        workers[t].heap = calloc(client_count / thread_count + 1, sizeof(Conn *));
+        workers[t].random_state = 0x9E3779B97F4A7C15ULL * (t + 1);
+    }
+    start_us = now_us();
+    end_us = mode == MODE_GENERATE ? start_us + (uint64_t)(duration * 1e6) : start_us + (uint64_t)(last_line / speed) + 1;
+    for (int i = 0; i < client_count; i++)
+    {
+        Worker *worker = &workers[i % thread_count];
+        Conn *conn = &conns[i];
+        conn->id = i;
+        if (mode == MODE_REPLAY)
+        {
+            conn->session = &sessions[i];
+            conn->due_us = start_us + (uint64_t)(sessions[i].lines[0].at_us / speed);
+            snprintf(conn->username, sizeof(conn->username), "%s", sessions[i].lines[0].text);
+        }
+        else
+        {
+            snprintf(conn->username, sizeof(conn->username), "lg%d", i);
+        }
+        worker->conns[worker->conn_count++] = conn;
+    }
+
+    for (int t = 0; t < thread_count; t++)
+    {
+        pthread_create(&workers[t].thread, NULL, run_worker, &workers[t]);
+    }
+    for (int t = 0; t < thread_count; t++)
+    {
+        pthread_join(workers[t].thread, NULL);
+    }
+    double elapsed = (end_us - start_us) / 1e6;
+    print_report(workers, elapsed);
+    return 0;
+}
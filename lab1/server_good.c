@@ -11,167 +11,5320 @@
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #endif
 
 #ifndef _WIN32
 #include <poll.h>
 #include <stddef.h> // Include this header for nfds_t definition
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <linux/errqueue.h>
+#define USE_EPOLL
+#ifdef MSG_ZEROCOPY
+#define USE_ZEROCOPY
+#endif
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define USE_URING
+#endif
+#endif
+#else
+#define fdatasync fsync
 #endif
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <time.h>
+#include <stdatomic.h>
+#include "board_protocol.h"
+#include "board_map.h"
 #ifndef _WIN32
 #include <unistd.h>
+#include <signal.h>
+#endif
+
+#define MAX_USERNAME_LENGTH 15
+#define MAX_EVENTS 64
+#define MAX_REACTORS 64
+#define DEFAULT_BOARD_WIDTH 81
+#define DEFAULT_BOARD_HEIGHT 21
+#define MAX_BOARD_SIZE 100000 // Largest width or height accepted by -d
+#define TILE_SIZE 64 // Cells per tile side; one uint64_t of dirty bits per tile row
+#define BOARD_SHARD_ROWS 3 // Minimum rows per independently locked board band
+#define MAX_BOARD_SHARDS 256
+#define MAX_REGION_CELLS (1 << 19) // Largest snapshot or region sent in one frame
+#define DEFAULT_HIGH_WATER (256 * 1024) // Queued bytes before a client counts as slow
+#define MIN_HIGH_WATER 4096 // Below this the replies to one command can already trip it
+#define FLUSH_IOVECS 64 // Queued messages handed to one sendmsg()
+#define URING_ENTRIES 4096 // Submission queue slots per reactor; the completion queue gets four times that
+#define URING_BUFFERS 1024 // Provided receive buffers per reactor, a power of two
+#define URING_BUFFER_SIZE 4096
+#define URING_CHAIN 4 // Linked sendmsg operations per client flush, each of up to FLUSH_IOVECS messages
+#define MAX_LINE_LENGTH 4096 // Longest text command or chat line
+#define MAX_DELTA_RUNS 4096 // Per delta frame; bigger changes are split into several
+#define MAX_DELTA_CELLS (256 * 1024)
+#define DELTA_MERGE_GAP 8 // Unchanged cells worth resending to save a run header
+#define MAX_BATCH_POINTS (MAX_LINE_LENGTH / 4) // "x y " is the shortest point
+#define MAX_BATCH_CELLS (1 << 20) // Largest filled /rect
+#define FILL_RADIUS 512 // /fill spreads at most this far from its start cell
+#define VIEW_BUCKET_MIN 256 // Smallest side of a /view index bucket, in cells
+#define MAX_VIEW_BUCKETS 64 // Buckets per board side at most
+#define DEFAULT_TICK_RATE 30 // Board broadcasts per second, 0 = one per change
+#define UNDO_DEPTH 16 // Own commands each client can /undo
+#define DEFAULT_HISTORY_MB 16 // Journal plus keyframes for /undo and /history (-j)
+#define HISTORY_KEYFRAMES 16 // Keyframes per journal length, so /history replays at most 1/16 of it
+#define MAX_KEYFRAMES (HISTORY_KEYFRAMES + 2)
+#define HISTORY_SCRATCH_KEEP 65536 // Per-thread journal scratch kept between commands, in entries
+
+struct {
+    int x;
+    int y;
+    char symbol;
+} DrawPoint;
+
+/*
+ * The board is stored as TILE_SIZE x TILE_SIZE tiles that are only allocated
+ * when something is drawn in them, so a mostly empty 100k x 100k canvas costs
+ * little more than its tile table. Missing tiles read as empty cells (0).
+ */
+typedef struct {
+    char (*cells)[TILE_SIZE];  // TILE_SIZE rows, right after the struct or in the board file
+    uint64_t dirty[TILE_SIZE]; // Cells changed since last announced, bit x of row y
+    atomic_int listed;         // Queued on dirty_tiles for the next tick
+} Tile;
+
+int board_width = DEFAULT_BOARD_WIDTH;
+int board_height = DEFAULT_BOARD_HEIGHT;
+int tiles_across;
+int tiles_down;
+_Atomic(Tile*) *tiles; // tiles_across * tiles_down, row major
+atomic_ulong board_seq = 0; // Bumped on every board change, under bus_lock
+
+/*
+ * With -m the cells live in a shared file mapping instead (layout in
+ * board_map.h); the Tile structs around them are rebuilt at startup.
+ */
+BoardMapHeader *board_map;
+unsigned char *board_map_present;
+char *board_map_cells;
+
+#if TILE_SIZE != BOARD_MAP_TILE
+#error "board_map.h assumes the server's tile size"
+#endif
+
+#define tileAt(x, y) (atomic_load(&tiles[((y) / TILE_SIZE) * tiles_across + (x) / TILE_SIZE]))
+#define onBoard(x, y) ((x) >= 0 && (x) < board_width && (y) >= 0 && (y) < board_height)
+
+/*
+ * With a broadcast tick, draws only mark their cells dirty and list the tile
+ * here; reactor 0 sends everything marked as one update per tick.
+ */
+int *dirty_tiles; // Tile indices
+size_t dirty_tile_count;
+size_t dirty_tile_capacity;
+pthread_mutex_t dirty_lock = PTHREAD_MUTEX_INITIALIZER; // Innermost lock
+atomic_int board_dirty_pending = 0;
+int tick_interval = 1000 / DEFAULT_TICK_RATE; // Milliseconds, 0 = broadcast immediately
+long long next_tick = 0;                      // Owned by reactor 0
+
+/*
+ * The board is split into row bands, each with its own lock, so draws to
+ * different regions from different reactor threads do not contend.
+ * Lock order: shards in ascending order, then bus_lock.
+ */
+pthread_mutex_t *shard_locks;
+int shard_rows = BOARD_SHARD_ROWS;
+int shard_count;
+
+#define shardOf(y) ((y) / shard_rows)
+
+// /view index geometry: the board is cut into square buckets of view_bucket_size cells
+int view_bucket_size;
+int view_buckets_across;
+int view_buckets_down;
+
+#define bucketOf(x, y) (((y) / view_bucket_size) * view_buckets_across + (x) / view_bucket_size)
+
+void lockShards(int first_row, int last_row) {
+    for (int i = shardOf(first_row); i <= shardOf(last_row); i++) {
+        pthread_mutex_lock(&shard_locks[i]);
+    }
+}
+
+void unlockShards(int first_row, int last_row) {
+    for (int i = shardOf(last_row); i >= shardOf(first_row); i--) {
+        pthread_mutex_unlock(&shard_locks[i]);
+    }
+}
+
+void lockAllShards() {
+    lockShards(0, board_height - 1);
+}
+
+void unlockAllShards() {
+    unlockShards(0, board_height - 1);
+}
+
+// Size the board and its locks from the command line options; tiles come later
+int boardInit(int width, int height) {
+    board_width = width;
+    board_height = height;
+    tiles_across = (width + TILE_SIZE - 1) / TILE_SIZE;
+    tiles_down = (height + TILE_SIZE - 1) / TILE_SIZE;
+    tiles = calloc((size_t)tiles_across * tiles_down, sizeof(*tiles));
+
+    shard_rows = (height + MAX_BOARD_SHARDS - 1) / MAX_BOARD_SHARDS;
+    if (shard_rows < BOARD_SHARD_ROWS) {
+        shard_rows = BOARD_SHARD_ROWS;
+    }
+    shard_count = (height + shard_rows - 1) / shard_rows;
+
+    int longest = width > height ? width : height;
+    view_bucket_size = (longest + MAX_VIEW_BUCKETS - 1) / MAX_VIEW_BUCKETS;
+    if (view_bucket_size < VIEW_BUCKET_MIN) {
+        view_bucket_size = VIEW_BUCKET_MIN;
+    }
+    view_bucket_size = (view_bucket_size + TILE_SIZE - 1) / TILE_SIZE * TILE_SIZE;
+    view_buckets_across = (width + view_bucket_size - 1) / view_bucket_size;
+    view_buckets_down = (height + view_bucket_size - 1) / view_bucket_size;
+    shard_locks = malloc(shard_count * sizeof(pthread_mutex_t));
+    if (tiles == NULL || shard_locks == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < shard_count; i++) {
+        pthread_mutex_init(&shard_locks[i], NULL);
+    }
+    return 0;
+}
+
+// Cell value, 0 when empty. Caller holds the row's shard lock.
+char boardGet(int x, int y) {
+    Tile *tile = tileAt(x, y);
+    return tile == NULL ? 0 : tile->cells[y % TILE_SIZE][x % TILE_SIZE];
+}
+
+// Copy len cells of row y starting at x, empty ones as spaces. Caller holds the row's shard lock.
+void boardCopyRow(char *out, int x, int y, int len) {
+    while (len > 0) {
+        Tile *tile = tileAt(x, y);
+        int span = TILE_SIZE - x % TILE_SIZE;
+        if (span > len) {
+            span = len;
+        }
+        for (int i = 0; i < span; i++) {
+            char cell = tile == NULL ? 0 : tile->cells[y % TILE_SIZE][x % TILE_SIZE + i];
+            out[i] = cell == 0 ? ' ' : cell;
+        }
+        out += span;
+        x += span;
+        len -= span;
+    }
+}
+
+// A tile for slot index, its cells either in the board file or right after it
+Tile *tileCreate(size_t index) {
+    if (board_map != NULL) {
+        Tile *tile = calloc(1, sizeof(Tile));
+        if (tile != NULL) {
+            tile->cells = (char (*)[TILE_SIZE])(board_map_cells + index * BOARD_MAP_TILE_BYTES);
+            board_map_present[index] = 1;
+        }
+        return tile;
+    }
+    Tile *tile = calloc(1, sizeof(Tile) + TILE_SIZE * TILE_SIZE);
+    if (tile != NULL) {
+        tile->cells = (char (*)[TILE_SIZE])(tile + 1);
+    }
+    return tile;
+}
+
+// Tile holding (x, y), allocated on first use; two rows of one tile can be
+// written under different shard locks, so the allocation is published with a CAS
+Tile *boardTile(int x, int y) {
+    size_t index = (size_t)(y / TILE_SIZE) * tiles_across + x / TILE_SIZE;
+    _Atomic(Tile*) *slot = &tiles[index];
+    Tile *tile = atomic_load(slot);
+    if (tile == NULL) {
+        Tile *fresh = tileCreate(index);
+        if (fresh == NULL) {
+            return NULL;
+        }
+        if (atomic_compare_exchange_strong(slot, &tile, fresh)) {
+            tile = fresh;
+        } else {
+            free(fresh);
+        }
+    }
+    return tile;
+}
+
+// Store a cell and mark it for the next update; returns 1 if it changed. Caller holds the row's shard lock.
+int boardSet(int x, int y, char symbol) {
+    Tile *tile = boardTile(x, y);
+    if (tile == NULL || tile->cells[y % TILE_SIZE][x % TILE_SIZE] == symbol) {
+        return 0;
+    }
+    tile->cells[y % TILE_SIZE][x % TILE_SIZE] = symbol;
+    tile->dirty[y % TILE_SIZE] |= 1ULL << (x % TILE_SIZE);
+    if (tick_interval > 0 && atomic_exchange(&tile->listed, 1) == 0) {
+        pthread_mutex_lock(&dirty_lock);
+        if (dirty_tile_count == dirty_tile_capacity) {
+            size_t capacity = dirty_tile_capacity == 0 ? 64 : dirty_tile_capacity * 2;
+            int *grown = realloc(dirty_tiles, capacity * sizeof(int));
+            if (grown != NULL) {
+                dirty_tiles = grown;
+                dirty_tile_capacity = capacity;
+            }
+        }
+        if (dirty_tile_count < dirty_tile_capacity) {
+            dirty_tiles[dirty_tile_count++] = (y / TILE_SIZE) * tiles_across + x / TILE_SIZE;
+        }
+        pthread_mutex_unlock(&dirty_lock);
+    }
+    return 1;
+}
+
+// Drop every tile; the board is empty again. Caller holds all shard locks.
+void boardClear() {
+    for (size_t i = 0; i < (size_t)tiles_across * tiles_down; i++) {
+        // Only write slots that hold a tile, so untouched parts of the table stay unmapped
+        if (atomic_load(&tiles[i]) != NULL) {
+            Tile *tile = atomic_exchange(&tiles[i], NULL);
+            if (board_map != NULL) {
+                memset(tile->cells, 0, BOARD_MAP_TILE_BYTES);
+                board_map_present[i] = 0;
+            }
+            free(tile);
+        }
+    }
+    pthread_mutex_lock(&dirty_lock);
+    dirty_tile_count = 0;
+    pthread_mutex_unlock(&dirty_lock);
+}
+
+/*
+ * Keep the board in a shared mapping of path (-m). An existing file for the
+ * same board size is taken over as is: only its present table is scanned to
+ * rebuild the tile table, so restarting costs no parsing or copying.
+ */
+int boardMapOpen(const char *path) {
+    uint64_t tile_count = (uint64_t)tiles_across * tiles_down;
+    uint64_t size = board_map_size(tile_count);
+    struct stat info;
+    BoardMapHeader *header;
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+
+    if (fd < 0 || fstat(fd, &info) < 0) {
+        perror(path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    int fresh = info.st_size == 0;
+    if (fresh && ftruncate(fd, size) < 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    if (!fresh && (uint64_t)info.st_size != size) {
+        fprintf(stderr, "%s does not hold a %dx%d board.\n", path, board_width, board_height);
+        close(fd);
+        return -1;
+    }
+    header = (BoardMapHeader*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // The mapping keeps the file open
+    if (header == MAP_FAILED) {
+        perror(path);
+        return -1;
+    }
+    if (fresh) {
+        memcpy(header->magic, BOARD_MAP_MAGIC, 4);
+        header->version = BOARD_MAP_VERSION;
+        header->width = board_width;
+        header->height = board_height;
+        header->tile_size = TILE_SIZE;
+        header->tiles_across = tiles_across;
+        header->tiles_down = tiles_down;
+        header->data_offset = board_map_data_offset(tile_count);
+        atomic_store(&header->seq, 0);
+    } else if (memcmp(header->magic, BOARD_MAP_MAGIC, 4) != 0 || header->version != BOARD_MAP_VERSION ||
+               header->width != (uint32_t)board_width || header->height != (uint32_t)board_height ||
+               header->tile_size != TILE_SIZE || header->data_offset != board_map_data_offset(tile_count)) {
+        fprintf(stderr, "%s does not hold a %dx%d board.\n", path, board_width, board_height);
+        munmap(header, size);
+        return -1;
+    }
+
+    board_map = header;
+    board_map_present = (unsigned char*)header + BOARD_MAP_PAGE;
+    board_map_cells = (char*)header + header->data_offset;
+    for (size_t i = 0; i < tile_count; i++) {
+        if (board_map_present[i]) {
+            Tile *tile = tileCreate(i);
+            if (tile == NULL) {
+                return -1;
+            }
+            atomic_store(&tiles[i], tile);
+        }
+    }
+    atomic_store(&board_seq, atomic_load(&header->seq));
+    return 0;
+}
+
+void storeBoardSeq(unsigned long seq) {
+    atomic_store(&board_seq, seq);
+    if (board_map != NULL) {
+        atomic_store(&board_map->seq, seq);
+    }
+}
+
+/*
+ * Journal behind /undo, /redo and /history: every changed cell in the order
+ * the changes hit the board, kept in a ring that overwrites the oldest.
+ */
+typedef struct {
+    uint64_t seq;    // Lower bound on the board update that shows the change
+    uint32_t x;      // HISTORY_RESET for a /reset
+    uint32_t y;
+    uint32_t client; // Id of the client that made it
+    char before;
+    char after;
+} HistoryEntry;
+
+#define HISTORY_RESET UINT32_MAX
+
+// Journal entries written by one command, by absolute journal position
+typedef struct {
+    uint64_t start;
+    uint32_t count;
+} HistoryRange;
+
+// Next board sequence number, mirrored into the board file for its readers. Caller holds bus_lock.
+unsigned long nextBoardSeq() {
+    unsigned long seq = atomic_fetch_add(&board_seq, 1) + 1;
+    if (board_map != NULL) {
+        atomic_store(&board_map->seq, seq);
+    }
+    return seq;
+}
+
+typedef struct {
+    int x;
+    int y;
+    int len;
+} DeltaRun;
+
+// Changed cells gathered for clients instead of the whole board
+typedef struct {
+    DeltaRun *runs;
+    int run_count;
+    int run_capacity;
+    char *cells; // Cells of all runs back to back
+    size_t cell_count;
+    size_t cell_capacity;
+} BoardDelta;
+
+/*
+ * Logging. Threads never format or write a message themselves: logAt()
+ * copies the format pointer and the arguments into a slot of a bounded
+ * lock-free ring, and the log writer thread formats whatever has piled up
+ * and writes it with one write() per stream (warnings and errors to stderr,
+ * the rest to stdout).
+ *
+ * The level is checked before anything else, so a disabled message costs one
+ * relaxed load. Each call site may log LOG_RATE_LIMIT records per second; the
+ * rest are counted and reported with the site's next record. When the ring is
+ * full a record is dropped and counted rather than waited for. The level is set
+ * with -l and can be changed at runtime through the metrics port (-M).
+ */
+#define LOG_RING_SIZE 4096 // Records; a power of two
+#define LOG_MAX_ARGS 8
+#define LOG_TEXT_BYTES 96 // String arguments, copied back to back
+#define LOG_RATE_LIMIT 50 // Records per call site per second
+#define LOG_FLUSH_MS 10   // How long the writer sleeps when the ring is empty
+#define LOG_LINE_MAX 1024
+
+typedef enum {
+    LOG_ERROR,
+    LOG_WARN,
+    LOG_INFO,
+    LOG_DEBUG,
+    LOG_LEVELS
+} LogLevel;
+
+const char *log_level_names[LOG_LEVELS] = { "error", "warn", "info", "debug" };
+atomic_int log_level = LOG_INFO;
+
+// One per logAt() call site, for rate limiting
+typedef struct {
+    atomic_llong window; // Second the count is for
+    atomic_uint count;
+    atomic_ulong suppressed; // Not yet reported
+} LogSite;
+
+typedef union {
+    long long i;
+    unsigned long long u;
+    double d;
+    const void *p;
+    size_t text; // %s: offset into LogRecord.text
+} LogArg;
+
+typedef struct {
+    atomic_size_t sequence; // Ring slot state, see logPush()
+    int level;
+    char thread[12];
+    long long time; // Wall clock nanoseconds
+    const char *format;
+    unsigned long suppressed; // Records of this site dropped by the rate limit since its last one
+    LogArg args[LOG_MAX_ARGS];
+    char text[LOG_TEXT_BYTES];
+} LogRecord;
+
+LogRecord log_ring[LOG_RING_SIZE];
+atomic_size_t log_enqueue_pos;
+atomic_size_t log_dequeue_pos;
+atomic_ulong log_dropped;    // Ring was full
+atomic_ulong log_suppressed; // Rate limited
+pthread_mutex_t log_output_lock = PTHREAD_MUTEX_INITIALIZER; // Serialises consumers only
+__thread char log_thread_name[12] = "main";
+
+#define logAt(level, ...) \
+    do { \
+        static LogSite log_site; \
+        if ((int)(level) <= atomic_load_explicit(&log_level, memory_order_relaxed)) { \
+            logWrite(&log_site, (level), __VA_ARGS__); \
+        } \
+    } while (0)
+
+int parseLogLevel(const char *name) {
+    for (int level = 0; level < LOG_LEVELS; level++) {
+        if (strcmp(name, log_level_names[level]) == 0) {
+            return level;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Bounded multi-producer multi-consumer queue (Vyukov): a slot whose sequence
+ * equals the enqueue position is free, one whose sequence is position + 1
+ * holds a record. Claiming a slot is a single compare-and-swap; nobody waits.
+ */
+LogRecord *logClaim() {
+    size_t position = atomic_load_explicit(&log_enqueue_pos, memory_order_relaxed);
+    for (;;) {
+        LogRecord *record = &log_ring[position & (LOG_RING_SIZE - 1)];
+        size_t sequence = atomic_load_explicit(&record->sequence, memory_order_acquire);
+        long difference = (long)(sequence - position);
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&log_enqueue_pos, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                return record;
+            }
+        } else if (difference < 0) {
+            return NULL; // Full
+        } else {
+            position = atomic_load_explicit(&log_enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+void logPublish(LogRecord *record) {
+    size_t position = atomic_load_explicit(&record->sequence, memory_order_relaxed);
+    atomic_store_explicit(&record->sequence, position + 1, memory_order_release);
+}
+
+LogRecord *logTake(size_t *position) {
+    *position = atomic_load_explicit(&log_dequeue_pos, memory_order_relaxed);
+    for (;;) {
+        LogRecord *record = &log_ring[*position & (LOG_RING_SIZE - 1)];
+        size_t sequence = atomic_load_explicit(&record->sequence, memory_order_acquire);
+        long difference = (long)(sequence - (*position + 1));
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&log_dequeue_pos, position, *position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                return record;
+            }
+        } else if (difference < 0) {
+            return NULL; // Empty
+        } else {
+            *position = atomic_load_explicit(&log_dequeue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+void logRelease(LogRecord *record, size_t position) {
+    atomic_store_explicit(&record->sequence, position + LOG_RING_SIZE, memory_order_release);
+}
+
+/*
+ * Walk one printf conversion starting after its '%'. Sets *conversion to the
+ * conversion character and *longs to the number of 'l's ('z' counts as one);
+ * returns a pointer just past it.
+ */
+const char *logConversion(const char *spec, char *conversion, int *longs) {
+    *longs = 0;
+    while (*spec != '\0' && strchr("-+ #0123456789.", *spec) != NULL) {
+        spec++;
+    }
+    while (*spec == 'l' || *spec == 'z' || *spec == 'h') {
+        if (*spec != 'h') {
+            (*longs)++;
+        }
+        spec++;
+    }
+    *conversion = *spec;
+    return *spec != '\0' ? spec + 1 : spec;
+}
+
+// Only the conversions below are supported: d i u x X c s p f g e and %%
+__attribute__((format(printf, 3, 4)))
+void logWrite(LogSite *site, int level, const char *format, ...) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    long long window = atomic_load_explicit(&site->window, memory_order_relaxed);
+    if (window != now.tv_sec &&
+        atomic_compare_exchange_strong_explicit(&site->window, &window, now.tv_sec,
+                                                memory_order_relaxed, memory_order_relaxed)) {
+        atomic_store_explicit(&site->count, 0, memory_order_relaxed);
+    }
+    if (atomic_fetch_add_explicit(&site->count, 1, memory_order_relaxed) >= LOG_RATE_LIMIT) {
+        atomic_fetch_add_explicit(&site->suppressed, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&log_suppressed, 1, memory_order_relaxed);
+        return;
+    }
+
+    LogRecord *record = logClaim();
+    if (record == NULL) {
+        atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+        return;
+    }
+    record->level = level;
+    memcpy(record->thread, log_thread_name, sizeof(record->thread));
+    record->time = (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+    record->format = format;
+    record->suppressed = 0;
+    if (atomic_load_explicit(&site->suppressed, memory_order_relaxed) != 0) {
+        record->suppressed = atomic_exchange_explicit(&site->suppressed, 0, memory_order_relaxed);
+    }
+
+    va_list args;
+    va_start(args, format);
+    size_t text_used = 0;
+    int count = 0;
+    for (const char *p = strchr(format, '%'); p != NULL && count < LOG_MAX_ARGS; p = strchr(p, '%')) {
+        char conversion;
+        int longs;
+        p = logConversion(p + 1, &conversion, &longs);
+        LogArg *arg = &record->args[count];
+        switch (conversion) {
+        case 'd':
+        case 'i':
+        case 'c':
+            arg->i = longs >= 2 ? va_arg(args, long long) : longs == 1 ? va_arg(args, long) : va_arg(args, int);
+            break;
+        case 'u':
+        case 'x':
+        case 'X':
+            arg->u = longs >= 2 ? va_arg(args, unsigned long long) : longs == 1 ? va_arg(args, unsigned long)
+                                                                                : va_arg(args, unsigned int);
+            break;
+        case 'f':
+        case 'g':
+        case 'e':
+            arg->d = va_arg(args, double);
+            break;
+        case 'p':
+            arg->p = va_arg(args, void*);
+            break;
+        case 's': {
+            // The caller's string may be gone by the time the writer runs
+            const char *text = va_arg(args, const char*);
+            size_t length = text != NULL ? strlen(text) : 0;
+            if (length > LOG_TEXT_BYTES - 1 - text_used) {
+                length = LOG_TEXT_BYTES - 1 - text_used;
+            }
+            memcpy(record->text + text_used, text, length);
+            record->text[text_used + length] = '\0';
+            arg->text = text_used;
+            text_used += length + (text_used + length < LOG_TEXT_BYTES - 1 ? 1 : 0);
+            break;
+        }
+        default:
+            continue; // %% takes no argument
+        }
+        count++;
+    }
+    va_end(args);
+    logPublish(record);
+}
+
+// Format a record as one line into out; returns its length
+size_t logFormat(const LogRecord *record, char *out, size_t size) {
+    time_t seconds = (time_t)(record->time / 1000000000LL);
+    struct tm local;
+    localtime_r(&seconds, &local);
+    size_t length = strftime(out, size, "%Y-%m-%d %H:%M:%S", &local);
+    length += snprintf(out + length, size - length, ".%03d %-5s %-7s ", (int)(record->time / 1000000 % 1000),
+                       log_level_names[record->level], record->thread);
+
+    const char *p = record->format;
+    int index = 0;
+    while (*p != '\0' && length < size - 1) {
+        if (*p != '%') {
+            out[length++] = *p++;
+            continue;
+        }
+        char conversion, spec[32];
+        int longs;
+        const char *end = logConversion(p + 1, &conversion, &longs);
+        // Rebuild the conversion without its length modifier; integers were widened to long long
+        size_t flags = strspn(p + 1, "-+ #0123456789.");
+        if (flags > sizeof(spec) - 4) {
+            flags = sizeof(spec) - 4;
+        }
+        spec[0] = '%';
+        memcpy(spec + 1, p + 1, flags);
+        size_t spec_length = flags + 1;
+        if (strchr("diuxX", conversion) != NULL) {
+            spec[spec_length++] = 'l';
+            spec[spec_length++] = 'l';
+        }
+        spec[spec_length++] = conversion;
+        spec[spec_length] = '\0';
+
+        const LogArg *arg = &record->args[index < LOG_MAX_ARGS ? index : LOG_MAX_ARGS - 1];
+        int written = 0;
+        switch (conversion) {
+        case 'd':
+        case 'i':
+            written = snprintf(out + length, size - length, spec, arg->i);
+            break;
+        case 'u':
+        case 'x':
+        case 'X':
+            written = snprintf(out + length, size - length, spec, arg->u);
+            break;
+        case 'c':
+            written = snprintf(out + length, size - length, spec, (int)arg->i);
+            break;
+        case 'f':
+        case 'g':
+        case 'e':
+            written = snprintf(out + length, size - length, spec, arg->d);
+            break;
+        case 'p':
+            written = snprintf(out + length, size - length, spec, arg->p);
+            break;
+        case 's':
+            written = snprintf(out + length, size - length, spec, record->text + arg->text);
+            break;
+        case '%':
+            out[length++] = '%';
+            index--;
+            break;
+        default:
+            break;
+        }
+        index++;
+        if (written > 0) {
+            length += (size_t)written < size - length ? (size_t)written : size - length - 1;
+        }
+        p = end;
+    }
+
+    // One record is one line, whether or not the format ended in a newline
+    while (length > 0 && out[length - 1] == '\n') {
+        length--;
+    }
+    if (record->suppressed > 0) {
+        length += snprintf(out + length, size - length, " (%lu more suppressed)", record->suppressed);
+        if (length > size - 2) {
+            length = size - 2;
+        }
+    }
+    out[length++] = '\n';
+    return length;
+}
+
+void logWriteAll(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return;
+        }
+        data += written;
+        length -= written;
+    }
+}
+
+// Format and write everything queued; returns how many records were written
+size_t logDrain() {
+    static char out[2][LOG_RING_SIZE / 16 * LOG_LINE_MAX];
+    static size_t reported_drops;
+    size_t used[2] = { 0, 0 }, records = 0, position;
+    LogRecord *record;
+
+    pthread_mutex_lock(&log_output_lock);
+    while ((record = logTake(&position)) != NULL) {
+        int stream = record->level <= LOG_WARN ? 1 : 0;
+        if (sizeof(out[stream]) - used[stream] < LOG_LINE_MAX) {
+            logWriteAll(stream == 1 ? STDERR_FILENO : STDOUT_FILENO, out[stream], used[stream]);
+            used[stream] = 0;
+        }
+        used[stream] += logFormat(record, out[stream] + used[stream], LOG_LINE_MAX);
+        logRelease(record, position);
+        records++;
+    }
+    size_t drops = atomic_load(&log_dropped);
+    if (drops != reported_drops) {
+        if (sizeof(out[1]) - used[1] < LOG_LINE_MAX) {
+            logWriteAll(STDERR_FILENO, out[1], used[1]);
+            used[1] = 0;
+        }
+        used[1] += snprintf(out[1] + used[1], LOG_LINE_MAX, "%zu log record(s) dropped, the log ring was full.\n",
+                            drops - reported_drops);
+        reported_drops = drops;
+    }
+    logWriteAll(STDOUT_FILENO, out[0], used[0]);
+    logWriteAll(STDERR_FILENO, out[1], used[1]);
+    pthread_mutex_unlock(&log_output_lock);
+    return records;
+}
+
+void *logWriter(void *arg) {
+    (void)arg;
+    snprintf(log_thread_name, sizeof(log_thread_name), "log");
+    for (;;) {
+        if (logDrain() == 0) {
+            struct timespec pause = { 0, LOG_FLUSH_MS * 1000000L };
+            nanosleep(&pause, NULL);
+        }
+    }
+    return NULL;
+}
+
+// Startup messages written before an exit() must not be lost with the ring
+void logFlush() {
+    logDrain();
+}
+
+int logInit() {
+    pthread_t writer;
+    for (size_t i = 0; i < LOG_RING_SIZE; i++) {
+        atomic_init(&log_ring[i].sequence, i);
+    }
+    atexit(logFlush);
+    return pthread_create(&writer, NULL, logWriter, NULL) == 0 ? 0 : -1;
+}
+
+/*
+ * Metrics. Every counter and histogram has a single writer (a reactor thread,
+ * or the log writer for the persistence ones), so recording is a relaxed load
+ * and store with no locked instruction and no sharing between reactors.
+ * Readers (/stats, GET /metrics) sum the per-reactor copies whenever asked
+ * and may see a snapshot that is a few events old.
+ *
+ * Histograms are log-linear like HdrHistogram: values below
+ * HISTOGRAM_SUB_BUCKETS are exact, above that every power of two is split
+ * into HISTOGRAM_SUB_BUCKETS / 2 buckets, so a reported percentile is within
+ * about 6% of the true value. Latencies are recorded in nanoseconds.
+ */
+#define HISTOGRAM_SUB_BUCKETS 32
+#define HISTOGRAM_HALF (HISTOGRAM_SUB_BUCKETS / 2)
+#define HISTOGRAM_GROUPS 44 // Values up to 2^48, about three days in nanoseconds
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS + (HISTOGRAM_GROUPS - 1) * HISTOGRAM_HALF)
+
+typedef struct {
+    atomic_ulong counts[HISTOGRAM_BUCKETS];
+    atomic_ulong total;
+    atomic_ulong sum;
+    atomic_ulong max;
+} Histogram;
+
+// Plain copy of one or more Histograms added together, for reading percentiles
+typedef struct {
+    unsigned long counts[HISTOGRAM_BUCKETS];
+    unsigned long total;
+    unsigned long sum;
+    unsigned long max;
+} HistogramTotals;
+
+typedef enum {
+    COMMAND_DRAW,
+    COMMAND_DRAWMANY,
+    COMMAND_LINE,
+    COMMAND_RECT,
+    COMMAND_FILL,
+    COMMAND_SHOW,
+    COMMAND_VIEW,
+    COMMAND_RESET,
+    COMMAND_UNDO,
+    COMMAND_REDO,
+    COMMAND_HISTORY,
+    COMMAND_CHAT,
+    COMMAND_OTHER, // /help, /stats and unknown commands
+    COMMAND_KINDS
+} CommandKind;
+
+const char *command_names[COMMAND_KINDS] = {
+    "draw", "drawmany", "line", "rect", "fill", "show", "view", "reset", "undo", "redo", "history", "chat", "other"
+};
+
+typedef struct {
+    atomic_ulong accepts;
+    atomic_ulong disconnects;
+    atomic_ulong slow_disconnects; // Dropped by the slow consumer policy
+    atomic_ulong coalesced;        // Times a slow client's board frames were replaced by a snapshot
+    atomic_ulong bytes_in;
+    atomic_ulong bytes_out;
+    atomic_ulong send_calls;       // sendmsg()/send() calls that wrote something
+    atomic_ulong zerocopy_sends;   // Of those, sent with MSG_ZEROCOPY
+    atomic_ulong zerocopy_copied;  // Zero-copy sends the kernel ended up copying anyway
+    atomic_ulong syscalls;         // System calls made by the reactor thread, io_uring_enter() included
+    atomic_ulong online;           // Connections currently owned
+    atomic_ulong queued_bytes;     // Unsent bytes across all owned clients
+    atomic_ulong commands[COMMAND_KINDS];
+    Histogram command_time[COMMAND_KINDS]; // Handling one command, reply included
+    Histogram fanout_time;   // From publishing a broadcast to queuing it for this reactor's clients
+    Histogram mailbox_depth; // Broadcasts picked up per mailbox drain
+    Histogram tick_time;     // Reactor 0 only: building and publishing one board broadcast
+} ReactorMetrics;
+
+// Written by the log writer thread
+Histogram wal_sync_time;
+Histogram snapshot_time;
+
+long long monotonicNanos() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Single writer only: the load and store are not one atomic step
+void metricAdd(atomic_ulong *counter, unsigned long amount) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount,
+                          memory_order_relaxed);
+}
+
+void metricSub(atomic_ulong *counter, unsigned long amount) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) - amount,
+                          memory_order_relaxed);
+}
+
+int histogramIndex(unsigned long value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return (int)value;
+    }
+    // Keep the top five bits: group g covers [2^(g+4), 2^(g+5)) in HISTOGRAM_HALF steps
+    int group = (63 - __builtin_clzl(value)) - 4;
+    int index = HISTOGRAM_SUB_BUCKETS + (group - 1) * HISTOGRAM_HALF +
+                (int)(value >> group) - HISTOGRAM_HALF;
+    return index < HISTOGRAM_BUCKETS ? index : HISTOGRAM_BUCKETS - 1;
+}
+
+// Largest value that lands in a bucket
+unsigned long histogramBucketTop(int index) {
+    if (index < HISTOGRAM_SUB_BUCKETS) {
+        return (unsigned long)index;
+    }
+    int group = (index - HISTOGRAM_SUB_BUCKETS) / HISTOGRAM_HALF + 1;
+    unsigned long step = (unsigned long)((index - HISTOGRAM_SUB_BUCKETS) % HISTOGRAM_HALF + HISTOGRAM_HALF);
+    return ((step + 1) << group) - 1;
+}
+
+void histogramRecord(Histogram *histogram, unsigned long value) {
+    metricAdd(&histogram->counts[histogramIndex(value)], 1);
+    metricAdd(&histogram->total, 1);
+    metricAdd(&histogram->sum, value);
+    if (value > atomic_load_explicit(&histogram->max, memory_order_relaxed)) {
+        atomic_store_explicit(&histogram->max, value, memory_order_relaxed);
+    }
+}
+
+void histogramRecordSince(Histogram *histogram, long long start) {
+    long long elapsed = monotonicNanos() - start;
+    histogramRecord(histogram, elapsed > 0 ? (unsigned long)elapsed : 0);
+}
+
+void histogramAdd(HistogramTotals *totals, Histogram *histogram) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        totals->counts[i] += atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+    }
+    totals->total += atomic_load_explicit(&histogram->total, memory_order_relaxed);
+    totals->sum += atomic_load_explicit(&histogram->sum, memory_order_relaxed);
+    unsigned long max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    if (max > totals->max) {
+        totals->max = max;
+    }
+}
+
+// Value at or below which the given fraction of recordings fall, 0 when empty
+unsigned long histogramPercentile(const HistogramTotals *totals, double fraction) {
+    // Bucket counts and the total are read at slightly different times; go by the buckets
+    unsigned long recorded = 0, seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        recorded += totals->counts[i];
+    }
+    if (recorded == 0) {
+        return 0;
+    }
+    unsigned long rank = (unsigned long)(fraction * recorded + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += totals->counts[i];
+        if (seen >= rank) {
+            unsigned long top = histogramBucketTop(i);
+            return top < totals->max ? top : totals->max;
+        }
+    }
+    return totals->max;
+}
+
+typedef enum {
+    MESSAGE_TEXT,  // Replies and chat, always delivered
+    MESSAGE_BOARD  // Snapshots and deltas, superseded by a newer snapshot
+} MessageKind;
+
+// Outbound payload, shared by every reactor and client queue that has to deliver it
+typedef struct Message {
+    atomic_int refs;
+    MessageKind kind;
+    unsigned long exclude_id; // Client that should not receive it (0 = none)
+    struct Message *binary;   // Same content framed for binary protocol clients
+    struct Message *rle;      // Board frames: binary frame with run-length encoded cells, if smaller
+    int has_area;             // Board change confined to [x0, x1] x [y0, y1], for /view filtering
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+    long long published;      // monotonicNanos() when it was handed to the reactors, for fan-out time
+    size_t length;
+    char data[];
+} Message;
+
+typedef enum {
+    PROTOCOL_UNKNOWN, // Nothing received yet
+    PROTOCOL_TEXT,    // Telnet style text commands
+    PROTOCOL_BINARY   // Length-prefixed frames from board_protocol.h
+} Protocol;
+
+// What to do with a client whose outbound queue passes the high-water mark
+typedef enum {
+    SLOW_COALESCE,  // Drop queued board frames and send one fresh snapshot once drained
+    SLOW_DISCONNECT // Drop the connection
+} SlowConsumerPolicy;
+
+SlowConsumerPolicy slow_policy = SLOW_COALESCE;
+size_t high_water = DEFAULT_HIGH_WATER;
+size_t zerocopy_threshold = 0; // -z: batches of at least this many bytes go out with MSG_ZEROCOPY, 0 = never
+
+// One queued message and how much of it has already been written
+typedef struct {
+    Message *message;
+    size_t offset;
+} OutboundEntry;
+
+// A message the kernel may still be reading from after a MSG_ZEROCOPY send
+typedef struct {
+    Message *message;
+    uint32_t id; // Completion notification that releases it
+} ZerocopyHold;
+
+// How reactors wait for sockets, chosen with -b
+typedef enum {
+    BACKEND_POLL,
+    BACKEND_EPOLL, // Linux
+    BACKEND_URING  // Linux with io_uring
+} EventBackend;
+
+const char *backend_names[] = { "poll", "epoll", "io_uring" };
+
+#ifdef USE_EPOLL
+EventBackend event_backend = BACKEND_EPOLL;
+#else
+EventBackend event_backend = BACKEND_POLL;
+#endif
+
+#ifdef USE_URING
+// One reactor's io_uring: the mapped rings plus a ring of provided receive buffers
+typedef struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit; // Queued since the last io_uring_enter()
+    struct io_uring_buf_ring *buffer_ring;
+    char *buffers;       // URING_BUFFERS * URING_BUFFER_SIZE
+    uint64_t wake_value; // Target of the pending eventfd read
+} Uring;
 #endif
 
-#define MAX_CONNECTED_CLIENTS 10
-#define MAX_USERNAME_LENGTH 15
-#define BOARD_WIDTH 81
-#define BOARD_HEIGHT 21
+typedef struct Reactor Reactor;
+
+// Per-connection state, owned by the reactor thread that accepted it
+typedef struct {
+    int fd;
+    unsigned long id;
+    size_t index; // Position in the owning reactor's clients table
+    size_t poll_index; // poll() backend: position in the reactor's poll_fds
+    Reactor *reactor;
+    char username[MAX_USERNAME_LENGTH];
+    Protocol protocol;
+    int protocol_version; // Negotiated with FRAME_HELLO
+    int features;         // HELLO_FLAG_* the client asked for and the server supports
+
+    // Partial line or binary frame carried over between reads
+    unsigned char *inbound;
+    size_t in_length;
+    size_t in_capacity;
+    int in_discard; // Text input: dropping the rest of a line that was too long
+
+    // Outbound ring of messages waiting for the socket to become writable
+    OutboundEntry *outbound;
+    size_t out_head;
+    size_t out_count;
+    size_t out_capacity;
+    size_t out_bytes;   // Unsent bytes across the ring
+    int needs_snapshot; // Board frames were coalesced away; resend the board when drained
+    int dead;           // Scheduled for disconnect at the end of the loop iteration
+    int flush_pending;  // On the reactor's flush list
+
+    // io_uring backend: operations the kernel still holds this client for
+    int recv_armed;     // Multishot receive active
+    int send_ops;       // Linked sendmsg operations in flight
+    size_t out_inflight; // Queued messages at the head of the ring they cover
+    struct msghdr *send_msgs; // Their headers, URING_CHAIN of them
+    struct iovec *send_iov;   // and iovecs
+    size_t send_iov_capacity;
+    int closing;        // Disconnected; freed once nothing is in flight
+
+    // MSG_ZEROCOPY (-z): ring of messages pinned by sends that have not completed
+    int zerocopy;       // SO_ZEROCOPY is on and the kernel has not fallen back to copying
+    uint32_t zerocopy_next; // Notification id the next zero-copy send will get
+    ZerocopyHold *zerocopy_holds;
+    size_t zerocopy_head;
+    size_t zerocopy_count;
+    size_t zerocopy_capacity;
+
+    // /view subscription; without one the client gets every board update
+    int has_view;
+    int view_x;
+    int view_y;
+    int view_w;
+    int view_h;
+    int view_fallback; // Its view buckets could not grow, so it is on the full_view list instead
+    unsigned long delivered; // Reactor delivery serial of the last message queued, to skip duplicates
+
+    // Own commands /undo and /redo can revert, newest last
+    HistoryRange undo[UNDO_DEPTH];
+    int undo_count;
+    HistoryRange redo[UNDO_DEPTH];
+    int redo_count;
+} Client;
+
+typedef struct {
+    Client **clients;
+    size_t count;
+    size_t capacity;
+} ClientList;
+
+// One event loop thread with its own listener, connections and mailbox
+struct Reactor {
+    int id;
+    int listen_fd;
+    int wake_fd;
+    pthread_t thread;
+
+    // Connection table, grows on demand
+    Client **clients;
+    size_t client_count;
+    size_t client_capacity;
+
+    // Broadcasts published by any thread, delivered by this one
+    pthread_mutex_t mailbox_lock;
+    Message **mailbox;
+    size_t mailbox_count;
+    size_t mailbox_capacity;
+
+    /*
+     * Spatial index of named clients: those with a /view sit in every bucket
+     * their view overlaps, the rest in full_view. Only this reactor's thread
+     * touches it.
+     */
+    ClientList full_view;
+    ClientList *view_buckets; // view_buckets_across * view_buckets_down
+    unsigned long delivery_serial;
+
+    // Journal entries of the command being applied on this thread
+    HistoryEntry *journal;
+    size_t journal_count;
+    size_t journal_capacity;
+
+    /*
+     * While corked (handling events and draining the mailbox), output is only
+     * queued and the client listed here; each listed client is then flushed
+     * once, so everything it was sent in this iteration goes out in one
+     * sendmsg().
+     */
+    int corked;
+    Client **flush_list;
+    size_t flush_count;
+    size_t flush_capacity;
+
+    // Clients to disconnect once the current events are handled
+    Client **dead;
+    size_t dead_count;
+    size_t dead_capacity;
+
+    ReactorMetrics metrics;
+
+#ifdef USE_EPOLL
+    int epoll_fd;
+#endif
+#ifdef USE_URING
+    Uring uring;
+#endif
+    struct pollfd *poll_fds;
+    void **poll_ptrs;
+    nfds_t poll_count;
+    nfds_t poll_capacity;
+};
+
+Reactor reactors[MAX_REACTORS];
+int reactor_count = 1;
+pthread_mutex_t bus_lock = PTHREAD_MUTEX_INITIALIZER;
+atomic_ulong next_client_id = 1;
+
+// Markers for the non-client fds registered with a reactor
+char listener_tag;
+char wakeup_tag;
+
+#define isClientTag(ptr) ((ptr) != &listener_tag && (ptr) != &wakeup_tag)
+
+Client *addClient(Reactor *reactor, int fd) {
+    if (reactor->client_count == reactor->client_capacity) {
+        size_t capacity = reactor->client_capacity == 0 ? 16 : reactor->client_capacity * 2;
+        Client **grown = (Client**)realloc(reactor->clients, capacity * sizeof(Client*));
+        if (grown == NULL) {
+            return NULL;
+        }
+        reactor->clients = grown;
+        reactor->client_capacity = capacity;
+    }
+    Client *client = (Client*)calloc(1, sizeof(Client));
+    if (client == NULL) {
+        return NULL;
+    }
+    client->fd = fd;
+    client->id = atomic_fetch_add(&next_client_id, 1);
+    client->reactor = reactor;
+    client->index = reactor->client_count;
+    reactor->clients[reactor->client_count++] = client;
+    metricAdd(&reactor->metrics.online, 1);
+    return client;
+}
+
+void releaseMessage(Message *message);
+
+int listAdd(ClientList *list, Client *client) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity == 0 ? 8 : list->capacity * 2;
+        Client **grown = (Client**)realloc(list->clients, capacity * sizeof(Client*));
+        if (grown == NULL) {
+            return -1;
+        }
+        list->clients = grown;
+        list->capacity = capacity;
+    }
+    list->clients[list->count++] = client;
+    return 0;
+}
+
+void listRemove(ClientList *list, Client *client) {
+    for (size_t i = 0; i < list->count; i++) {
+        if (list->clients[i] == client) {
+            list->clients[i] = list->clients[--list->count];
+            return;
+        }
+    }
+}
+
+// Add a named client to its reactor's spatial index (add = 1) or take it out (add = 0)
+void markDead(Client *client);
+
+void indexClient(Client *client, int add) {
+    Reactor *reactor = client->reactor;
+
+    if (client->has_view && !client->view_fallback) {
+        for (int by = client->view_y / view_bucket_size; by <= (client->view_y + client->view_h - 1) / view_bucket_size; by++) {
+            for (int bx = client->view_x / view_bucket_size; bx <= (client->view_x + client->view_w - 1) / view_bucket_size; bx++) {
+                ClientList *bucket = &reactor->view_buckets[by * view_buckets_across + bx];
+                if (!add) {
+                    listRemove(bucket, client);
+                } else if (listAdd(bucket, client) < 0) {
+                    // Out of memory: leave the buckets it got into and send it every change instead
+                    indexClient(client, 0);
+                    client->view_fallback = 1;
+                    indexClient(client, 1);
+                    return;
+                }
+            }
+        }
+        return;
+    }
+    if (!add) {
+        listRemove(&reactor->full_view, client);
+        client->view_fallback = 0;
+    } else if (listAdd(&reactor->full_view, client) < 0) {
+        markDead(client); // It would never hear about a change again
+    }
+}
+
+void zerocopyReleaseAll(Client *client);
+
+// Take a client out of its reactor's tables; its memory stays until freeClient()
+void unlinkClient(Client *client) {
+    Reactor *reactor = client->reactor;
+    if (client->username[0] != '\0') {
+        indexClient(client, 0);
+    }
+    // Move the last entry into the freed slot to keep the table dense
+    reactor->clients[client->index] = reactor->clients[--reactor->client_count];
+    reactor->clients[client->index]->index = client->index;
+    metricSub(&reactor->metrics.queued_bytes, client->out_bytes);
+    metricSub(&reactor->metrics.online, 1);
+}
+
+void freeClient(Client *client) {
+    for (size_t i = 0; i < client->out_count; i++) {
+        releaseMessage(client->outbound[(client->out_head + i) % client->out_capacity].message);
+    }
+    zerocopyReleaseAll(client);
+    free(client->send_msgs);
+    free(client->send_iov);
+    free(client->outbound);
+    free(client->inbound);
+    free(client);
+}
+
+void removeClient(Client *client) {
+    unlinkClient(client);
+    freeClient(client);
+}
+
+#ifdef USE_URING
+/*
+ * io_uring backend (-b uring). Each reactor owns a ring it alone submits to:
+ * a multishot accept on its listener, a multishot receive per client fed
+ * from a ring of provided buffers, a read on the wakeup eventfd, and for
+ * output a chain of linked sends over the client's queued messages. The
+ * kernel reports all of it as completions, so one io_uring_enter() per loop
+ * iteration both submits everything queued and waits for more.
+ *
+ * A completion's user_data is the Client pointer (or NULL) with the
+ * operation in the low bits.
+ */
+#define URING_ACCEPT 1
+#define URING_WAKE 2
+#define URING_RECV 3
+#define URING_SEND 4
+#define URING_OP_MASK 7
+
+int uringEnter(Reactor *reactor, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t size) {
+    metricAdd(&reactor->metrics.syscalls, 1);
+    return (int)syscall(__NR_io_uring_enter, reactor->uring.fd, to_submit, min_complete, flags, arg, size);
+}
+
+// Create the ring; must run on the reactor's own thread, which is then the only one allowed to submit
+int uringInit(Reactor *reactor) {
+    Uring *ring = &reactor->uring;
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    params.cq_entries = URING_ENTRIES * 4;
+    ring->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->fd < 0 && errno == EINVAL) {
+        // Kernels before 6.1 lack deferred task running; completions then arrive asynchronously
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = URING_ENTRIES * 4;
+        ring->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    }
+    if (ring->fd < 0 || !(params.features & IORING_FEAT_EXT_ARG)) {
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    }
+    char *sq = (char*)mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        return -1;
+    }
+    char *cq = sq;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = (char*)mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            return -1;
+        }
+    }
+    ring->sqes = (struct io_uring_sqe*)mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                                            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        return -1;
+    }
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    // Slot i of the submission array always names sqe i
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+        ring->sq_array[i] = i;
+    }
+
+    // Receive buffers the kernel picks from as data arrives, instead of one buffer parked per client
+    ring->buffer_ring = (struct io_uring_buf_ring*)mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf),
+                                                        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->buffers = (char*)malloc((size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+    if (ring->buffer_ring == MAP_FAILED || ring->buffers == NULL) {
+        return -1;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->buffer_ring;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return -1;
+    }
+    for (unsigned i = 0; i < URING_BUFFERS; i++) {
+        struct io_uring_buf *buf = &ring->buffer_ring->bufs[i];
+        buf->addr = (uint64_t)(uintptr_t)(ring->buffers + (size_t)i * URING_BUFFER_SIZE);
+        buf->len = URING_BUFFER_SIZE;
+        buf->bid = i;
+    }
+    atomic_store_explicit((_Atomic uint16_t*)&ring->buffer_ring->tail, URING_BUFFERS, memory_order_release);
+    return 0;
+}
+
+// Hand receive buffer id back to the kernel
+void uringRecycle(Reactor *reactor, unsigned id) {
+    struct io_uring_buf_ring *buffer_ring = reactor->uring.buffer_ring;
+    uint16_t tail = buffer_ring->tail;
+    struct io_uring_buf *buf = &buffer_ring->bufs[tail & (URING_BUFFERS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(reactor->uring.buffers + (size_t)id * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = id;
+    atomic_store_explicit((_Atomic uint16_t*)&buffer_ring->tail, (uint16_t)(tail + 1), memory_order_release);
+}
+
+// Submit everything queued so far without waiting
+void uringSubmit(Reactor *reactor) {
+    Uring *ring = &reactor->uring;
+    while (ring->to_submit > 0) {
+        int submitted = uringEnter(reactor, ring->to_submit, 0, 0, NULL, 0);
+        if (submitted < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            logAt(LOG_ERROR, "io_uring submit: %s\n", strerror(errno));
+            exit(1);
+        }
+        ring->to_submit -= submitted;
+    }
+}
+
+// Free submission slots; the kernel consumes them all on every io_uring_enter()
+unsigned uringSpace(Reactor *reactor) {
+    Uring *ring = &reactor->uring;
+    unsigned head = atomic_load_explicit((_Atomic unsigned*)ring->sq_head, memory_order_acquire);
+    return ring->sq_entries - (*ring->sq_tail - head);
+}
+
+// Claim the next submission slot, zeroed. Without SQPOLL the kernel only reads
+// the ring inside io_uring_enter(), so the tail can move before the entry is filled.
+struct io_uring_sqe *uringSqe(Reactor *reactor, uint8_t opcode, int fd, uint64_t user_data) {
+    Uring *ring = &reactor->uring;
+    if (uringSpace(reactor) == 0) {
+        uringSubmit(reactor);
+    }
+    unsigned tail = *ring->sq_tail;
+    struct io_uring_sqe *sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+    atomic_store_explicit((_Atomic unsigned*)ring->sq_tail, tail + 1, memory_order_release);
+    ring->to_submit++;
+    return sqe;
+}
+
+void uringAccept(Reactor *reactor) {
+    struct io_uring_sqe *sqe = uringSqe(reactor, IORING_OP_ACCEPT, reactor->listen_fd, URING_ACCEPT);
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+void uringWake(Reactor *reactor) {
+    struct io_uring_sqe *sqe = uringSqe(reactor, IORING_OP_READ, reactor->wake_fd, URING_WAKE);
+    sqe->addr = (uint64_t)(uintptr_t)&reactor->uring.wake_value;
+    sqe->len = sizeof(reactor->uring.wake_value);
+    sqe->off = (uint64_t)-1;
+}
+
+int uringRecv(Client *client) {
+    struct io_uring_sqe *sqe = uringSqe(client->reactor, IORING_OP_RECV, client->fd, (uint64_t)(uintptr_t)client | URING_RECV);
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    client->recv_armed = 1;
+    return 0;
+}
+
+// Send the head of the outbound queue as a chain of linked sendmsg operations,
+// each gathering up to FLUSH_IOVECS messages like flushClient() does. MSG_WAITALL
+// makes a short send fail the link, so the rest of the chain is cancelled rather
+// than written out of order. Only one chain per client is in flight at a time.
+void uringSend(Client *client) {
+    Reactor *reactor = client->reactor;
+    if (client->send_ops > 0 || client->out_count == 0 || client->dead) {
+        return;
+    }
+    size_t count = client->out_count < URING_CHAIN * FLUSH_IOVECS ? client->out_count : URING_CHAIN * FLUSH_IOVECS;
+    if (client->send_msgs == NULL) {
+        client->send_msgs = (struct msghdr*)calloc(URING_CHAIN, sizeof(struct msghdr));
+    }
+    if (count > client->send_iov_capacity) {
+        // Most clients only ever have a few messages queued
+        size_t capacity = client->send_iov_capacity == 0 ? 8 : client->send_iov_capacity;
+        while (capacity < count) {
+            capacity *= 2;
+        }
+        struct iovec *grown = (struct iovec*)realloc(client->send_iov, capacity * sizeof(struct iovec));
+        if (grown == NULL) {
+            markDead(client);
+            return;
+        }
+        client->send_iov = grown;
+        client->send_iov_capacity = capacity;
+    }
+    if (client->send_msgs == NULL) {
+        markDead(client);
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        OutboundEntry *entry = &client->outbound[(client->out_head + i) % client->out_capacity];
+        client->send_iov[i].iov_base = entry->message->data + entry->offset;
+        client->send_iov[i].iov_len = entry->message->length - entry->offset;
+    }
+
+    int ops = (int)((count + FLUSH_IOVECS - 1) / FLUSH_IOVECS);
+    // A chain split across two io_uring_enter() calls would be two chains
+    if (uringSpace(reactor) < (unsigned)ops) {
+        uringSubmit(reactor);
+    }
+    for (int op = 0; op < ops; op++) {
+        struct msghdr *msg = &client->send_msgs[op];
+        size_t first = (size_t)op * FLUSH_IOVECS;
+        memset(msg, 0, sizeof(*msg));
+        msg->msg_iov = &client->send_iov[first];
+        msg->msg_iovlen = count - first < FLUSH_IOVECS ? count - first : FLUSH_IOVECS;
+        struct io_uring_sqe *sqe = uringSqe(reactor, IORING_OP_SENDMSG, client->fd, (uint64_t)(uintptr_t)client | URING_SEND);
+        sqe->addr = (uint64_t)(uintptr_t)msg;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        if (op + 1 < ops) {
+            sqe->flags = IOSQE_IO_LINK;
+        }
+    }
+    client->send_ops = ops;
+    client->out_inflight = count;
+}
+
+// Close and free a disconnected client once the kernel holds nothing of it any more
+void uringRetire(Client *client) {
+    if (client->closing && !client->recv_armed && client->send_ops == 0) {
+        metricAdd(&client->reactor->metrics.syscalls, 1);
+        close(client->fd);
+        freeClient(client);
+    }
+}
+#endif
+
+/*
+ * Event notification for the readiness backends: edge-triggered epoll
+ * (the default on Linux) or poll(). Registered fds carry a pointer back to
+ * their Client, or one of the tags above. The io_uring backend is
+ * completion based and runs its own loop (uringRun); here it only arms a
+ * client's receive.
+ */
+typedef struct {
+    void *ptr;
+    int readable;
+    int writable;
+    int hangup;
+    int error; // Also set when zero-copy completions are waiting on the error queue
+} Event;
+
+int eventInit(Reactor *reactor) {
+#ifdef USE_EPOLL
+    if (event_backend == BACKEND_EPOLL) {
+        metricAdd(&reactor->metrics.syscalls, 1);
+        reactor->epoll_fd = epoll_create1(0);
+        return reactor->epoll_fd;
+    }
+#endif
+    // poll() needs no setup; an io_uring is created by the thread that will use it
+    return 0;
+}
+
+int eventAdd(Reactor *reactor, int fd, void *ptr, int may_write) {
+#ifdef USE_EPOLL
+    if (event_backend == BACKEND_EPOLL) {
+        struct epoll_event ev;
+        // Edge-triggered EPOLLOUT only fires when the socket becomes writable again,
+        // so it can stay registered without a modify call per queued message
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | (may_write ? EPOLLOUT : 0);
+        ev.data.ptr = ptr;
+        metricAdd(&reactor->metrics.syscalls, 1);
+        return epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    }
+#endif
+#ifdef USE_URING
+    if (event_backend == BACKEND_URING) {
+        // The listener and wakeup fd are armed once the ring exists
+        return isClientTag(ptr) ? uringRecv((Client*)ptr) : 0;
+    }
+#endif
+    // POLLOUT is only requested through eventWatchWrite() while output is queued
+    if (reactor->poll_count == reactor->poll_capacity) {
+        nfds_t capacity = reactor->poll_capacity == 0 ? 16 : reactor->poll_capacity * 2;
+        struct pollfd *fds = (struct pollfd*)realloc(reactor->poll_fds, capacity * sizeof(struct pollfd));
+        if (fds == NULL) {
+            return -1;
+        }
+        reactor->poll_fds = fds;
+        void **ptrs = (void**)realloc(reactor->poll_ptrs, capacity * sizeof(void*));
+        if (ptrs == NULL) {
+            return -1;
+        }
+        reactor->poll_ptrs = ptrs;
+        reactor->poll_capacity = capacity;
+    }
+    reactor->poll_fds[reactor->poll_count].fd = fd;
+    reactor->poll_fds[reactor->poll_count].events = POLLIN;
+    reactor->poll_fds[reactor->poll_count].revents = 0;
+    if (isClientTag(ptr)) {
+        ((Client*)ptr)->poll_index = reactor->poll_count;
+    }
+    reactor->poll_ptrs[reactor->poll_count++] = ptr;
+    return 0;
+}
+
+// Level-triggered poll() must only ask for POLLOUT while output is queued;
+// EPOLLOUT is always registered and io_uring has no readiness to watch
+void eventWatchWrite(Client *client, int pending) {
+    if (event_backend != BACKEND_POLL) {
+        return;
+    }
+    client->reactor->poll_fds[client->poll_index].events = POLLIN | (pending ? POLLOUT : 0);
+}
+
+// Stop watching a client's socket; the poll() entry is swapped with the last one, which takes its place
+void eventRemove(Client *client) {
+    Reactor *reactor = client->reactor;
+#ifdef USE_EPOLL
+    if (event_backend == BACKEND_EPOLL) {
+        metricAdd(&reactor->metrics.syscalls, 1);
+        epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+        return;
+    }
+#endif
+    size_t i = client->poll_index;
+    reactor->poll_fds[i] = reactor->poll_fds[--reactor->poll_count];
+    reactor->poll_ptrs[i] = reactor->poll_ptrs[reactor->poll_count];
+    if (isClientTag(reactor->poll_ptrs[i])) {
+        ((Client*)reactor->poll_ptrs[i])->poll_index = i;
+    }
+}
+
+int eventWait(Reactor *reactor, Event *events, int max_events, int timeout) {
+    metricAdd(&reactor->metrics.syscalls, 1);
+#ifdef USE_EPOLL
+    if (event_backend == BACKEND_EPOLL) {
+        struct epoll_event ready[MAX_EVENTS];
+        int n = epoll_wait(reactor->epoll_fd, ready, max_events < MAX_EVENTS ? max_events : MAX_EVENTS, timeout);
+        for (int i = 0; i < n; i++) {
+            events[i].ptr = ready[i].data.ptr;
+            events[i].readable = (ready[i].events & EPOLLIN) != 0;
+            events[i].writable = (ready[i].events & EPOLLOUT) != 0;
+            events[i].hangup = (ready[i].events & (EPOLLHUP | EPOLLERR | EPOLLRDHUP)) != 0;
+            events[i].error = (ready[i].events & EPOLLERR) != 0;
+        }
+        return n;
+    }
+#endif
+    int activity = poll(reactor->poll_fds, reactor->poll_count, timeout);
+    int n = 0;
+    for (nfds_t i = 0; i < reactor->poll_count && activity > 0 && n < max_events; i++) {
+        if (reactor->poll_fds[i].revents != 0) {
+            events[n].ptr = reactor->poll_ptrs[i];
+            events[n].readable = (reactor->poll_fds[i].revents & POLLIN) != 0;
+            events[n].writable = (reactor->poll_fds[i].revents & POLLOUT) != 0;
+            events[n].hangup = (reactor->poll_fds[i].revents & (POLLHUP | POLLERR)) != 0;
+            events[n].error = (reactor->poll_fds[i].revents & POLLERR) != 0;
+            n++;
+        }
+    }
+    return activity < 0 ? activity : n;
+}
+
+int setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+Message *createMessage(MessageKind kind, const char *data, size_t length, unsigned long exclude_id) {
+    Message *message = (Message*)malloc(sizeof(Message) + length);
+    if (message == NULL) {
+        return NULL;
+    }
+    atomic_init(&message->refs, 1);
+    message->kind = kind;
+    message->exclude_id = exclude_id;
+    message->binary = NULL;
+    message->rle = NULL;
+    message->has_area = 0;
+    message->published = 0;
+    message->length = length;
+    memcpy(message->data, data, length);
+    return message;
+}
+
+// Allocate a binary frame with room for the payload, which the caller fills in
+Message *createFrame(MessageKind kind, uint8_t type, size_t payload_length, unsigned long exclude_id) {
+    Message *frame = (Message*)malloc(sizeof(Message) + FRAME_HEADER_SIZE + payload_length);
+    if (frame == NULL) {
+        return NULL;
+    }
+    atomic_init(&frame->refs, 1);
+    frame->kind = kind;
+    frame->exclude_id = exclude_id;
+    frame->binary = NULL;
+    frame->rle = NULL;
+    frame->has_area = 0;
+    frame->published = 0;
+    frame->length = FRAME_HEADER_SIZE + payload_length;
+    put_frame_header((unsigned char*)frame->data, type, payload_length);
+    return frame;
+}
+
+// Text for telnet users plus the same text wrapped in a frame_type frame for binary clients
+Message *createTextMessage(MessageKind kind, uint8_t frame_type, const char *text, size_t length, unsigned long exclude_id) {
+    Message *message = createMessage(kind, text, length, exclude_id);
+    if (message == NULL) {
+        return NULL;
+    }
+    message->binary = createFrame(kind, frame_type, length, exclude_id);
+    if (message->binary != NULL) {
+        memcpy(message->binary->data + FRAME_HEADER_SIZE, text, length);
+    }
+    return message;
+}
+
+void retainMessage(Message *message) {
+    atomic_fetch_add(&message->refs, 1);
+}
+
+void releaseMessage(Message *message) {
+    if (atomic_fetch_sub(&message->refs, 1) == 1) {
+        if (message->binary != NULL) {
+            releaseMessage(message->binary);
+        }
+        if (message->rle != NULL) {
+            releaseMessage(message->rle);
+        }
+        free(message);
+    }
+}
+
+void sendClientBoard(Client *client);
+
+// Schedule a client for disconnect; it is closed after the current event batch
+void markDead(Client *client) {
+    Reactor *reactor = client->reactor;
+    if (client->dead) {
+        return;
+    }
+    if (reactor->dead_count == reactor->dead_capacity) {
+        size_t capacity = reactor->dead_capacity == 0 ? 16 : reactor->dead_capacity * 2;
+        Client **grown = (Client**)realloc(reactor->dead, capacity * sizeof(Client*));
+        if (grown == NULL) {
+            return;
+        }
+        reactor->dead = grown;
+        reactor->dead_capacity = capacity;
+    }
+    client->dead = 1;
+    reactor->dead[reactor->dead_count++] = client;
+}
+
+// Whether a batch of this size should go out with MSG_ZEROCOPY
+int zerocopyWanted(Client *client, size_t bytes) {
+#ifdef USE_ZEROCOPY
+    return client->zerocopy && zerocopy_threshold > 0 && bytes >= zerocopy_threshold;
+#else
+    (void)client;
+    (void)bytes;
+    return 0;
+#endif
+}
+
+// Keep a message alive until the kernel reports zero-copy send id complete
+int zerocopyHold(Client *client, Message *message, uint32_t id) {
+    if (client->zerocopy_count == client->zerocopy_capacity) {
+        size_t capacity = client->zerocopy_capacity == 0 ? 8 : client->zerocopy_capacity * 2;
+        ZerocopyHold *grown = (ZerocopyHold*)malloc(capacity * sizeof(ZerocopyHold));
+        if (grown == NULL) {
+            return -1;
+        }
+        for (size_t i = 0; i < client->zerocopy_count; i++) {
+            grown[i] = client->zerocopy_holds[(client->zerocopy_head + i) % client->zerocopy_capacity];
+        }
+        free(client->zerocopy_holds);
+        client->zerocopy_holds = grown;
+        client->zerocopy_head = 0;
+        client->zerocopy_capacity = capacity;
+    }
+    retainMessage(message);
+    client->zerocopy_holds[(client->zerocopy_head + client->zerocopy_count++) % client->zerocopy_capacity] =
+        (ZerocopyHold){ message, id };
+    return 0;
+}
+
+void zerocopyReleaseAll(Client *client) {
+    for (size_t i = 0; i < client->zerocopy_count; i++) {
+        releaseMessage(client->zerocopy_holds[(client->zerocopy_head + i) % client->zerocopy_capacity].message);
+    }
+    free(client->zerocopy_holds);
+    client->zerocopy_holds = NULL;
+    client->zerocopy_count = 0;
+}
+
+// Read zero-copy completions from the socket's error queue and release what they cover
+void zerocopyReap(Client *client) {
+#ifdef USE_ZEROCOPY
+    for (;;) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        metricAdd(&client->reactor->metrics.syscalls, 1);
+        if (recvmsg(client->fd, &msg, MSG_ERRQUEUE) < 0) {
+            return; // EAGAIN: nothing more queued
+        }
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR) {
+                continue;
+            }
+            struct sock_extended_err *err = (struct sock_extended_err*)CMSG_DATA(cmsg);
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                // Pinning pages only costs here (loopback, devices without scatter-gather)
+                metricAdd(&client->reactor->metrics.zerocopy_copied, err->ee_data - err->ee_info + 1);
+                client->zerocopy = 0;
+            }
+            // TCP completes sends in order: ids up to ee_data are all done
+            while (client->zerocopy_count > 0) {
+                ZerocopyHold *hold = &client->zerocopy_holds[client->zerocopy_head];
+                if ((int32_t)(hold->id - err->ee_data) > 0) {
+                    break;
+                }
+                releaseMessage(hold->message);
+                client->zerocopy_head = (client->zerocopy_head + 1) % client->zerocopy_capacity;
+                client->zerocopy_count--;
+            }
+        }
+    }
+#else
+    (void)client;
+#endif
+}
+
+/*
+ * Write queued messages until the queue is empty or the socket would block.
+ * Messages are shared and immutable, so up to FLUSH_IOVECS of them are
+ * handed to a single sendmsg() straight from their buffers; nothing is
+ * copied per client.
+ */
+void flushClient(Client *client) {
+    int allow_zerocopy = 1;
+
+#ifdef USE_URING
+    if (event_backend == BACKEND_URING) {
+        // Completions of the chain in flight call back here for the rest
+        if (client->send_ops == 0) {
+            if (client->out_count == 0 && client->needs_snapshot && !client->dead) {
+                client->needs_snapshot = 0;
+                sendClientBoard(client);
+            }
+            uringSend(client);
+        }
+        return;
+    }
+#endif
+    while (client->out_count > 0 && !client->dead) {
+        struct iovec iov[FLUSH_IOVECS];
+        struct msghdr msg;
+        size_t count = 0, batch = 0;
+
+        while (count < client->out_count && count < FLUSH_IOVECS) {
+            OutboundEntry *entry = &client->outbound[(client->out_head + count) % client->out_capacity];
+            iov[count].iov_base = entry->message->data + entry->offset;
+            iov[count].iov_len = entry->message->length - entry->offset;
+            batch += iov[count].iov_len;
+            count++;
+        }
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+
+        int zerocopy = allow_zerocopy && zerocopyWanted(client, batch);
+        int flags = MSG_NOSIGNAL;
+#ifdef USE_ZEROCOPY
+        if (zerocopy) {
+            flags |= MSG_ZEROCOPY;
+        }
+#endif
+        metricAdd(&client->reactor->metrics.syscalls, 1);
+        ssize_t sent = sendmsg(client->fd, &msg, flags);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (zerocopy && errno == ENOBUFS) {
+                allow_zerocopy = 0; // Too many sends pinned; copy until some complete
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                markDead(client);
+            }
+            break;
+        }
+        metricAdd(&client->reactor->metrics.send_calls, 1);
+
+        if (zerocopy) {
+            // Every message this send read from stays pinned until its completion
+            size_t covered = 0;
+            for (size_t i = 0; covered < (size_t)sent; i++) {
+                OutboundEntry *entry = &client->outbound[(client->out_head + i) % client->out_capacity];
+                if (zerocopyHold(client, entry->message, client->zerocopy_next) < 0) {
+                    markDead(client); // Cannot free it safely any more; keep it referenced instead
+                    retainMessage(entry->message);
+                }
+                covered += iov[i].iov_len;
+            }
+            client->zerocopy_next++;
+            metricAdd(&client->reactor->metrics.zerocopy_sends, 1);
+        }
+
+        client->out_bytes -= sent;
+        metricAdd(&client->reactor->metrics.bytes_out, sent);
+        metricSub(&client->reactor->metrics.queued_bytes, sent);
+        size_t remaining = sent;
+        while (remaining > 0) {
+            OutboundEntry *entry = &client->outbound[client->out_head];
+            size_t take = entry->message->length - entry->offset;
+            if (take > remaining) {
+                take = remaining;
+            }
+            entry->offset += take;
+            remaining -= take;
+            if (entry->offset == entry->message->length) {
+                releaseMessage(entry->message);
+                client->out_head = (client->out_head + 1) % client->out_capacity;
+                client->out_count--;
+            }
+        }
+        if ((size_t)sent < batch) {
+            break; // Socket buffer is full
+        }
+    }
+
+    if (client->out_count == 0 && client->needs_snapshot && !client->dead) {
+        client->needs_snapshot = 0;
+        sendClientBoard(client);
+    }
+    eventWatchWrite(client, client->out_count > 0);
+}
+
+// While the reactor is corked, flush this client once at the end of the iteration
+void scheduleFlush(Client *client) {
+    Reactor *reactor = client->reactor;
+    if (client->flush_pending) {
+        return;
+    }
+    if (reactor->flush_count == reactor->flush_capacity) {
+        size_t capacity = reactor->flush_capacity == 0 ? 64 : reactor->flush_capacity * 2;
+        Client **grown = (Client**)realloc(reactor->flush_list, capacity * sizeof(Client*));
+        if (grown == NULL) {
+            flushClient(client);
+            return;
+        }
+        reactor->flush_list = grown;
+        reactor->flush_capacity = capacity;
+    }
+    client->flush_pending = 1;
+    reactor->flush_list[reactor->flush_count++] = client;
+}
+
+// Send everything queued while corked, one sendmsg() batch per client
+void uncorkReactor(Reactor *reactor) {
+    reactor->corked = 0;
+    for (size_t i = 0; i < reactor->flush_count; i++) {
+        Client *client = reactor->flush_list[i];
+        client->flush_pending = 0;
+        if (!client->dead) {
+            flushClient(client);
+        }
+    }
+    reactor->flush_count = 0;
+}
+
+// Throw away board frames that have not started going out; a fresh snapshot replaces them.
+// Entries with an io_uring send in flight have started, whatever their offset says.
+void dropQueuedBoardFrames(Client *client) {
+    size_t kept = 0;
+    for (size_t i = 0; i < client->out_count; i++) {
+        OutboundEntry entry = client->outbound[(client->out_head + i) % client->out_capacity];
+        if (entry.message->kind == MESSAGE_BOARD && entry.offset == 0 && i >= client->out_inflight) {
+            client->out_bytes -= entry.message->length;
+            metricSub(&client->reactor->metrics.queued_bytes, entry.message->length);
+            releaseMessage(entry.message);
+        } else {
+            client->outbound[(client->out_head + kept++) % client->out_capacity] = entry;
+        }
+    }
+    client->out_count = kept;
+}
+
+int pushOutbound(Client *client, Message *message, size_t offset) {
+    if (client->out_count == client->out_capacity) {
+        size_t capacity = client->out_capacity == 0 ? 8 : client->out_capacity * 2;
+        OutboundEntry *grown = (OutboundEntry*)malloc(capacity * sizeof(OutboundEntry));
+        if (grown == NULL) {
+            return -1;
+        }
+        // Unwrap the ring into the new storage
+        for (size_t i = 0; i < client->out_count; i++) {
+            grown[i] = client->outbound[(client->out_head + i) % client->out_capacity];
+        }
+        free(client->outbound);
+        client->outbound = grown;
+        client->out_head = 0;
+        client->out_capacity = capacity;
+    }
+    retainMessage(message);
+    client->outbound[(client->out_head + client->out_count++) % client->out_capacity] =
+        (OutboundEntry){ message, offset };
+    client->out_bytes += message->length - offset;
+    metricAdd(&client->reactor->metrics.queued_bytes, message->length - offset);
+    return 0;
+}
+
+/*
+ * Send a message to one client without ever blocking the reactor. If nothing
+ * is queued we try to write it straight away; whatever does not fit is queued
+ * and flushed on EPOLLOUT. Slow consumers are handled per slow_policy.
+ */
+void clientQueueEncoded(Client *client, Message *message) {
+    size_t offset = 0;
+
+    if (client->dead) {
+        return;
+    }
+    if (message->kind == MESSAGE_BOARD && client->needs_snapshot) {
+        return; // Superseded by the snapshot we owe this client
+    }
+
+    // A frame bigger than the mark by itself (a large snapshot or region) only counts once the queue is
+    // past the mark, or it could never be sent. The text queued with it, like the greeting, doesn't matter.
+    size_t counted = message->length > high_water ? 0 : message->length;
+    if (client->out_bytes + counted > high_water) {
+        if (slow_policy == SLOW_DISCONNECT) {
+            logAt(LOG_WARN, "Client %s is too slow, disconnecting.\n", client->username);
+            metricAdd(&client->reactor->metrics.slow_disconnects, 1);
+            markDead(client);
+            return;
+        }
+        if (message->kind == MESSAGE_BOARD) {
+            dropQueuedBoardFrames(client);
+            client->needs_snapshot = 1;
+            metricAdd(&client->reactor->metrics.coalesced, 1);
+            return;
+        }
+        if (client->out_bytes > high_water * 4) {
+            // Even chat alone is piling up; give up on this reader
+            logAt(LOG_WARN, "Client %s is too slow, disconnecting.\n", client->username);
+            metricAdd(&client->reactor->metrics.slow_disconnects, 1);
+            markDead(client);
+            return;
+        }
+    }
+
+    // Fast path: nothing queued and nothing to batch it with. Zero-copy and
+    // io_uring sends need the message held in the queue until they complete.
+    int send_now = client->out_count == 0 && !client->reactor->corked;
+    int direct = send_now && !zerocopyWanted(client, message->length) && event_backend != BACKEND_URING;
+    if (direct) {
+        for (;;) {
+            metricAdd(&client->reactor->metrics.syscalls, 1);
+            ssize_t sent = send(client->fd, message->data + offset, message->length - offset, MSG_NOSIGNAL);
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                markDead(client);
+                return;
+            }
+            if (sent > 0) {
+                offset += sent;
+                metricAdd(&client->reactor->metrics.bytes_out, sent);
+                metricAdd(&client->reactor->metrics.send_calls, 1);
+            }
+            break;
+        }
+        if (offset == message->length) {
+            return;
+        }
+    }
+
+    if (pushOutbound(client, message, offset) < 0) {
+        markDead(client);
+        return;
+    }
+    if (client->reactor->corked) {
+        scheduleFlush(client);
+    } else if (send_now && !direct) {
+        flushClient(client);
+    } else {
+        eventWatchWrite(client, 1);
+    }
+}
+
+// Queue a message in the encoding this client speaks
+void clientQueueMessage(Client *client, Message *message) {
+    if (client->protocol == PROTOCOL_BINARY) {
+        if (message->rle != NULL && (client->features & HELLO_FLAG_RLE)) {
+            clientQueueEncoded(client, message->rle);
+            return;
+        }
+        // Every message is built with both encodings; only a failed allocation leaves this NULL
+        if (message->binary == NULL) {
+            return;
+        }
+        message = message->binary;
+    }
+    clientQueueEncoded(client, message);
+}
+
+void clientSend(Client *client, MessageKind kind, const char *data, size_t length) {
+    Message *message = createTextMessage(kind, FRAME_TEXT, data, length, 0);
+    if (message == NULL) {
+        markDead(client);
+        return;
+    }
+    clientQueueMessage(client, message);
+    releaseMessage(message);
+}
+
+void clientSendText(Client *client, const char *text) {
+    clientSend(client, MESSAGE_TEXT, text, strlen(text));
+}
+
+// Interrupt a reactor blocked waiting for events. The write is left out of the
+// syscall metric since it is usually made by another thread.
+void wakeReactor(Reactor *reactor) {
+    unsigned long long one = 1;
+    if (reactor->wake_fd >= 0 && write(reactor->wake_fd, &one, sizeof(one)) < 0) {
+        logAt(LOG_ERROR, "wakeup: %s\n", strerror(errno));
+    }
+}
+
+// Queue a message on every reactor's mailbox, each holding its own reference.
+// Caller must hold bus_lock and still owns (and releases) its reference.
+void publishMessageLocked(Message *message) {
+    message->published = monotonicNanos();
+    for (int i = 0; i < reactor_count; i++) {
+        Reactor *reactor = &reactors[i];
+        int was_empty;
+
+        pthread_mutex_lock(&reactor->mailbox_lock);
+        if (reactor->mailbox_count == reactor->mailbox_capacity) {
+            size_t capacity = reactor->mailbox_capacity == 0 ? 64 : reactor->mailbox_capacity * 2;
+            Message **grown = (Message**)realloc(reactor->mailbox, capacity * sizeof(Message*));
+            if (grown == NULL) {
+                pthread_mutex_unlock(&reactor->mailbox_lock);
+                continue;
+            }
+            reactor->mailbox = grown;
+            reactor->mailbox_capacity = capacity;
+        }
+        was_empty = reactor->mailbox_count == 0;
+        retainMessage(message);
+        reactor->mailbox[reactor->mailbox_count++] = message;
+        pthread_mutex_unlock(&reactor->mailbox_lock);
+
+        // Only the first pending message needs to wake the reactor up
+        if (was_empty) {
+            wakeReactor(reactor);
+        }
+    }
+}
+
+// Send a text message to every named client except the sender (pass NULL to include everyone).
+// Binary clients get it as a frame_type frame (FRAME_TEXT for notices, FRAME_CHAT for chat).
+void broadcastMessage(uint8_t frame_type, const char *text, size_t length, Client *sender) {
+    Message *message = createTextMessage(MESSAGE_TEXT, frame_type, text, length, sender != NULL ? sender->id : 0);
+    if (message == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&bus_lock);
+    publishMessageLocked(message);
+    pthread_mutex_unlock(&bus_lock);
+    releaseMessage(message);
+}
+
+// Deliver everything other threads (and this one) published since the last drain
+void drainMailbox(Reactor *reactor) {
+    Message **pending;
+    size_t count;
+
+    pthread_mutex_lock(&reactor->mailbox_lock);
+    pending = reactor->mailbox;
+    count = reactor->mailbox_count;
+    reactor->mailbox = NULL;
+    reactor->mailbox_count = 0;
+    reactor->mailbox_capacity = 0;
+    pthread_mutex_unlock(&reactor->mailbox_lock);
+
+    if (count > 0) {
+        histogramRecord(&reactor->metrics.mailbox_depth, count);
+    }
+    for (size_t m = 0; m < count; m++) {
+        Message *message = pending[m];
+        if (!message->has_area) {
+            for (size_t i = 0; i < reactor->client_count; i++) {
+                Client *client = reactor->clients[i];
+                if (client->username[0] != '\0' && client->id != message->exclude_id) {
+                    clientQueueMessage(client, message);
+                }
+            }
+        } else {
+            // Board change: clients without a view, then the views it overlaps, each once
+            unsigned long serial = ++reactor->delivery_serial;
+            for (size_t i = 0; i < reactor->full_view.count; i++) {
+                clientQueueMessage(reactor->full_view.clients[i], message);
+            }
+            for (int by = message->y0 / view_bucket_size; by <= message->y1 / view_bucket_size; by++) {
+                for (int bx = message->x0 / view_bucket_size; bx <= message->x1 / view_bucket_size; bx++) {
+                    ClientList *bucket = &reactor->view_buckets[by * view_buckets_across + bx];
+                    for (size_t i = 0; i < bucket->count; i++) {
+                        Client *client = bucket->clients[i];
+                        if (client->delivered != serial &&
+                            client->view_x <= message->x1 && message->x0 < client->view_x + client->view_w &&
+                            client->view_y <= message->y1 && message->y0 < client->view_y + client->view_h) {
+                            client->delivered = serial;
+                            clientQueueMessage(client, message);
+                        }
+                    }
+                }
+            }
+        }
+        histogramRecordSince(&reactor->metrics.fanout_time, message->published);
+        releaseMessage(message);
+    }
+    free(pending);
+}
+
+// Render rows top..bottom (top > bottom, board coordinates) of columns x..x+w-1, one line each. Caller holds their shard locks.
+void renderRows(char *out, int x, int w, int top, int bottom) {
+    for (int y = top; y >= bottom; y--) { // Adjust to display the board correctly
+        boardCopyRow(out, x, y, w);
+        out[w] = '\n';
+        out += w + 1;
+    }
+}
+
+// Whole board small enough to go out as one snapshot frame
+#define boardFitsSnapshot() ((long long)board_width * board_height <= MAX_REGION_CELLS)
+
+/*
+ * Last rendered "BOARD:<seq>\n<rows>" frame. It is valid while its seq matches
+ * board_seq, so draw() and resetBoard() invalidate it just by bumping the
+ * sequence number. Lock order: board_frame_lock before the shard locks.
+ * Only used while boardFitsSnapshot().
+ */
+Message *board_frame = NULL;
+unsigned long board_frame_seq = 0;
+pthread_mutex_t board_frame_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Run-length encoded copy of a SNAPSHOT or REGION frame whose header is
+ * header_size bytes, as an rle_type frame. NULL when it would not be smaller,
+ * in which case everybody gets the plain frame.
+ */
+Message *compressBoardFrame(const Message *plain, uint8_t rle_type, size_t header_size) {
+    const unsigned char *payload = (const unsigned char*)plain->data + FRAME_HEADER_SIZE;
+    size_t cell_count = plain->length - FRAME_HEADER_SIZE - header_size;
+    Message *frame = createFrame(MESSAGE_BOARD, rle_type, header_size + rle_bound(cell_count), 0);
+    if (frame == NULL) {
+        return NULL;
+    }
+    unsigned char *out = (unsigned char*)frame->data + FRAME_HEADER_SIZE;
+    memcpy(out, payload, header_size);
+    size_t payload_length = header_size + rle_encode(out + header_size, payload + header_size, cell_count);
+    if (payload_length >= header_size + cell_count) {
+        releaseMessage(frame);
+        return NULL;
+    }
+    put_frame_header((unsigned char*)frame->data, rle_type, payload_length);
+    frame->length = FRAME_HEADER_SIZE + payload_length;
+    // Give back the worst-case room; a few hundred bytes usually remain
+    Message *shrunk = (Message*)realloc(frame, sizeof(Message) + frame->length);
+    return shrunk != NULL ? shrunk : frame;
+}
+
+// Build a full snapshot frame. Caller holds all shard locks.
+Message *renderBoardFrame(unsigned long seq) {
+    char header[32];
+    int header_len = sprintf(header, "BOARD:%lu\n", seq);
+    size_t rows_length = (size_t)(board_width + 1) * board_height;
+    Message *frame = (Message*)malloc(sizeof(Message) + header_len + rows_length);
+    if (frame == NULL) {
+        logAt(LOG_ERROR, "Failed to allocate memory for board string.\n");
+        return NULL;
+    }
+    atomic_init(&frame->refs, 1);
+    frame->kind = MESSAGE_BOARD;
+    frame->exclude_id = 0;
+    frame->rle = NULL;
+    frame->has_area = 0;
+    frame->published = 0;
+    frame->length = header_len + rows_length;
+    memcpy(frame->data, header, header_len);
+    renderRows(frame->data + header_len, 0, board_width, board_height - 1, 0);
+
+    // FRAME_SNAPSHOT: seq, width, height, then the rows top first without newlines
+    frame->binary = createFrame(MESSAGE_BOARD, FRAME_SNAPSHOT,
+                                SNAPSHOT_HEADER_SIZE + (size_t)board_width * board_height, 0);
+    if (frame->binary != NULL) {
+        unsigned char *payload = (unsigned char*)frame->binary->data + FRAME_HEADER_SIZE;
+        put_u64(payload, seq);
+        put_u32(payload + 8, board_width);
+        put_u32(payload + 12, board_height);
+        payload += SNAPSHOT_HEADER_SIZE;
+        for (int y = board_height - 1; y >= 0; y--) {
+            boardCopyRow((char*)payload, 0, y, board_width);
+            payload += board_width;
+        }
+    }
+    return frame;
+}
+
+// Build a "REGION:<seq> <x>,<y>,<w>,<h>\n<rows>" frame for part of the board. Caller holds the rows' shard locks.
+Message *renderRegionFrame(unsigned long seq, int x, int y, int w, int h) {
+    char header[96];
+    int header_len = sprintf(header, "REGION:%lu %d,%d,%d,%d\n", seq, x, y, w, h);
+    size_t rows_length = (size_t)(w + 1) * h;
+    Message *frame = (Message*)malloc(sizeof(Message) + header_len + rows_length);
+    if (frame == NULL) {
+        return NULL;
+    }
+    atomic_init(&frame->refs, 1);
+    frame->kind = MESSAGE_BOARD;
+    frame->exclude_id = 0;
+    frame->rle = NULL;
+    frame->has_area = 0;
+    frame->published = 0;
+    frame->length = header_len + rows_length;
+    memcpy(frame->data, header, header_len);
+    renderRows(frame->data + header_len, x, w, y + h - 1, y);
+
+    // FRAME_REGION: seq, x, y, width, height, then the rows top first without newlines
+    frame->binary = createFrame(MESSAGE_BOARD, FRAME_REGION, REGION_HEADER_SIZE + (size_t)w * h, 0);
+    if (frame->binary != NULL) {
+        unsigned char *payload = (unsigned char*)frame->binary->data + FRAME_HEADER_SIZE;
+        put_u64(payload, seq);
+        put_u32(payload + 8, x);
+        put_u32(payload + 12, y);
+        put_u32(payload + 16, w);
+        put_u32(payload + 20, h);
+        payload += REGION_HEADER_SIZE;
+        for (int row = y + h - 1; row >= y; row--) {
+            boardCopyRow((char*)payload, x, row, w);
+            payload += w;
+        }
+    }
+    return frame;
+}
+
+// Remember a freshly rendered frame unless a newer one is already cached
+void cacheBoardFrame(Message *frame, unsigned long seq) {
+    pthread_mutex_lock(&board_frame_lock);
+    if (board_frame == NULL || seq > board_frame_seq) {
+        if (board_frame != NULL) {
+            releaseMessage(board_frame);
+        }
+        retainMessage(frame);
+        board_frame = frame;
+        board_frame_seq = seq;
+    }
+    pthread_mutex_unlock(&board_frame_lock);
+}
+
+// Current snapshot frame with a reference for the caller; only re-rendered when the board changed
+Message *showBoard() {
+    Message *frame = NULL;
+
+    pthread_mutex_lock(&board_frame_lock);
+    if (board_frame == NULL || board_frame_seq != atomic_load(&board_seq)) {
+        // Holding every band keeps the render consistent with the sequence number
+        lockAllShards();
+        unsigned long seq = atomic_load(&board_seq);
+        frame = renderBoardFrame(seq);
+        unlockAllShards();
+        if (frame != NULL && frame->binary != NULL) {
+            frame->rle = compressBoardFrame(frame->binary, FRAME_SNAPSHOT_RLE, SNAPSHOT_HEADER_SIZE);
+        }
+        if (frame != NULL) {
+            if (board_frame != NULL) {
+                releaseMessage(board_frame);
+            }
+            board_frame = frame;
+            board_frame_seq = seq;
+        }
+    }
+    frame = board_frame;
+    if (frame != NULL) {
+        retainMessage(frame);
+    }
+    pthread_mutex_unlock(&board_frame_lock);
+    return frame;
+}
+
+/*
+ * Clip a requested rectangle to the board; -1 if nothing is left. Requests
+ * come in as 64-bit values, so 32-bit coordinates from a frame cannot
+ * overflow while they are clipped.
+ */
+int clipToBoard(long long x, long long y, long long w, long long h, int *cx, int *cy, int *cw, int *ch) {
+    if (x < 0) { w += x; x = 0; }
+    if (y < 0) { h += y; y = 0; }
+    if (w > board_width - x) w = board_width - x;
+    if (h > board_height - y) h = board_height - y;
+    if (w <= 0 || h <= 0) {
+        return -1;
+    }
+    *cx = (int)x;
+    *cy = (int)y;
+    *cw = (int)w;
+    *ch = (int)h;
+    return 0;
+}
+
+// Render part of the board, clipped to its edges; NULL if nothing is left or it is too big for one frame
+Message *showRegion(long long left, long long bottom, long long width, long long height) {
+    Message *frame;
+    int x, y, w, h;
+
+    if (clipToBoard(left, bottom, width, height, &x, &y, &w, &h) < 0 || (long long)w * h > MAX_REGION_CELLS) {
+        return NULL;
+    }
+    lockShards(y, y + h - 1);
+    frame = renderRegionFrame(atomic_load(&board_seq), x, y, w, h);
+    unlockShards(y, y + h - 1);
+    // Encoded outside the locks; nobody else holds the frame yet
+    if (frame != NULL && frame->binary != NULL) {
+        frame->rle = compressBoardFrame(frame->binary, FRAME_REGION_RLE, REGION_HEADER_SIZE);
+    }
+    return frame;
+}
+
+// Full snapshot: "BOARD:<seq>\n" followed by the rendered board, shared rather than copied.
+// Boards too big for that get the bottom-left corner instead; clients ask for other parts with /show x y w h.
+void sendBoardSnapshot(Client *client) {
+    Message *frame;
+    if (boardFitsSnapshot()) {
+        frame = showBoard();
+    } else {
+        frame = showRegion(0, 0, DEFAULT_BOARD_WIDTH, DEFAULT_BOARD_HEIGHT);
+    }
+    if (frame != NULL) {
+        clientQueueMessage(client, frame);
+        releaseMessage(frame);
+    }
+}
+
+// /show x y w h: the cells in a viewport, read straight from the tiles
+void sendRegion(Client *client, long long x, long long y, long long w, long long h) {
+    Message *frame;
+
+    if (w > MAX_REGION_CELLS || h > MAX_REGION_CELLS || w * h > MAX_REGION_CELLS) {
+        clientSendText(client, "Region too large.\n");
+        return;
+    }
+    frame = showRegion(x, y, w, h);
+    if (frame == NULL) {
+        clientSendText(client, "Invalid region.\n");
+        return;
+    }
+    clientQueueMessage(client, frame);
+    releaseMessage(frame);
+}
+
+// The board as this client sees it: its /view region, or the usual snapshot
+void sendClientBoard(Client *client) {
+    if (client->has_view) {
+        sendRegion(client, client->view_x, client->view_y, client->view_w, client->view_h);
+    } else {
+        sendBoardSnapshot(client);
+    }
+}
+
+void deltaBegin(BoardDelta *delta) {
+    memset(delta, 0, sizeof(*delta));
+}
+
+void deltaFree(BoardDelta *delta) {
+    free(delta->runs);
+    free(delta->cells);
+}
+
+// Append a horizontal run of cells. Caller holds the row's shard lock.
+int deltaAddRun(BoardDelta *delta, int x, int y, int len) {
+    if (delta->run_count == delta->run_capacity) {
+        int capacity = delta->run_capacity == 0 ? 64 : delta->run_capacity * 2;
+        DeltaRun *grown = (DeltaRun*)realloc(delta->runs, capacity * sizeof(DeltaRun));
+        if (grown == NULL) {
+            return -1;
+        }
+        delta->runs = grown;
+        delta->run_capacity = capacity;
+    }
+    if (delta->cell_count + len > delta->cell_capacity) {
+        size_t capacity = delta->cell_capacity == 0 ? 1024 : delta->cell_capacity * 2;
+        while (capacity < delta->cell_count + len) {
+            capacity *= 2;
+        }
+        char *grown = (char*)realloc(delta->cells, capacity);
+        if (grown == NULL) {
+            return -1;
+        }
+        delta->cells = grown;
+        delta->cell_capacity = capacity;
+    }
+    delta->runs[delta->run_count].x = x;
+    delta->runs[delta->run_count].y = y;
+    delta->runs[delta->run_count].len = len;
+    delta->run_count++;
+    boardCopyRow(delta->cells + delta->cell_count, x, y, len);
+    delta->cell_count += len;
+    return 0;
+}
+
+// Move the dirty cells of one tile inside [x0, x1] x [y0, y1] into the delta. Caller holds the rows' shard locks.
+void deltaAddTile(BoardDelta *delta, int index, int x0, int y0, int x1, int y1) {
+    Tile *tile = atomic_load(&tiles[index]);
+    int tile_x = (index % tiles_across) * TILE_SIZE;
+    int tile_y = (index / tiles_across) * TILE_SIZE;
+    int first = x0 > tile_x ? x0 - tile_x : 0;
+    int last = x1 < tile_x + TILE_SIZE - 1 ? x1 - tile_x : TILE_SIZE - 1;
+    uint64_t columns = (last - first == TILE_SIZE - 1 ? ~0ULL : (1ULL << (last - first + 1)) - 1) << first;
+
+    if (tile == NULL) {
+        return;
+    }
+    for (int row = 0; row < TILE_SIZE; row++) {
+        int y = tile_y + row;
+        uint64_t bits = tile->dirty[row] & columns;
+        if (y < y0 || y > y1 || bits == 0) {
+            continue;
+        }
+        tile->dirty[row] &= ~bits;
+        int x = first;
+        while (x <= last) {
+            if (!(bits >> x & 1)) {
+                x++;
+                continue;
+            }
+            // Extend the run over short gaps of unchanged cells
+            int start = x, end = x + 1, gap = 0;
+            for (x++; x <= last && gap < DELTA_MERGE_GAP; x++) {
+                if (bits >> x & 1) {
+                    end = x + 1;
+                    gap = 0;
+                } else {
+                    gap++;
+                }
+            }
+            x = end;
+            deltaAddRun(delta, tile_x + start, y, end - start);
+        }
+    }
+}
+
+// Move every dirty cell inside [x0, x1] x [y0, y1] into the delta. Caller holds the rows' shard locks.
+void deltaAddDirty(BoardDelta *delta, int x0, int y0, int x1, int y1) {
+    for (int ty = y0 / TILE_SIZE; ty <= y1 / TILE_SIZE; ty++) {
+        for (int tx = x0 / TILE_SIZE; tx <= x1 / TILE_SIZE; tx++) {
+            deltaAddTile(delta, ty * tiles_across + tx, x0, y0, x1, y1);
+        }
+    }
+}
+
+/*
+ * Encode runs once per protocol: "DELTA:<seq> <x>,<y>,<len>:<cells> ...\n"
+ * for telnet users, FRAME_DELTA for binary clients.
+ */
+Message *encodeDelta(const DeltaRun *runs, int run_count, const char *cells, size_t cell_count, unsigned long seq) {
+    size_t text_length = 32 + cell_count + run_count * 40;
+    char *text = (char*)malloc(text_length);
+    const char *cell = cells;
+    size_t length;
+
+    if (text == NULL) {
+        return NULL;
+    }
+    length = sprintf(text, "DELTA:%lu", seq);
+    for (int i = 0; i < run_count; i++) {
+        length += sprintf(text + length, " %d,%d,%d:", runs[i].x, runs[i].y, runs[i].len);
+        memcpy(text + length, cell, runs[i].len);
+        length += runs[i].len;
+        cell += runs[i].len;
+    }
+    text[length++] = '\n';
+    Message *message = createMessage(MESSAGE_BOARD, text, length, 0);
+    free(text);
+    if (message == NULL) {
+        return NULL;
+    }
+
+    message->binary = createFrame(MESSAGE_BOARD, FRAME_DELTA,
+                                  DELTA_HEADER_SIZE + run_count * DELTA_RUN_HEADER_SIZE + cell_count, 0);
+    if (message->binary != NULL) {
+        unsigned char *payload = (unsigned char*)message->binary->data + FRAME_HEADER_SIZE;
+        put_u64(payload, seq);
+        put_u16(payload + 8, run_count);
+        payload += DELTA_HEADER_SIZE;
+        cell = cells;
+        for (int i = 0; i < run_count; i++) {
+            put_u32(payload, runs[i].x);
+            put_u32(payload + 4, runs[i].y);
+            put_u16(payload + 8, runs[i].len);
+            memcpy(payload + DELTA_RUN_HEADER_SIZE, cell, runs[i].len);
+            payload += DELTA_RUN_HEADER_SIZE + runs[i].len;
+            cell += runs[i].len;
+        }
+    }
+    return message;
+}
+
+// Number the delta and queue it for every client, while the touched shards are still locked.
+// It goes out as one frame per /view index bucket it touches (and per MAX_DELTA_RUNS runs),
+// each tagged with its area and given the next sequence number.
+void sendDeltaToClients(BoardDelta *delta) {
+    int first = 0;
+    size_t cell_offset = 0;
+
+    pthread_mutex_lock(&bus_lock);
+    while (first < delta->run_count) {
+        DeltaRun *run = &delta->runs[first];
+        int bucket = bucketOf(run->x, run->y);
+        int x0 = run->x, y0 = run->y, x1 = run->x + run->len - 1, y1 = run->y;
+        int last = first;
+        size_t cells = 0;
+        while (last < delta->run_count && last - first < MAX_DELTA_RUNS &&
+               cells + delta->runs[last].len <= MAX_DELTA_CELLS &&
+               bucketOf(delta->runs[last].x, delta->runs[last].y) == bucket) {
+            run = &delta->runs[last];
+            if (run->x < x0) x0 = run->x;
+            if (run->x + run->len - 1 > x1) x1 = run->x + run->len - 1;
+            if (run->y < y0) y0 = run->y;
+            if (run->y > y1) y1 = run->y;
+            cells += run->len;
+            last++;
+        }
+        unsigned long seq = nextBoardSeq();
+        Message *message = encodeDelta(delta->runs + first, last - first, delta->cells + cell_offset, cells, seq);
+        if (message != NULL) {
+            message->has_area = 1;
+            message->x0 = x0;
+            message->y0 = y0;
+            message->x1 = x1;
+            message->y1 = y1;
+            publishMessageLocked(message);
+            releaseMessage(message);
+        }
+        first = last;
+        cell_offset += cells;
+    }
+    pthread_mutex_unlock(&bus_lock);
+}
+
+// Note that changes wait for the next tick; the first one arms reactor 0's timer
+void boardDirtied() {
+    if (atomic_exchange(&board_dirty_pending, 1) == 0) {
+        wakeReactor(&reactors[0]);
+    }
+}
+
+// Order dirty tiles by /view index bucket so each bucket's changes form one delta frame
+int compareTileBuckets(const void *a, const void *b) {
+    int ta = *(const int*)a, tb = *(const int*)b;
+    int ba = bucketOf(ta % tiles_across * TILE_SIZE, ta / tiles_across * TILE_SIZE);
+    int bb = bucketOf(tb % tiles_across * TILE_SIZE, tb / tiles_across * TILE_SIZE);
+    if (ba != bb) {
+        return ba < bb ? -1 : 1;
+    }
+    return ta < tb ? -1 : ta > tb;
+}
+
+// Tick: send every cell changed since the last one as a single update
+void flushBoardChanges() {
+    BoardDelta delta;
+    int *pending;
+    size_t count;
+
+    unsigned char needed[MAX_BOARD_SHARDS] = {0};
+
+    if (atomic_exchange(&board_dirty_pending, 0) == 0) {
+        return;
+    }
+    pthread_mutex_lock(&dirty_lock);
+    pending = dirty_tiles;
+    count = dirty_tile_count;
+    dirty_tiles = NULL;
+    dirty_tile_count = 0;
+    dirty_tile_capacity = 0;
+    pthread_mutex_unlock(&dirty_lock);
+
+    // Only the bands of the listed tiles are locked, so draws elsewhere carry on during the flush.
+    // A tile stays listed until it is read below, so draws to it meanwhile are still picked up.
+    for (size_t i = 0; i < count; i++) {
+        int top = pending[i] / tiles_across * TILE_SIZE;
+        int bottom = top + TILE_SIZE - 1 < board_height - 1 ? top + TILE_SIZE - 1 : board_height - 1;
+        for (int shard = shardOf(top); shard <= shardOf(bottom); shard++) {
+            needed[shard] = 1;
+        }
+    }
+    for (int shard = 0; shard < shard_count; shard++) {
+        if (needed[shard]) {
+            pthread_mutex_lock(&shard_locks[shard]);
+        }
+    }
+
+    qsort(pending, count, sizeof(int), compareTileBuckets);
+    deltaBegin(&delta);
+    for (size_t i = 0; i < count; i++) {
+        Tile *tile = atomic_load(&tiles[pending[i]]);
+        if (tile != NULL) {
+            deltaAddTile(&delta, pending[i], 0, 0, board_width - 1, board_height - 1);
+            atomic_store(&tile->listed, 0);
+        }
+    }
+    if (delta.run_count > 0) {
+        sendDeltaToClients(&delta);
+    }
+    for (int shard = shard_count - 1; shard >= 0; shard--) {
+        if (needed[shard]) {
+            pthread_mutex_unlock(&shard_locks[shard]);
+        }
+    }
+    deltaFree(&delta);
+    free(pending);
+}
+
+/*
+ * History (-j megabytes, 0 = off). Half the budget is the journal ring, the
+ * other half keyframes: copies of the board at journal positions, taken
+ * every history_capacity / HISTORY_KEYFRAMES entries. A keyframe is built
+ * from the previous one plus the entries since, sharing the tiles nobody
+ * touched in between, so taking one never stops the board. /history starts
+ * from the newest keyframe before the requested update and replays at most
+ * one interval of entries. Keyframes whose entries fell off the ring are
+ * dropped, as are the oldest ones when they outgrow their half.
+ *
+ * Everything here is guarded by journal_lock, taken under shard locks.
+ */
+typedef struct {
+    int refs; // Keyframes sharing this copy
+    char cells[TILE_SIZE * TILE_SIZE];
+} HistoryTile;
+
+typedef struct {
+    uint64_t position; // Journal entries before this one are included
+    uint64_t seq;      // Oldest board update it can stand for
+    size_t count;
+    uint32_t *indices; // Sorted tile indices
+    HistoryTile **tiles;
+} Keyframe;
+
+pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+HistoryEntry *journal;
+size_t history_capacity; // Journal entries, 0 = history off
+size_t keyframe_budget;  // Bytes of keyframe tiles
+size_t keyframe_interval;
+size_t keyframe_bytes;
+uint64_t journal_head; // Absolute position of the next entry
+uint64_t journal_tail; // Oldest entry still in the ring
+uint64_t journal_last_seq;
+Keyframe keyframes[MAX_KEYFRAMES]; // Oldest first
+int keyframe_count;
+atomic_int history_rebase = 0; // Keyframes lost track of the journal; reactor 0 takes a fresh one
+
+#define journalAt(position) (&journal[(position) % history_capacity])
+
+HistoryTile *historyTileCreate(const char *cells) {
+    HistoryTile *tile = (HistoryTile*)malloc(sizeof(HistoryTile));
+    if (tile != NULL) {
+        tile->refs = 1;
+        if (cells != NULL) {
+            memcpy(tile->cells, cells, sizeof(tile->cells));
+        } else {
+            memset(tile->cells, 0, sizeof(tile->cells));
+        }
+        keyframe_bytes += sizeof(HistoryTile);
+    }
+    return tile;
+}
+
+void historyTileRelease(HistoryTile *tile) {
+    if (tile != NULL && --tile->refs == 0) {
+        keyframe_bytes -= sizeof(HistoryTile);
+        free(tile);
+    }
+}
+
+void keyframeFree(Keyframe *keyframe) {
+    for (size_t i = 0; i < keyframe->count; i++) {
+        historyTileRelease(keyframe->tiles[i]);
+    }
+    free(keyframe->indices);
+    free(keyframe->tiles);
+    memset(keyframe, 0, sizeof(*keyframe));
+}
+
+void dropOldestKeyframe() {
+    keyframeFree(&keyframes[0]);
+    memmove(keyframes, keyframes + 1, (keyframe_count - 1) * sizeof(Keyframe));
+    memset(&keyframes[--keyframe_count], 0, sizeof(Keyframe));
+}
+
+// Position of tile index in the keyframe, or where it would be inserted
+size_t keyframeSearch(const Keyframe *keyframe, uint32_t index) {
+    size_t low = 0, high = keyframe->count;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (keyframe->indices[middle] < index) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+int compareTileIndices(const void *a, const void *b) {
+    uint32_t left = *(const uint32_t*)a, right = *(const uint32_t*)b;
+    return left < right ? -1 : left > right;
+}
+
+// The next keyframe: base plus the journal entries after it, copying only the tiles they touch
+int keyframeBuild(const Keyframe *base, Keyframe *out) {
+    size_t pending = journal_head - base->position, touched = 0, merged = 0;
+    uint32_t *indices = (uint32_t*)malloc((pending + 1) * sizeof(uint32_t));
+
+    memset(out, 0, sizeof(*out));
+    if (indices == NULL) {
+        return -1;
+    }
+    for (uint64_t p = base->position; p < journal_head; p++) {
+        const HistoryEntry *entry = journalAt(p);
+        if (entry->x != HISTORY_RESET) {
+            indices[touched++] = (entry->y / TILE_SIZE) * tiles_across + entry->x / TILE_SIZE;
+        }
+    }
+    qsort(indices, touched, sizeof(uint32_t), compareTileIndices);
+
+    out->indices = (uint32_t*)malloc((base->count + touched + 1) * sizeof(uint32_t));
+    out->tiles = (HistoryTile**)malloc((base->count + touched + 1) * sizeof(HistoryTile*));
+    if (out->indices == NULL || out->tiles == NULL) {
+        free(indices);
+        keyframeFree(out);
+        return -1;
+    }
+    // Merge the base's tiles with the newly touched ones
+    for (size_t i = 0, j = 0; i < base->count || j < touched;) {
+        if (j < touched && merged > 0 && out->indices[merged - 1] == indices[j]) {
+            j++;
+        } else if (j == touched || (i < base->count && base->indices[i] <= indices[j])) {
+            out->indices[merged] = base->indices[i];
+            out->tiles[merged++] = base->tiles[i++];
+            out->tiles[merged - 1]->refs++;
+        } else {
+            out->indices[merged] = indices[j++];
+            out->tiles[merged++] = NULL; // Created on first write below
+        }
+    }
+    out->count = merged;
+    free(indices);
+
+    for (uint64_t p = base->position; p < journal_head; p++) {
+        const HistoryEntry *entry = journalAt(p);
+        if (entry->x == HISTORY_RESET) {
+            for (size_t i = 0; i < out->count; i++) {
+                historyTileRelease(out->tiles[i]);
+                out->tiles[i] = NULL;
+            }
+            continue;
+        }
+        size_t i = keyframeSearch(out, (entry->y / TILE_SIZE) * tiles_across + entry->x / TILE_SIZE);
+        HistoryTile *tile = out->tiles[i];
+        if (tile == NULL || tile->refs > 1) {
+            // Copy on write: older keyframes keep their version
+            HistoryTile *copy = historyTileCreate(tile == NULL ? NULL : tile->cells);
+            if (copy == NULL) {
+                keyframeFree(out);
+                return -1;
+            }
+            historyTileRelease(tile);
+            out->tiles[i] = tile = copy;
+        }
+        tile->cells[(entry->y % TILE_SIZE) * TILE_SIZE + entry->x % TILE_SIZE] = entry->after;
+    }
+
+    // Touched tiles that were never written after a reset stay empty
+    size_t kept = 0;
+    for (size_t i = 0; i < out->count; i++) {
+        if (out->tiles[i] != NULL) {
+            out->indices[kept] = out->indices[i];
+            out->tiles[kept++] = out->tiles[i];
+        }
+    }
+    out->count = kept;
+    out->position = journal_head;
+    out->seq = journal_last_seq;
+    return 0;
+}
+
+// Keep keyframes in step with the journal. Caller holds journal_lock.
+void historyMaintain() {
+    if (keyframe_count > 0 && journal_head - keyframes[keyframe_count - 1].position >= keyframe_interval) {
+        Keyframe next;
+        if (keyframes[keyframe_count - 1].position < journal_tail || keyframeBuild(&keyframes[keyframe_count - 1], &next) < 0) {
+            // One command outran the ring; only a copy of the live board can catch up
+            while (keyframe_count > 0) {
+                dropOldestKeyframe();
+            }
+            atomic_store(&history_rebase, 1);
+            wakeReactor(&reactors[0]);
+            return;
+        }
+        if (keyframe_count == MAX_KEYFRAMES) {
+            dropOldestKeyframe();
+        }
+        keyframes[keyframe_count++] = next;
+    }
+    while (keyframe_count > 1 && (keyframes[0].position < journal_tail || keyframe_bytes > keyframe_budget)) {
+        dropOldestKeyframe();
+    }
+}
+
+/*
+ * Add the entries of one command to the journal and report where they went.
+ * Caller holds their rows' shard locks. Entries are stamped with the next
+ * update when the command is applied, which is only a lower bound on the one
+ * that carries it: a tick may go out as several deltas, and another reactor
+ * can publish first. /history <seq> may therefore show a few changes that
+ * clients only received a couple of updates after seq.
+ */
+void historyAppend(const HistoryEntry *entries, size_t count, HistoryRange *range) {
+    pthread_mutex_lock(&journal_lock);
+    uint64_t seq = atomic_load(&board_seq) + 1; // Read under the lock so seqs never go backwards in the ring
+    range->start = journal_head;
+    range->count = count;
+    for (size_t i = 0; i < count; i++) {
+        HistoryEntry *slot = journalAt(journal_head++);
+        *slot = entries[i];
+        slot->seq = seq;
+    }
+    if (journal_head - journal_tail > history_capacity) {
+        journal_tail = journal_head - history_capacity;
+    }
+    journal_last_seq = seq;
+    historyMaintain();
+    pthread_mutex_unlock(&journal_lock);
+}
+
+/*
+ * Start the keyframes over from a copy of the live board: at startup, and
+ * after a single command wrote more cells than the journal holds.
+ */
+void historyRebase() {
+    size_t total = (size_t)tiles_across * tiles_down, count = 0;
+    Keyframe keyframe;
+
+    lockAllShards();
+    pthread_mutex_lock(&journal_lock);
+    atomic_store(&history_rebase, 0);
+    while (keyframe_count > 0) {
+        dropOldestKeyframe();
+    }
+    for (size_t i = 0; i < total; i++) {
+        count += atomic_load(&tiles[i]) != NULL;
+    }
+    memset(&keyframe, 0, sizeof(keyframe));
+    keyframe.indices = (uint32_t*)malloc((count + 1) * sizeof(uint32_t));
+    keyframe.tiles = (HistoryTile**)malloc((count + 1) * sizeof(HistoryTile*));
+    for (size_t i = 0; i < total && keyframe.indices != NULL && keyframe.tiles != NULL; i++) {
+        Tile *tile = atomic_load(&tiles[i]);
+        if (tile != NULL) {
+            HistoryTile *copy = historyTileCreate((const char*)tile->cells);
+            if (copy == NULL) {
+                break;
+            }
+            keyframe.indices[keyframe.count] = i;
+            keyframe.tiles[keyframe.count++] = copy;
+        }
+    }
+    keyframe.position = journal_head;
+    keyframe.seq = journal_last_seq > atomic_load(&board_seq) ? journal_last_seq : atomic_load(&board_seq);
+    if (keyframe.count == count && keyframe_bytes <= keyframe_budget) {
+        keyframes[keyframe_count++] = keyframe;
+    } else {
+        keyframeFree(&keyframe);
+        fprintf(stderr, "The board does not fit in the history budget; /history is unavailable.\n");
+    }
+    pthread_mutex_unlock(&journal_lock);
+    unlockAllShards();
+}
+
+int historyInit(int megabytes) {
+    size_t budget = (size_t)megabytes * 1024 * 1024;
+    if (budget == 0) {
+        return 0;
+    }
+    history_capacity = budget / 2 / sizeof(HistoryEntry);
+    keyframe_budget = budget / 2;
+    keyframe_interval = history_capacity / HISTORY_KEYFRAMES;
+    if (keyframe_interval == 0) {
+        keyframe_interval = 1;
+    }
+    journal = (HistoryEntry*)malloc(history_capacity * sizeof(HistoryEntry));
+    if (journal == NULL) {
+        return -1;
+    }
+    journal_last_seq = atomic_load(&board_seq);
+    historyRebase();
+    return 0;
+}
+
+/*
+ * Render the area with every change stamped up to seq (see historyAppend), or explain why not:
+ * "HISTORY:<seq> x,y,w,h\n" followed by the rows, top row first.
+ */
+void sendHistory(Client *client, unsigned long seq, int x, int y, int w, int h) {
+    char *grid, *text, header[96];
+    const Keyframe *keyframe = NULL;
+
+    if ((long long)w * h > MAX_REGION_CELLS) {
+        clientSendText(client, "Region too large.\n");
+        return;
+    }
+    if (w < 1 || h < 1 || !onBoard(x, y) || !onBoard(x + w - 1, y + h - 1)) {
+        clientSendText(client, "Invalid region.\n");
+        return;
+    }
+    if (seq > atomic_load(&board_seq)) {
+        clientSendText(client, "That update has not happened yet.\n");
+        return;
+    }
+    grid = (char*)calloc((size_t)w * h, 1);
+    if (grid == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&journal_lock);
+    for (int i = keyframe_count - 1; i >= 0; i--) {
+        if (keyframes[i].seq <= seq && keyframes[i].position >= journal_tail) {
+            keyframe = &keyframes[i];
+            break;
+        }
+    }
+    if (keyframe == NULL) {
+        pthread_mutex_unlock(&journal_lock);
+        free(grid);
+        clientSendText(client, "That update is no longer in the history.\n");
+        return;
+    }
+    for (int ty = y / TILE_SIZE; ty <= (y + h - 1) / TILE_SIZE; ty++) {
+        for (int tx = x / TILE_SIZE; tx <= (x + w - 1) / TILE_SIZE; tx++) {
+            uint32_t index = ty * tiles_across + tx;
+            size_t i = keyframeSearch(keyframe, index);
+            if (i == keyframe->count || keyframe->indices[i] != index) {
+                continue;
+            }
+            for (int cy = ty * TILE_SIZE; cy < (ty + 1) * TILE_SIZE; cy++) {
+                for (int cx = tx * TILE_SIZE; cx < (tx + 1) * TILE_SIZE; cx++) {
+                    if (cx >= x && cx < x + w && cy >= y && cy < y + h) {
+                        grid[(size_t)(cy - y) * w + cx - x] = keyframe->tiles[i]->cells[(cy % TILE_SIZE) * TILE_SIZE + cx % TILE_SIZE];
+                    }
+                }
+            }
+        }
+    }
+    for (uint64_t p = keyframe->position; p < journal_head; p++) {
+        const HistoryEntry *entry = journalAt(p);
+        if (entry->seq > seq) {
+            break;
+        }
+        if (entry->x == HISTORY_RESET) {
+            memset(grid, 0, (size_t)w * h);
+        } else if ((int)entry->x >= x && (int)entry->x < x + w && (int)entry->y >= y && (int)entry->y < y + h) {
+            grid[(size_t)(entry->y - y) * w + entry->x - x] = entry->after;
+        }
+    }
+    pthread_mutex_unlock(&journal_lock);
+
+    int header_length = snprintf(header, sizeof(header), "HISTORY:%lu %d,%d,%d,%d\n", seq, x, y, w, h);
+    text = (char*)malloc(header_length + (size_t)(w + 1) * h + 1);
+    if (text != NULL) {
+        char *out = text + header_length;
+        memcpy(text, header, header_length);
+        for (int row = h - 1; row >= 0; row--) {
+            for (int i = 0; i < w; i++) {
+                char cell = grid[(size_t)row * w + i];
+                *out++ = cell == 0 ? ' ' : cell;
+            }
+            *out++ = '\n';
+        }
+        *out = '\0';
+        clientSendText(client, text);
+        free(text);
+    }
+    free(grid);
+}
+
+/*
+ * Cells written by one command (/draw, /drawmany, /line, /rect, /fill). The
+ * rows it may touch stay locked from batchBegin() to batchCommit(), so peers
+ * see the whole shape appear in one update or not at all.
+ */
+typedef struct {
+    int first_row; // Locked rows
+    int last_row;
+    int count;     // Cells written, changed or not
+    int changed;   // Bounding box of the changed cells, if any
+    int min_x;
+    int min_y;
+    int max_x;
+    int max_y;
+    Client *author;       // Journaled as this client's command; NULL when replaying or without history
+    HistoryRange written; // Where its journal entries went
+} BoardBatch;
+
+void batchBegin(BoardBatch *batch, int first_row, int last_row, Client *author) {
+    batch->first_row = first_row;
+    batch->last_row = last_row;
+    batch->count = 0;
+    batch->changed = 0;
+    batch->author = history_capacity > 0 ? author : NULL;
+    batch->written.count = 0;
+    if (batch->author != NULL) {
+        batch->author->reactor->journal_count = 0;
+    }
+    lockShards(first_row, last_row);
+}
+
+// Remember a changed cell for the journal, in the author's reactor scratch
+void batchJournal(BoardBatch *batch, int x, int y, char before, char after) {
+    Reactor *reactor = batch->author->reactor;
+    if (reactor->journal_count == reactor->journal_capacity) {
+        size_t capacity = reactor->journal_capacity == 0 ? 256 : reactor->journal_capacity * 2;
+        HistoryEntry *grown = (HistoryEntry*)realloc(reactor->journal, capacity * sizeof(HistoryEntry));
+        if (grown == NULL) {
+            return;
+        }
+        reactor->journal = grown;
+        reactor->journal_capacity = capacity;
+    }
+    HistoryEntry *entry = &reactor->journal[reactor->journal_count++];
+    entry->x = x;
+    entry->y = y;
+    entry->client = batch->author->id;
+    entry->before = before;
+    entry->after = after;
+}
+
+// Write one cell; points off the board or outside the locked rows are skipped
+void batchSet(BoardBatch *batch, int x, int y, char symbol) {
+    if (!onBoard(x, y) || y < batch->first_row || y > batch->last_row) {
+        return;
+    }
+    char before = boardGet(x, y);
+    if (boardSet(x, y, symbol)) {
+        if (batch->author != NULL) {
+            batchJournal(batch, x, y, before, symbol);
+        }
+        if (!batch->changed || x < batch->min_x) batch->min_x = x;
+        if (!batch->changed || x > batch->max_x) batch->max_x = x;
+        if (!batch->changed || y < batch->min_y) batch->min_y = y;
+        if (!batch->changed || y > batch->max_y) batch->max_y = y;
+        batch->changed = 1;
+    }
+    batch->count++;
+}
+
+// Publish everything the batch changed as a single delta (or leave it for the next tick), then release its rows
+void batchCommit(BoardBatch *batch) {
+    if (batch->author != NULL) {
+        Reactor *reactor = batch->author->reactor;
+        if (reactor->journal_count > 0) {
+            historyAppend(reactor->journal, reactor->journal_count, &batch->written);
+        }
+        if (reactor->journal_capacity > HISTORY_SCRATCH_KEEP) {
+            free(reactor->journal);
+            reactor->journal = NULL;
+            reactor->journal_capacity = 0;
+        }
+        reactor->journal_count = 0;
+    }
+    if (batch->changed) {
+        if (tick_interval > 0) {
+            boardDirtied();
+        } else {
+            BoardDelta delta;
+            deltaBegin(&delta);
+            deltaAddDirty(&delta, batch->min_x, batch->min_y, batch->max_x, batch->max_y);
+            sendDeltaToClients(&delta);
+            deltaFree(&delta);
+        }
+    }
+    unlockShards(batch->first_row, batch->last_row);
+}
+
+// Bresenham line between two cells, end points included
+void batchLine(BoardBatch *batch, int x0, int y0, int x1, int y1, char symbol) {
+    int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
+    int dy = -abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
+    int err = dx + dy;
+
+    for (;;) {
+        batchSet(batch, x0, y0, symbol);
+        if (x0 == x1 && y0 == y1) {
+            break;
+        }
+        int e2 = 2 * err;
+        if (e2 >= dy) {
+            err += dy;
+            x0 += sx;
+        }
+        if (e2 <= dx) {
+            err += dx;
+            y0 += sy;
+        }
+    }
+}
+
+// Rectangle with opposite corners (x0, y0) and (x1, y1)
+void batchRect(BoardBatch *batch, int x0, int y0, int x1, int y1, char symbol, int filled) {
+    int left = x0 < x1 ? x0 : x1, right = x0 < x1 ? x1 : x0;
+    int bottom = y0 < y1 ? y0 : y1, top = y0 < y1 ? y1 : y0;
+
+    for (int y = bottom; y <= top; y++) {
+        if (filled || y == bottom || y == top) {
+            for (int x = left; x <= right; x++) {
+                batchSet(batch, x, y, symbol);
+            }
+        } else {
+            batchSet(batch, left, y, symbol);
+            batchSet(batch, right, y, symbol);
+        }
+    }
+}
+
+/*
+ * 4-connected flood fill of the region holding (x, y), kept within the
+ * batch's locked rows and FILL_RADIUS columns so one command cannot repaint
+ * a whole 100k x 100k canvas.
+ */
+void batchFill(BoardBatch *batch, int x, int y, char symbol) {
+    int left = x - FILL_RADIUS < 0 ? 0 : x - FILL_RADIUS;
+    int right = x + FILL_RADIUS >= board_width ? board_width - 1 : x + FILL_RADIUS;
+    int width = right - left + 1;
+    int *stack = (int*)malloc(sizeof(int) * width * (batch->last_row - batch->first_row + 1));
+    int top = 0;
+    char target = boardGet(x, y);
+
+    if (stack == NULL || target == symbol) {
+        free(stack);
+        return;
+    }
+    // Cells are painted when pushed, so each one is pushed at most once
+    batchSet(batch, x, y, symbol);
+    stack[top++] = (y - batch->first_row) * width + (x - left);
+    while (top > 0) {
+        int cell = stack[--top];
+        int cx = left + cell % width, cy = batch->first_row + cell / width;
+        int neighbours[4][2] = {{cx - 1, cy}, {cx + 1, cy}, {cx, cy - 1}, {cx, cy + 1}};
+        for (int i = 0; i < 4; i++) {
+            int nx = neighbours[i][0], ny = neighbours[i][1];
+            if (nx >= left && nx <= right && ny >= batch->first_row && ny <= batch->last_row &&
+                boardGet(nx, ny) == target) {
+                batchSet(batch, nx, ny, symbol);
+                if (boardGet(nx, ny) == symbol) {
+                    stack[top++] = (ny - batch->first_row) * width + (nx - left);
+                }
+            }
+        }
+    }
+    free(stack);
+}
+
+typedef enum {
+    OP_DRAW = 1, // x y
+    OP_DRAWMANY, // x y pairs
+    OP_LINE,     // x0 y0 x1 y1
+    OP_RECT,     // x0 y0 x1 y1 filled
+    OP_FILL,     // x y
+    OP_RESET,
+    OP_PUT       // x y symbol triples, symbol 0 = empty; written by /undo and /redo
+} OpType;
+
+#define MAX_PUT_CELLS (2 * MAX_BATCH_POINTS / 3)
+
+// One board-changing command, as applied to the board and as written to the operation log
+typedef struct {
+    uint8_t type;
+    char symbol;
+    int count; // Values used
+    int values[2 * MAX_BATCH_POINTS];
+} BoardOp;
+
+// Rows an operation may touch, which batchBegin() has to lock
+void opRows(const BoardOp *op, int *first_row, int *last_row) {
+    *first_row = board_height - 1;
+    *last_row = 0;
+    if (op->type == OP_FILL) {
+        *first_row = op->values[1] - FILL_RADIUS < 0 ? 0 : op->values[1] - FILL_RADIUS;
+        *last_row = op->values[1] + FILL_RADIUS >= board_height ? board_height - 1 : op->values[1] + FILL_RADIUS;
+        return;
+    }
+    // Every other value is a y coordinate, every third for OP_PUT
+    int step = op->type == OP_PUT ? 3 : 2;
+    for (int i = 1; i < op->count && (op->type != OP_RECT || i < 4); i += step) {
+        if (op->values[i] < *first_row) *first_row = op->values[i];
+        if (op->values[i] > *last_row) *last_row = op->values[i];
+    }
+}
+
+void opApply(BoardBatch *batch, const BoardOp *op) {
+    const int *v = op->values;
+
+    switch (op->type) {
+    case OP_DRAW:
+    case OP_DRAWMANY:
+        for (int i = 0; i + 1 < op->count; i += 2) {
+            batchSet(batch, v[i], v[i + 1], op->symbol);
+        }
+        break;
+    case OP_LINE:
+        batchLine(batch, v[0], v[1], v[2], v[3], op->symbol);
+        break;
+    case OP_RECT:
+        batchRect(batch, v[0], v[1], v[2], v[3], op->symbol, v[4]);
+        break;
+    case OP_FILL:
+        batchFill(batch, v[0], v[1], op->symbol);
+        break;
+    case OP_PUT:
+        for (int i = 0; i + 2 < op->count; i += 3) {
+            batchSet(batch, v[i], v[i + 1], (char)v[i + 2]);
+        }
+        break;
+    }
+}
+
+void walAppend(const BoardOp *op);
+
+// Push onto an undo or redo stack, forgetting the oldest entry when full
+void historyPush(HistoryRange *stack, int *depth, HistoryRange range) {
+    if (range.count == 0) {
+        return;
+    }
+    if (*depth == UNDO_DEPTH) {
+        memmove(stack, stack + 1, (UNDO_DEPTH - 1) * sizeof(HistoryRange));
+        (*depth)--;
+    }
+    stack[(*depth)++] = range;
+}
+
+// Apply an operation, log it and announce it; returns the number of cells written
+int applyOp(const BoardOp *op, Client *author) {
+    BoardBatch batch;
+    int first_row, last_row;
+
+    opRows(op, &first_row, &last_row);
+    batchBegin(&batch, first_row, last_row, author);
+    opApply(&batch, op);
+    if (batch.changed) {
+        walAppend(op); // Still under the row locks, so the log has conflicting operations in board order
+    }
+    batchCommit(&batch);
+    if (batch.written.count > 0) {
+        historyPush(author->undo, &author->undo_count, batch.written);
+        author->redo_count = 0; // A new command starts a new branch
+    }
+    return batch.count;
+}
+
+// Set one cell and announce it; -1 if it is off the board
+int draw(int x, int y, char symbol, Client *author)
+{
+    BoardOp op;
+
+    //y = BOARD_HEIGHT - y - 1; // Invert the y-axis
+    if (!onBoard(x, y))
+    {
+        return -1;
+    }
+    op.type = OP_DRAW;
+    op.symbol = symbol;
+    op.count = 2;
+    op.values[0] = x;
+    op.values[1] = y;
+    applyOp(&op, author);
+    return 0;
+}
+
+// Clear the board and tell every client: the new (empty) snapshot, which also becomes the cached frame,
+// or "CLEAR:<seq>" when the board is too big for a snapshot
+void resetBoard () {
+    Message *frame;
+    unsigned long seq;
+
+    BoardOp op = {.type = OP_RESET};
+
+    lockAllShards();
+    boardClear(); // The snapshot supersedes pending changes
+    walAppend(&op);
+    if (history_capacity > 0) {
+        HistoryEntry entry = {.x = HISTORY_RESET};
+        HistoryRange range;
+        historyAppend(&entry, 1, &range);
+    }
+
+    pthread_mutex_lock(&bus_lock);
+    seq = nextBoardSeq();
+    if (boardFitsSnapshot()) {
+        frame = renderBoardFrame(seq);
+        if (frame != NULL && frame->binary != NULL) {
+            frame->rle = compressBoardFrame(frame->binary, FRAME_SNAPSHOT_RLE, SNAPSHOT_HEADER_SIZE);
+        }
+    } else {
+        char text[32];
+        frame = createMessage(MESSAGE_BOARD, text, sprintf(text, "CLEAR:%lu\n", seq), 0);
+        if (frame != NULL) {
+            frame->binary = createFrame(MESSAGE_BOARD, FRAME_CLEAR, 8, 0);
+            if (frame->binary != NULL) {
+                put_u64((unsigned char*)frame->binary->data + FRAME_HEADER_SIZE, seq);
+            }
+        }
+    }
+    if (frame != NULL) {
+        publishMessageLocked(frame);
+    }
+    pthread_mutex_unlock(&bus_lock);
+    unlockAllShards();
+
+    if (frame != NULL) {
+        if (boardFitsSnapshot()) {
+            cacheBoardFrame(frame, seq);
+        }
+        releaseMessage(frame);
+    }
+}
+
+long long monotonicMillis() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * Persistence (-p dir). Every board-changing operation is appended to an
+ * in-memory log under the rows' shard locks; a writer thread moves whatever
+ * has piled up to <dir>/board.wal with one write() and one fdatasync()
+ * (group commit), so draws never wait for the disk. Every
+ * snapshot_interval seconds it writes <dir>/board.snap and starts a fresh
+ * log, which bounds how much has to be replayed at startup.
+ *
+ * board.wal:  u64 start lsn, then records: u32 length, u32 checksum, and a
+ *             payload of u8 type, u8 symbol, u16 count, count * u32 values.
+ *             A record's lsn is the start lsn plus its offset after the header.
+ * board.snap: "BSNP", u32 version, u32 width, u32 height, u64 seq, u64 lsn,
+ *             u32 tile count, per tile u32 index and its cells, u32 checksum.
+ */
+#define WAL_FILE "board.wal"
+#define SNAPSHOT_FILE "board.snap"
+#define WAL_HEADER_SIZE 8
+#define WAL_RECORD_HEADER_SIZE 8
+#define SNAPSHOT_MAGIC "BSNP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_FILE_HEADER_SIZE 36
+#define DEFAULT_SNAPSHOT_INTERVAL 60
+
+const char *persist_dir = NULL;
+int snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL; // Seconds
+int wal_fd = -1;                                   // Owned by the writer thread after startup
+
+pthread_mutex_t wal_lock = PTHREAD_MUTEX_INITIALIZER; // Taken under shard locks
+pthread_cond_t wal_ready = PTHREAD_COND_INITIALIZER;
+unsigned char *wal_buffer;
+size_t wal_length;
+size_t wal_capacity;
+uint64_t wal_lsn;      // Log position after the last appended record
+uint64_t snapshot_lsn; // Log position the newest snapshot covers
+
+// FNV-1a, enough to spot a torn or garbled record
+uint32_t checksum(const unsigned char *data, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+void persistPath(char *path, const char *name) {
+    snprintf(path, PATH_MAX, "%s/%s", persist_dir, name);
+}
+
+int writeAll(int fd, const unsigned char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        length -= written;
+    }
+    return 0;
+}
+
+// Make renames in the persistence directory durable
+void syncDirectory() {
+    int fd = open(persist_dir, O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+// Queue an operation for the log. Caller holds the shard locks of the rows it touched.
+void walAppend(const BoardOp *op) {
+    size_t length = WAL_RECORD_HEADER_SIZE + 4 + 4 * op->count;
+
+    if (persist_dir == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&wal_lock);
+    if (wal_length + length > wal_capacity) {
+        size_t capacity = wal_capacity == 0 ? 64 * 1024 : wal_capacity;
+        while (capacity < wal_length + length) {
+            capacity *= 2;
+        }
+        unsigned char *grown = (unsigned char*)realloc(wal_buffer, capacity);
+        if (grown == NULL) {
+            pthread_mutex_unlock(&wal_lock);
+            logAt(LOG_ERROR, "wal: %s\n", strerror(errno));
+            return;
+        }
+        wal_buffer = grown;
+        wal_capacity = capacity;
+    }
+    unsigned char *record = wal_buffer + wal_length;
+    unsigned char *payload = record + WAL_RECORD_HEADER_SIZE;
+    payload[0] = op->type;
+    payload[1] = op->symbol;
+    put_u16(payload + 2, op->count);
+    for (int i = 0; i < op->count; i++) {
+        put_u32(payload + 4 + 4 * i, (uint32_t)op->values[i]);
+    }
+    put_u32(record, length - WAL_RECORD_HEADER_SIZE);
+    put_u32(record + 4, checksum(payload, length - WAL_RECORD_HEADER_SIZE));
+    if (wal_length == 0) {
+        pthread_cond_signal(&wal_ready);
+    }
+    wal_length += length;
+    wal_lsn += length;
+    pthread_mutex_unlock(&wal_lock);
+}
+
+// Take everything appended so far, leaving spare as the new (empty) buffer. Caller holds wal_lock.
+size_t walTake(unsigned char **spare, size_t *spare_capacity) {
+    unsigned char *data = wal_buffer;
+    size_t length = wal_length, capacity = wal_capacity;
+
+    wal_buffer = *spare;
+    wal_capacity = *spare_capacity;
+    wal_length = 0;
+    *spare = data;
+    *spare_capacity = capacity;
+    return length;
+}
+
+void walWrite(const unsigned char *data, size_t length) {
+    long long start = monotonicNanos();
+    if (writeAll(wal_fd, data, length) < 0 || fdatasync(wal_fd) < 0) {
+        logAt(LOG_ERROR, "wal: %s\n", strerror(errno));
+    }
+    histogramRecordSince(&wal_sync_time, start);
+}
+
+// Create a log file starting at lsn under a temporary name; returns its fd
+int walCreate(const char *path, uint64_t lsn) {
+    unsigned char header[WAL_HEADER_SIZE];
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    put_u64(header, lsn);
+    if (fd < 0 || writeAll(fd, header, WAL_HEADER_SIZE) < 0 || fsync(fd) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Write board.snap and start a new, empty log at the lsn it covers. The old
+ * log is completed first and only replaced after the snapshot is on disk, so
+ * a crash at any point leaves a snapshot plus a log that covers the rest.
+ */
+void takeSnapshot(unsigned char **spare, size_t *spare_capacity) {
+    char path[PATH_MAX], temp_path[PATH_MAX], wal_path[PATH_MAX], new_wal_path[PATH_MAX];
+    size_t tail, tile_count = 0, total = (size_t)tiles_across * tiles_down;
+    uint64_t lsn, seq;
+
+    // Holding every band means no operation is half applied or half logged
+    lockAllShards();
+    pthread_mutex_lock(&wal_lock);
+    lsn = wal_lsn;
+    seq = atomic_load(&board_seq);
+    tail = walTake(spare, spare_capacity);
+    pthread_mutex_unlock(&wal_lock);
+    if (lsn == snapshot_lsn) {
+        unlockAllShards();
+        return; // Nothing changed since the last one
+    }
+    for (size_t i = 0; i < total; i++) {
+        tile_count += atomic_load(&tiles[i]) != NULL;
+    }
+    size_t length = SNAPSHOT_FILE_HEADER_SIZE + tile_count * (4 + TILE_SIZE * TILE_SIZE) + 4;
+    unsigned char *image = (unsigned char*)malloc(length);
+    if (image == NULL) {
+        unlockAllShards();
+        walWrite(*spare, tail);
+        return;
+    }
+    memcpy(image, SNAPSHOT_MAGIC, 4);
+    put_u32(image + 4, SNAPSHOT_VERSION);
+    put_u32(image + 8, board_width);
+    put_u32(image + 12, board_height);
+    put_u64(image + 16, seq);
+    put_u64(image + 24, lsn);
+    put_u32(image + 32, tile_count);
+    unsigned char *out = image + SNAPSHOT_FILE_HEADER_SIZE;
+    for (size_t i = 0; i < total; i++) {
+        Tile *tile = atomic_load(&tiles[i]);
+        if (tile != NULL) {
+            put_u32(out, i);
+            memcpy(out + 4, tile->cells, TILE_SIZE * TILE_SIZE);
+            out += 4 + TILE_SIZE * TILE_SIZE;
+        }
+    }
+    unlockAllShards();
+    put_u32(out, checksum(image, length - 4));
+
+    // Finish the old log up to the snapshot point
+    walWrite(*spare, tail);
+
+    persistPath(path, SNAPSHOT_FILE);
+    persistPath(temp_path, SNAPSHOT_FILE ".new");
+    persistPath(wal_path, WAL_FILE);
+    persistPath(new_wal_path, WAL_FILE ".new");
+    int new_wal = walCreate(new_wal_path, lsn);
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (new_wal < 0 || fd < 0 || writeAll(fd, image, length) < 0 || fsync(fd) < 0 ||
+        rename(temp_path, path) < 0) {
+        logAt(LOG_ERROR, "snapshot: %s\n", strerror(errno));
+        if (new_wal >= 0) {
+            close(new_wal);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(image);
+        return;
+    }
+    close(fd);
+    syncDirectory();
+    if (rename(new_wal_path, wal_path) < 0) {
+        logAt(LOG_ERROR, "snapshot: %s\n", strerror(errno));
+        close(new_wal);
+    } else {
+        syncDirectory();
+        close(wal_fd);
+        wal_fd = new_wal;
+        snapshot_lsn = lsn;
+    }
+    free(image);
+}
+
+// Group commit loop: one write() and fdatasync() for everything appended meanwhile
+void *walWriter(void *arg) {
+    unsigned char *spare = NULL;
+    size_t spare_capacity = 0;
+    long long next_snapshot = monotonicMillis() + snapshot_interval * 1000LL;
+    (void)arg;
+
+    snprintf(log_thread_name, sizeof(log_thread_name), "wal");
+    for (;;) {
+        pthread_mutex_lock(&wal_lock);
+        while (wal_length == 0 && monotonicMillis() < next_snapshot) {
+            struct timespec deadline;
+            long long wait = next_snapshot - monotonicMillis();
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += wait / 1000;
+            deadline.tv_nsec += (wait % 1000) * 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&wal_ready, &wal_lock, &deadline);
+        }
+        size_t length = walTake(&spare, &spare_capacity);
+        pthread_mutex_unlock(&wal_lock);
+
+        if (length > 0) {
+            walWrite(spare, length);
+        }
+        if (monotonicMillis() >= next_snapshot) {
+            long long start = monotonicNanos();
+            takeSnapshot(&spare, &spare_capacity);
+            histogramRecordSince(&snapshot_time, start);
+            next_snapshot = monotonicMillis() + snapshot_interval * 1000LL;
+        }
+    }
+    return NULL;
+}
+
+// Read a whole file into memory; NULL if it does not exist
+unsigned char *readFile(const char *path, size_t *length) {
+    struct stat info;
+    unsigned char *data;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &info) < 0 || (data = (unsigned char*)malloc(info.st_size + 1)) == NULL) {
+        close(fd);
+        return NULL;
+    }
+    *length = 0;
+    while (*length < (size_t)info.st_size) {
+        ssize_t got = read(fd, data + *length, info.st_size - *length);
+        if (got <= 0) {
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        *length += got;
+    }
+    close(fd);
+    return data;
+}
+
+// Decode one logged operation; -1 if it is not one this server could have written
+int walDecode(const unsigned char *payload, uint32_t length, BoardOp *op) {
+    static const int counts[] = {0, 2, -1, 4, 5, 2, 0, -1}; // Indexed by OpType, -1 = any number of points
+    if (length < 4) {
+        return -1;
+    }
+    op->type = payload[0];
+    op->symbol = payload[1];
+    op->count = get_u16(payload + 2);
+    int step = op->type == OP_PUT ? 3 : 2;
+    if (op->type < OP_DRAW || op->type > OP_PUT || length != 4 + 4 * (uint32_t)op->count ||
+        op->count > 2 * MAX_BATCH_POINTS ||
+        (counts[op->type] >= 0 ? op->count != counts[op->type] : op->count == 0 || op->count % step != 0)) {
+        return -1;
+    }
+    for (int i = 0; i < op->count; i++) {
+        op->values[i] = (int)get_u32(payload + 4 + 4 * i);
+    }
+    // Coordinates were checked before logging; a value outside the board means a bad record
+    for (int i = 0; i + 1 < op->count && (op->type != OP_RECT || i < 4); i += step) {
+        if (!onBoard(op->values[i], op->values[i + 1])) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Apply a logged operation without logging or announcing it again
+void replayOp(const BoardOp *op) {
+    BoardBatch batch;
+    int first_row, last_row;
+
+    if (op->type == OP_RESET) {
+        boardClear();
+        return;
+    }
+    opRows(op, &first_row, &last_row);
+    batchBegin(&batch, first_row, last_row, NULL);
+    opApply(&batch, op);
+    unlockShards(first_row, last_row);
+}
+
+// Load board.snap into empty tiles; returns -1 if it is unusable
+int loadSnapshot(uint64_t *seq) {
+    char path[PATH_MAX];
+    size_t length;
+    unsigned char *image;
+    int result = -1;
+
+    persistPath(path, SNAPSHOT_FILE);
+    image = readFile(path, &length);
+    if (image == NULL) {
+        return 0; // First start
+    }
+    if (length < SNAPSHOT_FILE_HEADER_SIZE + 4 || memcmp(image, SNAPSHOT_MAGIC, 4) != 0 ||
+        get_u32(image + 4) != SNAPSHOT_VERSION || get_u32(image + length - 4) != checksum(image, length - 4)) {
+        fprintf(stderr, "Snapshot %s is damaged.\n", path);
+    } else if ((int)get_u32(image + 8) != board_width || (int)get_u32(image + 12) != board_height) {
+        fprintf(stderr, "Snapshot %s is for a %ux%u board.\n", path, get_u32(image + 8), get_u32(image + 12));
+    } else {
+        uint32_t tile_count = get_u32(image + 32);
+        const unsigned char *in = image + SNAPSHOT_FILE_HEADER_SIZE;
+        if (length != SNAPSHOT_FILE_HEADER_SIZE + (size_t)tile_count * (4 + TILE_SIZE * TILE_SIZE) + 4) {
+            fprintf(stderr, "Snapshot %s is damaged.\n", path);
+        } else {
+            result = 0;
+            for (uint32_t i = 0; i < tile_count && result == 0; i++, in += 4 + TILE_SIZE * TILE_SIZE) {
+                uint32_t index = get_u32(in);
+                Tile *tile = index < (uint32_t)tiles_across * tiles_down ? tileCreate(index) : NULL;
+                if (tile == NULL) {
+                    result = -1;
+                    break;
+                }
+                memcpy(tile->cells, in + 4, TILE_SIZE * TILE_SIZE);
+                free(atomic_exchange(&tiles[index], tile));
+            }
+            *seq = get_u64(image + 16);
+            snapshot_lsn = get_u64(image + 24);
+        }
+    }
+    free(image);
+    return result;
+}
+
+/*
+ * Startup: load the newest snapshot, replay the log records after it, drop a
+ * torn record at the end, and leave wal_fd open for appending.
+ */
+int recoverBoard() {
+    char path[PATH_MAX];
+    uint64_t seq = 0, start;
+    size_t length, offset = WAL_HEADER_SIZE;
+    unsigned char *log;
+    BoardOp *op = (BoardOp*)malloc(sizeof(BoardOp));
+    int replayed = 0;
+
+    if (op == NULL || (mkdir(persist_dir, 0755) < 0 && errno != EEXIST)) {
+        free(op);
+        return -1;
+    }
+    persistPath(path, SNAPSHOT_FILE ".new");
+    unlink(path);
+    persistPath(path, WAL_FILE ".new");
+    unlink(path);
+    if (board_map != NULL) {
+        char snapshot_path[PATH_MAX];
+        persistPath(path, WAL_FILE);
+        persistPath(snapshot_path, SNAPSHOT_FILE);
+        if (access(path, F_OK) == 0 || access(snapshot_path, F_OK) == 0) {
+            // The log is authoritative; a mapped board may be ahead of or behind it
+            boardClear();
+        }
+    }
+    if (loadSnapshot(&seq) < 0) {
+        free(op);
+        return -1;
+    }
+
+    persistPath(path, WAL_FILE);
+    log = readFile(path, &length);
+    if (log == NULL || length < WAL_HEADER_SIZE) {
+        // No log yet: start one where the snapshot ends
+        free(log);
+        free(op);
+        wal_fd = walCreate(path, snapshot_lsn);
+        wal_lsn = snapshot_lsn;
+        syncDirectory();
+        if (seq > 0) {
+            storeBoardSeq(seq);
+        }
+        return wal_fd < 0 ? -1 : 0;
+    }
+    start = get_u64(log);
+    if (start > snapshot_lsn) {
+        fprintf(stderr, "Log %s starts after the snapshot; changes in between are lost.\n", path);
+    }
+    while (offset + WAL_RECORD_HEADER_SIZE <= length) {
+        uint32_t size = get_u32(log + offset);
+        const unsigned char *payload = log + offset + WAL_RECORD_HEADER_SIZE;
+        if (size > length - offset - WAL_RECORD_HEADER_SIZE || get_u32(log + offset + 4) != checksum(payload, size) ||
+            walDecode(payload, size, op) < 0) {
+            break; // Torn write from a crash: everything after it is discarded
+        }
+        if (start + (offset - WAL_HEADER_SIZE) >= snapshot_lsn) {
+            replayOp(op);
+            replayed++;
+        }
+        offset += WAL_RECORD_HEADER_SIZE + size;
+    }
+    free(log);
+    free(op);
+
+    // Nobody has seen the replayed changes as deltas; clients start from a snapshot anyway
+    for (size_t i = 0; i < (size_t)tiles_across * tiles_down; i++) {
+        Tile *tile = atomic_load(&tiles[i]);
+        if (tile != NULL) {
+            memset(tile->dirty, 0, sizeof(tile->dirty));
+            atomic_store(&tile->listed, 0);
+        }
+    }
+    dirty_tile_count = 0;
+
+    wal_fd = open(path, O_WRONLY);
+    if (wal_fd < 0 || ftruncate(wal_fd, offset) < 0 || lseek(wal_fd, offset, SEEK_SET) < 0) {
+        return -1;
+    }
+    wal_lsn = start + (offset - WAL_HEADER_SIZE);
+    storeBoardSeq(seq + replayed);
+    logAt(LOG_INFO, "Recovered the board from %s: %d logged operation(s) replayed.\n", persist_dir, replayed);
+    return 0;
+}
+
+// /draw: set the cell, peers get the delta, the sender gets an acknowledgement
+void drawCommand(Client *client, int x, int y, char symbol) {
+    int check = draw(x, y, symbol, client);
+    if (check == -1) {
+        clientSendText(client, "Invalid coordinates.\n");
+    } else {
+        clientSendText(client, "Draw successful.\n");
+    }
+}
+
+// A numbered DRAW: the client already shows it and settles its prediction with the DRAW_ACK
+void drawAckCommand(Client *client, int x, int y, char symbol, uint32_t id) {
+    int check = isgraph((unsigned char)symbol) ? draw(x, y, symbol, client) : -1;
+    Message *ack = createFrame(MESSAGE_TEXT, FRAME_DRAW_ACK, DRAW_ACK_SIZE, 0);
+    if (ack == NULL) {
+        markDead(client); // The client would wait for this ack forever
+        return;
+    }
+    unsigned char *reply = (unsigned char*)ack->data + FRAME_HEADER_SIZE;
+    put_u32(reply, id);
+    reply[4] = check == -1 ? DRAW_ACK_REJECTED : DRAW_ACK_APPLIED;
+    // Without ticks the change already went out, under this seq or before it. Ticks publish it
+    // under this seq or a later one, depending on where its delta falls among the tick's frames.
+    put_u64(reply + 5, atomic_load(&board_seq) + (tick_interval > 0));
+    clientQueueEncoded(client, ack);
+    releaseMessage(ack);
+}
+
+// Parse an argument as a whole number; -1 if it is missing or not a number
+int parseNumber(const char *token, int *value) {
+    char *end;
+
+    if (token == NULL) {
+        return -1;
+    }
+    long number = strtol(token, &end, 10);
+    if (end == token || *end != '\0' || number < INT_MIN || number > INT_MAX) {
+        return -1;
+    }
+    *value = (int)number;
+    return 0;
+}
+
+int nextNumber(char **saveptr, int *value) {
+    return parseNumber(strtok_r(NULL, " ", saveptr), value);
+}
+
+// Read the next argument as a single character symbol
+int nextSymbol(char **saveptr, char *symbol) {
+    char *token = strtok_r(NULL, " ", saveptr);
+    if (token == NULL || strlen(token) != 1) {
+        return -1;
+    }
+    *symbol = token[0];
+    return 0;
+}
+
+void opReply(Client *client, int count) {
+    char reply[64];
+    snprintf(reply, sizeof(reply), "Drew %d cells.\n", count);
+    clientSendText(client, reply);
+}
+
+// /drawmany <symbol> <x> <y> [<x> <y> ...]: every point is checked before any is drawn
+void drawManyCommand(Client *client, char **saveptr) {
+    static const char *usage = "Usage: /drawmany <symbol> <x> <y> [<x> <y> ...]\n";
+    BoardOp *op = (BoardOp*)malloc(sizeof(BoardOp));
+
+    if (op == NULL) {
+        return;
+    }
+    op->type = OP_DRAWMANY;
+    op->count = 0;
+    if (nextSymbol(saveptr, &op->symbol) < 0) {
+        clientSendText(client, usage);
+        free(op);
+        return;
+    }
+    while (op->count < 2 * MAX_BATCH_POINTS && nextNumber(saveptr, &op->values[op->count]) == 0) {
+        if (nextNumber(saveptr, &op->values[op->count + 1]) < 0) {
+            op->count = 0;
+            break;
+        }
+        op->count += 2;
+    }
+    if (op->count == 0 || strtok_r(NULL, " ", saveptr) != NULL) {
+        clientSendText(client, usage);
+        free(op);
+        return;
+    }
+    for (int i = 0; i < op->count; i += 2) {
+        if (!onBoard(op->values[i], op->values[i + 1])) {
+            clientSendText(client, "Invalid coordinates.\n");
+            free(op);
+            return;
+        }
+    }
+    opReply(client, applyOp(op, client));
+    free(op);
+}
+
+// /line <x0> <y0> <x1> <y1> <symbol>
+void lineCommand(Client *client, char **saveptr) {
+    BoardOp op;
+    int *v = op.values;
+
+    if (nextNumber(saveptr, &v[0]) < 0 || nextNumber(saveptr, &v[1]) < 0 ||
+        nextNumber(saveptr, &v[2]) < 0 || nextNumber(saveptr, &v[3]) < 0 ||
+        nextSymbol(saveptr, &op.symbol) < 0) {
+        clientSendText(client, "Usage: /line <x0> <y0> <x1> <y1> <symbol>\n");
+        return;
+    }
+    if (!onBoard(v[0], v[1]) || !onBoard(v[2], v[3])) {
+        clientSendText(client, "Invalid coordinates.\n");
+        return;
+    }
+    op.type = OP_LINE;
+    op.count = 4;
+    opReply(client, applyOp(&op, client));
+}
+
+// /rect <x0> <y0> <x1> <y1> <symbol> [filled]
+void rectCommand(Client *client, char **saveptr) {
+    static const char *usage = "Usage: /rect <x0> <y0> <x1> <y1> <symbol> [filled]\n";
+    BoardOp op;
+    int *v = op.values;
+
+    if (nextNumber(saveptr, &v[0]) < 0 || nextNumber(saveptr, &v[1]) < 0 ||
+        nextNumber(saveptr, &v[2]) < 0 || nextNumber(saveptr, &v[3]) < 0 ||
+        nextSymbol(saveptr, &op.symbol) < 0) {
+        clientSendText(client, usage);
+        return;
+    }
+    char *mode = strtok_r(NULL, " ", saveptr);
+    v[4] = 0;
+    if (mode != NULL) {
+        if (strcmp(mode, "filled") != 0) {
+            clientSendText(client, usage);
+            return;
+        }
+        v[4] = 1;
+    }
+    if (!onBoard(v[0], v[1]) || !onBoard(v[2], v[3])) {
+        clientSendText(client, "Invalid coordinates.\n");
+        return;
+    }
+    if (v[4] && (long long)(abs(v[2] - v[0]) + 1) * (abs(v[3] - v[1]) + 1) > MAX_BATCH_CELLS) {
+        clientSendText(client, "Shape too large.\n");
+        return;
+    }
+    op.type = OP_RECT;
+    op.count = 5;
+    opReply(client, applyOp(&op, client));
+}
+
+// /fill <x> <y> <symbol>
+void fillCommand(Client *client, char **saveptr) {
+    BoardOp op;
+    int *v = op.values;
+
+    if (nextNumber(saveptr, &v[0]) < 0 || nextNumber(saveptr, &v[1]) < 0 || nextSymbol(saveptr, &op.symbol) < 0) {
+        clientSendText(client, "Usage: /fill <x> <y> <symbol>\n");
+        return;
+    }
+    if (!onBoard(v[0], v[1])) {
+        clientSendText(client, "Invalid coordinates.\n");
+        return;
+    }
+    op.type = OP_FILL;
+    op.count = 2;
+    opReply(client, applyOp(&op, client));
+}
+
+// /show [<x> <y> <w> <h>]: the whole board, or just a viewport of it
+void showCommand(Client *client, char **saveptr) {
+    char *token = strtok_r(NULL, " ", saveptr);
+    int x, y, w, h;
+
+    if (token == NULL) {
+        sendBoardSnapshot(client);
+    } else if (parseNumber(token, &x) < 0 || nextNumber(saveptr, &y) < 0 ||
+               nextNumber(saveptr, &w) < 0 || nextNumber(saveptr, &h) < 0) {
+        clientSendText(client, "Usage: /show [<x> <y> <w> <h>]\n");
+    } else {
+        sendRegion(client, x, y, w, h);
+    }
+}
+
+/*
+ * /view <x> <y> <w> <h>: only board updates overlapping the rectangle are sent
+ * from now on, starting with its current contents. /view alone goes back to
+ * receiving everything.
+ */
+void setClientView(Client *client, int has_view, long long left, long long bottom, long long width, long long height) {
+    int x = 0, y = 0, w = 0, h = 0;
+
+    if (has_view) {
+        if (clipToBoard(left, bottom, width, height, &x, &y, &w, &h) < 0) {
+            clientSendText(client, "Invalid region.\n");
+            return;
+        }
+        if ((long long)w * h > MAX_REGION_CELLS) {
+            clientSendText(client, "Region too large.\n");
+            return;
+        }
+    }
+    indexClient(client, 0);
+    client->has_view = has_view;
+    client->view_x = x;
+    client->view_y = y;
+    client->view_w = w;
+    client->view_h = h;
+    indexClient(client, 1);
+    sendClientBoard(client);
+}
+
+void viewCommand(Client *client, char **saveptr) {
+    char *token = strtok_r(NULL, " ", saveptr);
+    int x, y, w, h;
+
+    if (token == NULL) {
+        setClientView(client, 0, 0, 0, 0, 0);
+    } else if (parseNumber(token, &x) < 0 || nextNumber(saveptr, &y) < 0 ||
+               nextNumber(saveptr, &w) < 0 || nextNumber(saveptr, &h) < 0) {
+        clientSendText(client, "Usage: /view [<x> <y> <w> <h>]\n");
+    } else {
+        setClientView(client, 1, x, y, w, h);
+    }
+}
+
+void resetCommand(Client *client) {
+    resetBoard();
+    clientSendText(client, "Board reset.\n");
+}
+
+/*
+ * /undo and /redo: put back what this client's last command (or last undo)
+ * replaced. Cells someone else has changed since are left alone. The result
+ * is logged as OP_PUT records and becomes the matching /redo (or /undo).
+ */
+void undoCommand(Client *client, int redo) {
+    HistoryRange *stack = redo ? client->redo : client->undo;
+    int *depth = redo ? &client->redo_count : &client->undo_count;
+    HistoryRange range;
+    HistoryEntry *entries;
+    BoardBatch batch;
+    BoardOp *op;
+    int first_row = board_height - 1, last_row = 0, available;
+    char reply[64];
+
+    if (*depth == 0) {
+        clientSendText(client, redo ? "Nothing to redo.\n" : "Nothing to undo.\n");
+        return;
+    }
+    range = stack[--*depth];
+    entries = (HistoryEntry*)malloc(range.count * sizeof(HistoryEntry));
+    op = (BoardOp*)malloc(sizeof(BoardOp));
+    if (entries == NULL || op == NULL) {
+        free(entries);
+        free(op);
+        return;
+    }
+    pthread_mutex_lock(&journal_lock);
+    available = range.start >= journal_tail;
+    for (uint32_t i = 0; available && i < range.count; i++) {
+        entries[i] = *journalAt(range.start + i);
+    }
+    pthread_mutex_unlock(&journal_lock);
+    if (!available) {
+        *depth = 0; // Everything older is gone as well
+        clientSendText(client, "That change is too old to undo.\n");
+        free(entries);
+        free(op);
+        return;
+    }
+    for (uint32_t i = 0; i < range.count; i++) {
+        if ((int)entries[i].y < first_row) first_row = entries[i].y;
+        if ((int)entries[i].y > last_row) last_row = entries[i].y;
+    }
+
+    op->type = OP_PUT;
+    op->symbol = 0;
+    op->count = 0;
+    batchBegin(&batch, first_row, last_row, client);
+    // Newest first, so a cell written twice ends up with its oldest value
+    for (uint32_t i = range.count; i-- > 0;) {
+        const HistoryEntry *entry = &entries[i];
+        if (boardGet(entry->x, entry->y) != entry->after) {
+            continue;
+        }
+        batchSet(&batch, entry->x, entry->y, entry->before);
+        op->values[op->count++] = entry->x;
+        op->values[op->count++] = entry->y;
+        op->values[op->count++] = (unsigned char)entry->before;
+        if (op->count == 3 * MAX_PUT_CELLS) {
+            walAppend(op);
+            op->count = 0;
+        }
+    }
+    if (op->count > 0) {
+        walAppend(op);
+    }
+    batchCommit(&batch);
+    if (redo) {
+        historyPush(client->undo, &client->undo_count, batch.written);
+    } else {
+        historyPush(client->redo, &client->redo_count, batch.written);
+    }
+    snprintf(reply, sizeof(reply), redo ? "Redid %d cells.\n" : "Undid %d cells.\n", batch.count);
+    clientSendText(client, reply);
+    free(entries);
+    free(op);
+}
+
+// /history: the updates still covered; /history <seq> [<x> <y> <w> <h>]: that area as it was then
+void historyCommand(Client *client, char **saveptr) {
+    char *token = strtok_r(NULL, " ", saveptr);
+    int x = 0, y = 0, w = board_width, h = board_height;
+
+    if (history_capacity == 0) {
+        clientSendText(client, "History is turned off.\n");
+        return;
+    }
+    if (token == NULL) {
+        char reply[96];
+        pthread_mutex_lock(&journal_lock);
+        int usable = keyframe_count > 0 && keyframes[0].position >= journal_tail;
+        unsigned long oldest = usable ? keyframes[0].seq : 0;
+        pthread_mutex_unlock(&journal_lock);
+        if (!usable) {
+            clientSendText(client, "No history is available.\n");
+        } else {
+            snprintf(reply, sizeof(reply), "History covers updates %lu to %lu.\n", oldest, atomic_load(&board_seq));
+            clientSendText(client, reply);
+        }
+        return;
+    }
+
+    char *end;
+    unsigned long seq = strtoul(token, &end, 10);
+    if (*end != '\0' || token[0] == '-') {
+        clientSendText(client, "Usage: /history [<seq> [<x> <y> <w> <h>]]\n");
+        return;
+    }
+    if (client->has_view) {
+        x = client->view_x;
+        y = client->view_y;
+        w = client->view_w;
+        h = client->view_h;
+    } else if (!boardFitsSnapshot()) {
+        w = w < DEFAULT_BOARD_WIDTH ? w : DEFAULT_BOARD_WIDTH;
+        h = h < DEFAULT_BOARD_HEIGHT ? h : DEFAULT_BOARD_HEIGHT;
+    }
+    if ((token = strtok_r(NULL, " ", saveptr)) != NULL &&
+        (parseNumber(token, &x) < 0 || nextNumber(saveptr, &y) < 0 ||
+         nextNumber(saveptr, &w) < 0 || nextNumber(saveptr, &h) < 0)) {
+        clientSendText(client, "Usage: /history [<seq> [<x> <y> <w> <h>]]\n");
+        return;
+    }
+    sendHistory(client, seq, x, y, w, h);
+}
+
+/*
+ * Metrics exposure: /stats for clients, and with -M a small HTTP server on
+ * 127.0.0.1 for Prometheus (GET /metrics) and for changing the log level
+ * (GET or POST /loglevel?level=debug). It runs on its own thread and only
+ * reads what the reactors record, so a slow scrape never stalls the board.
+ */
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} TextBuffer;
+
+void textAppend(TextBuffer *text, const char *format, ...) {
+    va_list args;
+    for (;;) {
+        va_start(args, format);
+        int needed = vsnprintf(text->data + text->length, text->capacity - text->length, format, args);
+        va_end(args);
+        if (needed < 0) {
+            return;
+        }
+        if (text->length + needed < text->capacity) {
+            text->length += needed;
+            return;
+        }
+        size_t capacity = text->capacity == 0 ? 4096 : text->capacity * 2;
+        while (capacity <= text->length + needed) {
+            capacity *= 2;
+        }
+        char *grown = (char*)realloc(text->data, capacity);
+        if (grown == NULL) {
+            return;
+        }
+        text->data = grown;
+        text->capacity = capacity;
+    }
+}
+
+typedef struct {
+    unsigned long accepts;
+    unsigned long disconnects;
+    unsigned long slow_disconnects;
+    unsigned long coalesced;
+    unsigned long bytes_in;
+    unsigned long bytes_out;
+    unsigned long send_calls;
+    unsigned long zerocopy_sends;
+    unsigned long zerocopy_copied;
+    unsigned long syscalls;
+    unsigned long online;
+    unsigned long queued_bytes;
+    unsigned long mailbox_pending;
+    unsigned long commands[COMMAND_KINDS];
+    HistogramTotals command_time[COMMAND_KINDS];
+    HistogramTotals fanout_time;
+    HistogramTotals mailbox_depth;
+    HistogramTotals tick_time;
+} MetricsTotals;
+
+#define metricRead(counter) atomic_load_explicit(&(counter), memory_order_relaxed)
+
+// Sum every reactor's metrics; the totals are large, so they live on the heap
+MetricsTotals *metricsCollect() {
+    MetricsTotals *totals = (MetricsTotals*)calloc(1, sizeof(MetricsTotals));
+    if (totals == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < reactor_count; i++) {
+        ReactorMetrics *metrics = &reactors[i].metrics;
+        totals->accepts += metricRead(metrics->accepts);
+        totals->disconnects += metricRead(metrics->disconnects);
+        totals->slow_disconnects += metricRead(metrics->slow_disconnects);
+        totals->coalesced += metricRead(metrics->coalesced);
+        totals->bytes_in += metricRead(metrics->bytes_in);
+        totals->bytes_out += metricRead(metrics->bytes_out);
+        totals->send_calls += metricRead(metrics->send_calls);
+        totals->zerocopy_sends += metricRead(metrics->zerocopy_sends);
+        totals->zerocopy_copied += metricRead(metrics->zerocopy_copied);
+        totals->syscalls += metricRead(metrics->syscalls);
+        totals->online += metricRead(metrics->online);
+        totals->queued_bytes += metricRead(metrics->queued_bytes);
+        for (int kind = 0; kind < COMMAND_KINDS; kind++) {
+            totals->commands[kind] += metricRead(metrics->commands[kind]);
+            histogramAdd(&totals->command_time[kind], &metrics->command_time[kind]);
+        }
+        histogramAdd(&totals->fanout_time, &metrics->fanout_time);
+        histogramAdd(&totals->mailbox_depth, &metrics->mailbox_depth);
+        histogramAdd(&totals->tick_time, &metrics->tick_time);
+
+        pthread_mutex_lock(&reactors[i].mailbox_lock);
+        totals->mailbox_pending += reactors[i].mailbox_count;
+        pthread_mutex_unlock(&reactors[i].mailbox_lock);
+    }
+    return totals;
+}
+
+// Prometheus summary; scale converts recorded units (nanoseconds) to the exported ones
+void metricsSummary(TextBuffer *out, const char *name, const char *label, const HistogramTotals *totals, double scale) {
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    const char *separator = label[0] != '\0' ? "," : "";
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+        textAppend(out, "%s{%s%squantile=\"%g\"} %.9g\n", name, label, separator, quantiles[i],
+                   histogramPercentile(totals, quantiles[i]) * scale);
+    }
+    if (label[0] != '\0') {
+        textAppend(out, "%s_sum{%s} %.9g\n%s_count{%s} %lu\n", name, label, totals->sum * scale, name, label, totals->total);
+    } else {
+        textAppend(out, "%s_sum %.9g\n%s_count %lu\n", name, totals->sum * scale, name, totals->total);
+    }
+}
+
+void metricsRender(TextBuffer *out) {
+    MetricsTotals *totals = metricsCollect();
+    if (totals == NULL) {
+        return;
+    }
+    HistogramTotals *wal_sync = (HistogramTotals*)calloc(2, sizeof(HistogramTotals));
+    if (wal_sync == NULL) {
+        free(totals);
+        return;
+    }
+    HistogramTotals *snapshot = wal_sync + 1;
+    histogramAdd(wal_sync, &wal_sync_time);
+    histogramAdd(snapshot, &snapshot_time);
+
+    pthread_mutex_lock(&dirty_lock);
+    size_t dirty = dirty_tile_count;
+    pthread_mutex_unlock(&dirty_lock);
+    pthread_mutex_lock(&wal_lock);
+    size_t wal_pending = wal_length;
+    pthread_mutex_unlock(&wal_lock);
+    pthread_mutex_lock(&journal_lock);
+    uint64_t journal_entries = journal_head - journal_tail;
+    pthread_mutex_unlock(&journal_lock);
+
+    textAppend(out,
+        "# TYPE board_accepts_total counter\nboard_accepts_total %lu\n"
+        "# TYPE board_disconnects_total counter\nboard_disconnects_total %lu\n"
+        "# TYPE board_slow_disconnects_total counter\nboard_slow_disconnects_total %lu\n"
+        "# TYPE board_coalesced_total counter\nboard_coalesced_total %lu\n"
+        "# TYPE board_received_bytes_total counter\nboard_received_bytes_total %lu\n"
+        "# TYPE board_sent_bytes_total counter\nboard_sent_bytes_total %lu\n"
+        "# TYPE board_send_calls_total counter\nboard_send_calls_total %lu\n"
+        "# TYPE board_zerocopy_sends_total counter\nboard_zerocopy_sends_total %lu\n"
+        "# TYPE board_zerocopy_copied_total counter\nboard_zerocopy_copied_total %lu\n"
+        "# TYPE board_syscalls_total counter\nboard_syscalls_total %lu\n"
+        "# TYPE board_clients gauge\nboard_clients %lu\n"
+        "# TYPE board_queued_bytes gauge\nboard_queued_bytes %lu\n"
+        "# TYPE board_mailbox_pending gauge\nboard_mailbox_pending %lu\n"
+        "# TYPE board_dirty_tiles gauge\nboard_dirty_tiles %zu\n"
+        "# TYPE board_wal_pending_bytes gauge\nboard_wal_pending_bytes %zu\n"
+        "# TYPE board_journal_entries gauge\nboard_journal_entries %llu\n"
+        "# TYPE board_seq gauge\nboard_seq %lu\n",
+        totals->accepts, totals->disconnects, totals->slow_disconnects, totals->coalesced,
+        totals->bytes_in, totals->bytes_out, totals->send_calls, totals->zerocopy_sends, totals->zerocopy_copied, totals->syscalls, totals->online, totals->queued_bytes, totals->mailbox_pending,
+        dirty, wal_pending, (unsigned long long)journal_entries, atomic_load(&board_seq));
+
+    textAppend(out, "# TYPE board_commands_total counter\n");
+    for (int kind = 0; kind < COMMAND_KINDS; kind++) {
+        textAppend(out, "board_commands_total{command=\"%s\"} %lu\n", command_names[kind], totals->commands[kind]);
+    }
+    textAppend(out, "# TYPE board_command_seconds summary\n");
+    for (int kind = 0; kind < COMMAND_KINDS; kind++) {
+        char label[32];
+        snprintf(label, sizeof(label), "command=\"%s\"", command_names[kind]);
+        metricsSummary(out, "board_command_seconds", label, &totals->command_time[kind], 1e-9);
+    }
+    textAppend(out, "# TYPE board_fanout_seconds summary\n");
+    metricsSummary(out, "board_fanout_seconds", "", &totals->fanout_time, 1e-9);
+    textAppend(out, "# TYPE board_mailbox_depth summary\n");
+    metricsSummary(out, "board_mailbox_depth", "", &totals->mailbox_depth, 1);
+    textAppend(out, "# TYPE board_tick_seconds summary\n");
+    metricsSummary(out, "board_tick_seconds", "", &totals->tick_time, 1e-9);
+    textAppend(out, "# TYPE board_wal_sync_seconds summary\n");
+    metricsSummary(out, "board_wal_sync_seconds", "", wal_sync, 1e-9);
+    textAppend(out, "# TYPE board_snapshot_seconds summary\n");
+    metricsSummary(out, "board_snapshot_seconds", "", snapshot, 1e-9);
+    textAppend(out,
+        "# TYPE board_log_level gauge\nboard_log_level %d\n"
+        "# TYPE board_log_dropped_total counter\nboard_log_dropped_total %lu\n"
+        "# TYPE board_log_suppressed_total counter\nboard_log_suppressed_total %lu\n",
+        atomic_load(&log_level), atomic_load(&log_dropped), atomic_load(&log_suppressed));
+
+    free(wal_sync);
+    free(totals);
+}
+
+// /stats: the counters and the command latencies worth a glance, in milliseconds
+void statsCommand(Client *client) {
+    TextBuffer out = { NULL, 0, 0 };
+    MetricsTotals *totals = metricsCollect();
+    if (totals == NULL) {
+        clientSendText(client, "Cannot collect statistics right now.\n");
+        return;
+    }
+    textAppend(&out, "\nclients %lu, accepted %lu, received %lu bytes, sent %lu bytes, queued %lu bytes\n",
+               totals->online, totals->accepts, totals->bytes_in, totals->bytes_out, totals->queued_bytes);
+    textAppend(&out, "slow clients: %lu disconnected, %lu coalesced\n", totals->slow_disconnects, totals->coalesced);
+    for (int kind = 0; kind < COMMAND_KINDS; kind++) {
+        const HistogramTotals *time = &totals->command_time[kind];
+        if (totals->commands[kind] > 0) {
+            textAppend(&out, "%-9s %8lu  p50 %.3f  p99 %.3f  p99.9 %.3f  max %.3f ms\n", command_names[kind],
+                       totals->commands[kind], histogramPercentile(time, 0.5) / 1e6,
+                       histogramPercentile(time, 0.99) / 1e6, histogramPercentile(time, 0.999) / 1e6,
+                       time->max / 1e6);
+        }
+    }
+    textAppend(&out, "fan-out   %8lu  p50 %.3f  p99 %.3f  p99.9 %.3f  max %.3f ms\n", totals->fanout_time.total,
+               histogramPercentile(&totals->fanout_time, 0.5) / 1e6, histogramPercentile(&totals->fanout_time, 0.99) / 1e6,
+               histogramPercentile(&totals->fanout_time, 0.999) / 1e6, totals->fanout_time.max / 1e6);
+    if (out.data != NULL) {
+        clientSend(client, MESSAGE_TEXT, out.data, out.length);
+    }
+    free(out.data);
+    free(totals);
+}
+
+void metricsReply(int fd, const char *status, const char *body, size_t length) {
+    char header[256];
+    int header_length = snprintf(header, sizeof(header),
+        "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+        status, length);
+    if (writeAll(fd, (const unsigned char*)header, header_length) == 0) {
+        writeAll(fd, (const unsigned char*)body, length);
+    }
+}
+
+void metricsRequest(int fd) {
+    char request[2048];
+    size_t length = 0;
+
+    // Only the request line matters; stop at the end of the headers or a full buffer
+    while (length < sizeof(request) - 1) {
+        ssize_t received = recv(fd, request + length, sizeof(request) - 1 - length, 0);
+        if (received <= 0) {
+            break;
+        }
+        length += received;
+        request[length] = '\0';
+        if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL) {
+            break;
+        }
+    }
+    request[length] = '\0';
+
+    char method[8], target[256];
+    if (sscanf(request, "%7s %255s", method, target) != 2) {
+        metricsReply(fd, "400 Bad Request", "Bad request\n", 12);
+        return;
+    }
+    if (strcmp(target, "/metrics") == 0) {
+        TextBuffer out = { NULL, 0, 0 };
+        metricsRender(&out);
+        metricsReply(fd, "200 OK", out.data != NULL ? out.data : "", out.length);
+        free(out.data);
+    } else if (strncmp(target, "/loglevel", 9) == 0 && (target[9] == '\0' || target[9] == '?')) {
+        const char *query = strstr(target, "level=");
+        char reply[64];
+        if (query != NULL) {
+            int level = parseLogLevel(query + 6);
+            if (level < 0) {
+                metricsReply(fd, "400 Bad Request", "level must be error, warn, info or debug\n", 41);
+                return;
+            }
+            atomic_store(&log_level, level);
+        }
+        snprintf(reply, sizeof(reply), "%s\n", log_level_names[atomic_load(&log_level)]);
+        metricsReply(fd, "200 OK", reply, strlen(reply));
+    } else {
+        metricsReply(fd, "404 Not Found", "Not found\n", 10);
+    }
+}
+
+// One request per connection, served in turn; scrapes are rare and cheap
+void *metricsServer(void *arg) {
+    int listen_fd = *(int*)arg;
+    snprintf(log_thread_name, sizeof(log_thread_name), "metrics");
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR) {
+                logAt(LOG_ERROR, "metrics: %s\n", strerror(errno));
+            }
+            continue;
+        }
+        // A stalled scraper must not hold the port forever
+        struct timeval timeout = { 2, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        metricsRequest(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+int metricsStart(unsigned int port) {
+    static int listen_fd;
+    struct sockaddr_in address;
+    pthread_t thread;
+    int one = 1;
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        return -1;
+    }
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // Local only: anyone who reaches it can change the log level
+    if (bind(listen_fd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(listen_fd, 16) < 0 ||
+        pthread_create(&thread, NULL, metricsServer, &listen_fd) != 0) {
+        close(listen_fd);
+        return -1;
+    }
+    return 0;
+}
+
+// Relay a chat line as "<username>: <text>" to everyone
+void chatMessage(Client *client, const char *text, size_t length) {
+    char buffer[MAX_LINE_LENGTH + MAX_USERNAME_LENGTH + 3];
+    size_t uname_length = strlen(client->username);
+
+    if (length > sizeof(buffer) - uname_length - 3) {
+        length = sizeof(buffer) - uname_length - 3;
+    }
+    memcpy(buffer, client->username, uname_length);
+    memcpy(buffer + uname_length, ": ", 2);
+    memcpy(buffer + uname_length + 2, text, length);
+    length += uname_length + 2;
+
+    // Lines arrive without their newline; text peers need it back, a CHAT frame is delimited already
+    buffer[length] = '\n';
+    Message *message = createMessage(MESSAGE_TEXT, buffer, length + 1, 0);
+    if (message == NULL) {
+        return;
+    }
+    message->binary = createFrame(MESSAGE_TEXT, FRAME_CHAT, length, 0);
+    if (message->binary != NULL) {
+        memcpy(message->binary->data + FRAME_HEADER_SIZE, buffer, length);
+    }
+    pthread_mutex_lock(&bus_lock);
+    publishMessageLocked(message);
+    pthread_mutex_unlock(&bus_lock);
+    releaseMessage(message);
+}
+
+void commandParse (char *command, Client *client) {
+    char *saveptr = NULL; // strtok() is not safe with several reactor threads
+    char *token = strtok_r(command, " ", &saveptr);
+    if (token == NULL) {
+        clientSendText(client, "Unknown command. Type /help for a list of available commands.\n");
+        return;
+    }
+
+    if (strcmp(token, "/draw") == 0) {
+        int x, y;
+        char symbol;
+        token = strtok_r(NULL, " ", &saveptr);
+        if (token != NULL) x = atoi(token);
+        token = strtok_r(NULL, " ", &saveptr);
+        if (token != NULL) y = atoi(token);
+        token = strtok_r(NULL, " ", &saveptr);
+        if (token != NULL && strlen(token) == 1) symbol = token[0];
+
+        if (token == NULL || strlen(token) != 1) {
+            clientSendText(client, "Usage: /draw <x> <y> <symbol>\n");
+        } else {
+            drawCommand(client, x, y, symbol);
+        }
+    } else if (strcmp(token, "/drawmany") == 0) {
+        drawManyCommand(client, &saveptr);
+    } else if (strcmp(token, "/line") == 0) {
+        lineCommand(client, &saveptr);
+    } else if (strcmp(token, "/rect") == 0) {
+        rectCommand(client, &saveptr);
+    } else if (strcmp(token, "/fill") == 0) {
+        fillCommand(client, &saveptr);
+    } else if (strcmp(token, "/show") == 0) {
+        showCommand(client, &saveptr);
+    } else if (strcmp(token, "/view") == 0) {
+        viewCommand(client, &saveptr);
+    } else if (strcmp(token, "/reset") == 0) {
+        resetCommand(client);
+    } else if (strcmp(token, "/undo") == 0) {
+        undoCommand(client, 0);
+    } else if (strcmp(token, "/redo") == 0) {
+        undoCommand(client, 1);
+    } else if (strcmp(token, "/history") == 0) {
+        historyCommand(client, &saveptr);
+    } else if (strcmp(token, "/stats") == 0) {
+        statsCommand(client);
+    } else if (strcmp(token, "/help") == 0) {
+        clientSendText(client, "\nAvailable commands:\n/draw <x> <y> <symbol>\n/drawmany <symbol> <x> <y> [<x> <y> ...]\n/line <x0> <y0> <x1> <y1> <symbol>\n/rect <x0> <y0> <x1> <y1> <symbol> [filled]\n/fill <x> <y> <symbol>\n/show [<x> <y> <w> <h>]\n/view [<x> <y> <w> <h>]\n/undo\n/redo\n/history [<seq> [<x> <y> <w> <h>]] (as of roughly update <seq>)\n/stats\n/reset\n/help\n/exit\n");
+    } else {
+        clientSendText(client, "Unknown command. Type /help for a list of available commands.\n");
+    }
+}
+
+// Close a client marked dead and tell everyone else it left
+void disconnectClient(Client *client) {
+    if (client->username[0] != '\0') {
+        char str[MAX_USERNAME_LENGTH + 20];
+        sprintf(str, "%s disconnected.", client->username);
+        broadcastMessage(FRAME_TEXT, str, strlen(str), client);
+    }
+    logAt(LOG_DEBUG, "Client %lu disconnected.\n", client->id);
+    metricAdd(&client->reactor->metrics.disconnects, 1);
+#ifdef USE_URING
+    if (event_backend == BACKEND_URING) {
+        // The kernel may still be reading this client's messages and using its fd.
+        // Shutting the socket down ends those operations; the fd stays open until
+        // they have completed so its number cannot be reused under them.
+        metricAdd(&client->reactor->metrics.syscalls, 1);
+        shutdown(client->fd, SHUT_RDWR);
+        unlinkClient(client);
+        client->closing = 1;
+        uringRetire(client);
+        return;
+    }
+#endif
+    eventRemove(client);
+    metricAdd(&client->reactor->metrics.syscalls, 1);
+    close(client->fd);
+    removeClient(client);
+}
+
+// Store the username and send the greeting, notice to others and the first snapshot
+void welcomeClient(Client *client, const char *username, size_t length) {
+    if (length > MAX_USERNAME_LENGTH - 1) {
+        length = MAX_USERNAME_LENGTH - 1;
+    }
+    memcpy(client->username, username, length);
+    client->username[length] = '\0';
+    client->username[strcspn(client->username, "\r\n")] = '\0';
+    if (client->username[0] == '\0') {
+        strcpy(client->username, "Anon");
+    }
+    logAt(LOG_DEBUG, "Client %lu is now called %s.\n", client->id, client->username);
+    indexClient(client, 1);
+
+    char str[MAX_USERNAME_LENGTH + 20];
+    sprintf(str, "%s connected.", client->username);
+    clientSendText(client, "Welcome to the server!\n");
+    broadcastMessage(FRAME_TEXT, str, strlen(str), client);
+    // Send initial board to the newly connected client
+    sendBoardSnapshot(client);
+}
+
+// Metrics bucket for a text command line, by its first word
+CommandKind commandKind(const char *command) {
+    size_t length = strcspn(command, " ");
+    if (command[0] == '/') {
+        for (int kind = 0; kind < COMMAND_CHAT; kind++) {
+            if (strlen(command_names[kind]) == length - 1 && memcmp(command + 1, command_names[kind], length - 1) == 0) {
+                return (CommandKind)kind;
+            }
+        }
+    }
+    return COMMAND_OTHER;
+}
+
+void commandDone(Client *client, CommandKind kind, long long start) {
+    ReactorMetrics *metrics = &client->reactor->metrics;
+    metricAdd(&metrics->commands[kind], 1);
+    histogramRecordSince(&metrics->command_time[kind], start);
+}
+
+// Handle one line from a text client: username first, then commands or chat
+void handleClientData(Client *client, char *data, int length) {
+    if (client->username[0] == '\0') {
+        clientSendText(client, "Enter your username: ");
+        welcomeClient(client, data, length);
+        return;
+    }
 
-struct {
-    int x;
-    int y;
-    char symbol;
-} DrawPoint;
+    long long start = monotonicNanos();
+    CommandKind kind = COMMAND_CHAT;
+    if (data[0] == '/') {
+        logAt(LOG_DEBUG, "Command detected: \"%s\"\n", data);
+        kind = commandKind(data);
+        commandParse(data, client);
+    } else {
+        chatMessage(client, data, length);
+    }
+    commandDone(client, kind, start);
+}
 
-char board[BOARD_HEIGHT][BOARD_WIDTH];
+// FRAME_HELLO: agree on a version, then greet the client like a text user
+void handleHello(Client *client, const unsigned char *payload, uint32_t length) {
+    if (length < 2 || payload[0] < PROTOCOL_MIN_VERSION) {
+        clientSendText(client, "Unsupported protocol version.\n");
+        markDead(client);
+        return;
+    }
+    client->protocol_version = payload[0] < PROTOCOL_VERSION ? payload[0] : PROTOCOL_VERSION;
+    client->features = payload[1] & (HELLO_FLAG_RLE | HELLO_FLAG_DRAW_ACK);
 
-int draw(int x, int y, char symbol)
-{
-    //y = BOARD_HEIGHT - y - 1; // Invert the y-axis
-    if (x < 0 || x >= BOARD_WIDTH || y < 0 || y >= BOARD_HEIGHT)
-    {
-        return -1;
+    Message *ack = createFrame(MESSAGE_TEXT, FRAME_HELLO_ACK, HELLO_ACK_SIZE, 0);
+    if (ack != NULL) {
+        unsigned char *reply = (unsigned char*)ack->data + FRAME_HEADER_SIZE;
+        reply[0] = client->protocol_version;
+        reply[1] = client->features;
+        put_u32(reply + 2, board_width);
+        put_u32(reply + 6, board_height);
+        clientQueueEncoded(client, ack);
+        releaseMessage(ack);
     }
-    board[y][x] = symbol;
-    return 0;
+    welcomeClient(client, (const char*)payload + 2, length - 2);
 }
 
-char* showBoard() {
-    char *strboard = (char*)malloc((BOARD_WIDTH * (BOARD_HEIGHT + 1) + 1) * sizeof(char)); // Allocate memory
-    if (strboard == NULL) {
-        perror("Failed to allocate memory for board string");
-        return NULL;
+void handleFrame(Client *client, uint8_t type, const unsigned char *payload, uint32_t length) {
+    char command[MAX_LINE_LENGTH];
+    long long start;
+    CommandKind kind = COMMAND_OTHER;
+
+    if (client->protocol_version == 0) {
+        if (type != FRAME_HELLO) {
+            markDead(client);
+            return;
+        }
+        handleHello(client, payload, length);
+        return;
     }
-    int index = 0;
-    for (int i = BOARD_HEIGHT - 1; i >= 0; i--) { // Adjust to display the board correctly
-        for (int j = 0; j < BOARD_WIDTH; j++) {
-            strboard[index++] = board[i][j] == 0 ? ' ' : board[i][j]; // Use space for empty cells
+
+    start = monotonicNanos();
+    switch (type) {
+    case FRAME_DRAW:
+        kind = COMMAND_DRAW;
+        if (length == DRAW_ID_SIZE && (client->features & HELLO_FLAG_DRAW_ACK)) {
+            drawAckCommand(client, (int)get_u32(payload), (int)get_u32(payload + 4), (char)payload[8],
+                           get_u32(payload + 9));
+        } else if (length != 9) {
+            clientSendText(client, "Usage: /draw <x> <y> <symbol>\n");
+        } else if (!isgraph(payload[8])) {
+            // 0 means an empty cell and control bytes would break the text DELTA lines
+            clientSendText(client, "Invalid symbol.\n");
+        } else {
+            drawCommand(client, (int)get_u32(payload), (int)get_u32(payload + 4), (char)payload[8]);
+        }
+        break;
+    case FRAME_SHOW:
+        kind = COMMAND_SHOW;
+        // Optional payload: u32 x, u32 y, u32 w, u32 h; x and y are signed, so an area may start off the board
+        if (length >= 16) {
+            sendRegion(client, (int32_t)get_u32(payload), (int32_t)get_u32(payload + 4),
+                       get_u32(payload + 8), get_u32(payload + 12));
+        } else {
+            sendBoardSnapshot(client);
+        }
+        break;
+    case FRAME_VIEW:
+        kind = COMMAND_VIEW;
+        // u32 x, u32 y, u32 w, u32 h, or empty to drop the view
+        if (length >= 16) {
+            setClientView(client, 1, (int32_t)get_u32(payload), (int32_t)get_u32(payload + 4),
+                          get_u32(payload + 8), get_u32(payload + 12));
+        } else {
+            setClientView(client, 0, 0, 0, 0, 0);
+        }
+        break;
+    case FRAME_RESET:
+        kind = COMMAND_RESET;
+        resetCommand(client);
+        break;
+    case FRAME_CHAT:
+        kind = COMMAND_CHAT;
+        chatMessage(client, (const char*)payload, length);
+        break;
+    case FRAME_COMMAND:
+        if (length >= sizeof(command)) {
+            length = sizeof(command) - 1;
         }
-        strboard[index++] = '\n';
+        memcpy(command, payload, length);
+        command[length] = '\0';
+        kind = commandKind(command);
+        commandParse(command, client);
+        break;
+    default:
+        clientSendText(client, "Unknown command. Type /help for a list of available commands.\n");
+        break;
     }
-    strboard[index] = '\0'; // Null-terminate the string
-    return strboard;
+    commandDone(client, kind, start);
 }
 
-
-void sendBoardToClients(int current_client_fd, struct pollfd *pfds) {
-    char* board_string = showBoard();
-    if (board_string != NULL) {
-        for (int i = 1; i <= MAX_CONNECTED_CLIENTS; i++) {
-            if (pfds[i].fd != -1 && pfds[i].fd != current_client_fd) {
-                send(pfds[i].fd, board_string, strlen(board_string), 0);
-            }
+// Add received bytes to the client's reassembly buffer
+int appendInbound(Client *client, const char *data, size_t length) {
+    if (client->in_length + length > client->in_capacity) {
+        size_t capacity = client->in_capacity == 0 ? 4096 : client->in_capacity;
+        while (capacity < client->in_length + length) {
+            capacity *= 2;
         }
-        free(board_string); // Free the allocated memory
+        unsigned char *grown = (unsigned char*)realloc(client->inbound, capacity);
+        if (grown == NULL) {
+            markDead(client);
+            return -1;
+        }
+        client->inbound = grown;
+        client->in_capacity = capacity;
     }
+    memcpy(client->inbound + client->in_length, data, length);
+    client->in_length += length;
+    return 0;
 }
 
+// Drop what was handled from the front of the reassembly buffer
+void consumeInbound(Client *client, size_t length) {
+    memmove(client->inbound, client->inbound + length, client->in_length - length);
+    client->in_length -= length;
+}
 
+/*
+ * Split text input into lines and handle all complete ones, so pipelined
+ * commands are neither merged nor lost. A partial line waits for more data.
+ */
+void handleClientLines(Client *client, const char *data, size_t length) {
+    if (appendInbound(client, data, length) < 0) {
+        return;
+    }
 
+    size_t offset = 0;
+    while (!client->dead) {
+        char *line = (char*)client->inbound + offset;
+        char *newline = memchr(line, '\n', client->in_length - offset);
+        if (newline == NULL) {
+            break;
+        }
+        size_t line_length = newline - line;
+        offset += line_length + 1;
+        if (client->in_discard) {
+            client->in_discard = 0; // The end of a line already refused
+            continue;
+        }
+        if (line_length > 0 && line[line_length - 1] == '\r') {
+            line_length--; // Telnet sends CRLF
+        }
+        if (line_length > MAX_LINE_LENGTH) {
+            clientSendText(client, "Line too long.\n");
+            continue;
+        }
+        line[line_length] = '\0';
+        if (line_length > 0 || client->username[0] == '\0') {
+            handleClientData(client, line, line_length);
+        }
+    }
+    consumeInbound(client, offset);
 
-void resetBoard () {
-    memset(board, 0, sizeof(board));
+    // A partial line over the limit is refused now and the rest of it dropped as it arrives
+    if (client->in_length > MAX_LINE_LENGTH) {
+        if (!client->in_discard) {
+            clientSendText(client, "Line too long.\n");
+            client->in_discard = 1;
+        }
+        client->in_length = 0;
+    }
 }
 
-void commandParse (char *command, int client_fd, struct pollfd *pfds) {
-    char *token = strtok(command, " ");
-    if (token == NULL) {
-        send(client_fd, "Unknown command. Type /help for a list of available commands.\n", 64, 0);
+// Append received bytes and handle every complete frame; a partial frame waits for more data
+void handleClientFrames(Client *client, const char *data, size_t length) {
+    if (appendInbound(client, data, length) < 0) {
         return;
     }
 
-    if (strcmp(token, "/draw") == 0) {
-        int x, y;
-        char symbol;
-        token = strtok(NULL, " ");
-        if (token != NULL) x = atoi(token);
-        token = strtok(NULL, " ");
-        if (token != NULL) y = atoi(token);
-        token = strtok(NULL, " ");
-        if (token != NULL && strlen(token) == 1) symbol = token[0];
+    size_t offset = 0;
+    while (client->in_length - offset >= FRAME_HEADER_SIZE && !client->dead) {
+        const unsigned char *frame = client->inbound + offset;
+        uint32_t payload_length = get_u32(frame + 1);
+        if (payload_length > MAX_FRAME_PAYLOAD) {
+            markDead(client);
+            return;
+        }
+        if (client->in_length - offset < FRAME_HEADER_SIZE + payload_length) {
+            break;
+        }
+        handleFrame(client, frame[0], frame + FRAME_HEADER_SIZE, payload_length);
+        offset += FRAME_HEADER_SIZE + payload_length;
+    }
+    consumeInbound(client, offset);
+}
 
-        if (token == NULL || strlen(token) != 1) {
-            send(client_fd, "Usage: /draw <x> <y> <symbol>\n", 33, 0);
+// Hand received bytes to the client's protocol, recognising it from the first byte
+void handleInput(Client *client, const char *data, size_t length) {
+    metricAdd(&client->reactor->metrics.bytes_in, length);
+    if (client->protocol == PROTOCOL_UNKNOWN) {
+        // A FRAME_HELLO byte can't be typed on a terminal: binary client
+        client->protocol = (unsigned char)data[0] == FRAME_HELLO ? PROTOCOL_BINARY : PROTOCOL_TEXT;
+    }
+    if (client->protocol == PROTOCOL_BINARY) {
+        handleClientFrames(client, data, length);
+    } else {
+        handleClientLines(client, data, length);
+    }
+}
+
+// Drain the socket: with edge-triggered notification we must read until EAGAIN
+void readFromClient(Client *client) {
+    char buffer[16384];
+    for (;;) {
+        metricAdd(&client->reactor->metrics.syscalls, 1);
+        int s_len = recv(client->fd, buffer, sizeof(buffer), 0);
+        if (s_len > 0) {
+            handleInput(client, buffer, s_len);
+        } else if (s_len < 0 && errno == EINTR) {
+            continue;
+        } else if (s_len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
         } else {
-            int check = draw(x, y, symbol);
-            if (check == -1) {
-                send(client_fd, "Invalid coordinates.\n", 21, 0);
-            } else {
-                sendBoardToClients(-1, pfds);
-                send(client_fd, "Draw successful.\n", 18, 0);
-            }
+            markDead(client);
+            return;
         }
-    } else if (strcmp(token, "/show") == 0) {
-        char* board_string = showBoard();
-        if (board_string != NULL) {
-            send(client_fd, board_string, strlen(board_string), 0);
-            free(board_string);
+        if (client->dead) {
+            return;
         }
-    } else if (strcmp(token, "/reset") == 0) {
-        resetBoard();
-        send(client_fd, "Board reset.\n", 13, 0);
-        sendBoardToClients(-1, pfds);
-    } else if (strcmp(token, "/help") == 0) {
-        send(client_fd, "\nAvailable commands:\n/draw <x> <y> <symbol>\n/show\n/reset\n/help\n/exit\n", 71, 0);
-    } else {
-        send(client_fd, "Unknown command. Type /help for a list of available commands.\n", 64, 0);
     }
 }
 
+// Take on a freshly accepted connection
+void setupClient(Reactor *reactor, int c_socket) {
+    // Acks, deltas and broadcasts are small writes; don't let Nagle hold them back
+    int one = 1;
+    metricAdd(&reactor->metrics.syscalls, 1);
+    setsockopt(c_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    // Writes go through the outbound queue and must never block the reactor.
+    // io_uring wants blocking sockets: it waits for them itself instead of failing with EAGAIN.
+    if (event_backend != BACKEND_URING) {
+        metricAdd(&reactor->metrics.syscalls, 2);
+        setNonBlocking(c_socket);
+    }
 
+    Client *client = addClient(reactor, c_socket);
+    if (client == NULL || eventAdd(reactor, c_socket, client, 1) < 0) {
+        logAt(LOG_ERROR, "ERROR #6: cannot register client %d.\n", c_socket);
+        if (client != NULL) {
+            removeClient(client);
+        }
+        close(c_socket);
+        return;
+    }
+#ifdef USE_ZEROCOPY
+    if (zerocopy_threshold > 0) {
+        metricAdd(&reactor->metrics.syscalls, 1);
+        client->zerocopy = setsockopt(c_socket, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+    }
+#endif
+    metricAdd(&reactor->metrics.accepts, 1);
+    logAt(LOG_DEBUG, "Client %lu connected to reactor %d (fd %d, %zu online).\n",
+          client->id, reactor->id, c_socket, reactor->client_count);
+}
 
+void acceptClients(Reactor *reactor) {
+    struct sockaddr_in clientaddr; // Prisijungusio kliento adreso struktūra
+    socklen_t clientaddrlen = sizeof(clientaddr);
 
+    for (;;) {
+        metricAdd(&reactor->metrics.syscalls, 1);
+        int c_socket = accept(reactor->listen_fd, (struct sockaddr *)&clientaddr, &clientaddrlen);
+        if (c_socket < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                logAt(LOG_ERROR, "ERROR #5: error occured accepting connection.\n");
+            }
+            return;
+        }
+        setupClient(reactor, c_socket);
+    }
+}
 
+// How long reactor 0 may block: until the next tick while changes are waiting, else forever
+int tickTimeout(Reactor *reactor) {
+    if (reactor->id != 0 || tick_interval == 0 || !atomic_load(&board_dirty_pending)) {
+        return -1;
+    }
+    long long remaining = next_tick - monotonicMillis();
+    return remaining > 0 ? (int)remaining : 0;
+}
 
-int main(int argc, char *argv []){
-#ifdef _WIN32
-    WSADATA data;
-#endif
-    unsigned int port;
-    int l_socket; // socket'as skirtas prisijungimų laukimui
-    int c_socket; // prisijungusio kliento socket'as
+// End of a loop iteration, the same for every backend: board tick, broadcasts, queued sends, disconnects
+void reactorFinishIteration(Reactor *reactor) {
+    // The first change after a quiet spell goes out at once, later ones wait for the tick
+    if (tickTimeout(reactor) == 0) {
+        long long start = monotonicNanos();
+        flushBoardChanges();
+        histogramRecordSince(&reactor->metrics.tick_time, start);
+        next_tick = monotonicMillis() + tick_interval;
+    }
+    if (reactor->id == 0 && atomic_load(&history_rebase)) {
+        historyRebase();
+    }
+    drainMailbox(reactor);
+    uncorkReactor(reactor);
 
-    struct sockaddr_in servaddr; // Serverio adreso struktūra
-    struct sockaddr_in clientaddr; // Prisijungusio kliento adreso struktūra
-    socklen_t clientaddrlen = sizeof(struct sockaddr);
-
-    int s_len;
-    int r_len;
-    char buffer[4096];
-    
-    if (argc != 2){
-        printf("USAGE: %s <port>\n", argv[0]);
-        exit(1);
+    for (size_t i = 0; i < reactor->dead_count; i++) {
+        disconnectClient(reactor->dead[i]);
     }
+    reactor->dead_count = 0;
+}
 
-    port = atoi(argv[1]);
+#ifdef USE_URING
+// Submit what is queued and wait up to timeout ms (-1: forever) for a completion
+int uringWait(Reactor *reactor, int timeout) {
+    Uring *ring = &reactor->uring;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned head = *ring->cq_head;
 
-    if ((port < 1) || (port > 65535)){
-        printf("ERROR #1: invalid port specified.\n");
+    if (head != atomic_load_explicit((_Atomic unsigned*)ring->cq_tail, memory_order_acquire)) {
+        timeout = 0; // Completions are already waiting
+    }
+    memset(&arg, 0, sizeof(arg));
+    if (timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (long long)(timeout % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    int submitted = uringEnter(reactor, ring->to_submit, timeout == 0 ? 0 : 1,
+                               IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (submitted < 0) {
+        // ETIME: the timeout ran out; EBUSY: the completion queue overflowed and must be drained first
+        return errno == ETIME || errno == EINTR || errno == EBUSY || errno == EAGAIN ? 0 : -1;
+    }
+    ring->to_submit -= submitted;
+    return 0;
+}
+
+void uringReceived(Reactor *reactor, Client *client, const struct io_uring_cqe *cqe) {
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0 && !client->dead && !client->closing) {
+            handleInput(client, reactor->uring.buffers + (size_t)id * URING_BUFFER_SIZE, cqe->res);
+        }
+        uringRecycle(reactor, id);
+    }
+    if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS)) {
+        markDead(client); // EOF or error; also how the shutdown of a closing client ends its receive
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        // Multishot receives stop when every provided buffer is in use, among other reasons
+        client->recv_armed = 0;
+        if (!client->dead && !client->closing) {
+            uringRecv(client);
+        }
+    }
+}
+
+void uringSent(Client *client, const struct io_uring_cqe *cqe) {
+    client->send_ops--;
+    if (cqe->res == -ECANCELED || client->closing) {
+        // Cancelled because an earlier send of the chain failed, or nobody is left to account to
+    } else if (cqe->res < 0) {
+        markDead(client);
+    } else {
+        // The chain's sends complete in order, each continuing where the last stopped
+        size_t remaining = cqe->res;
+        metricAdd(&client->reactor->metrics.send_calls, 1);
+        metricAdd(&client->reactor->metrics.bytes_out, remaining);
+        metricSub(&client->reactor->metrics.queued_bytes, remaining);
+        client->out_bytes -= remaining;
+        while (remaining > 0) {
+            OutboundEntry *entry = &client->outbound[client->out_head];
+            size_t take = entry->message->length - entry->offset;
+            if (take > remaining) {
+                take = remaining;
+            }
+            entry->offset += take;
+            remaining -= take;
+            if (entry->offset == entry->message->length) {
+                releaseMessage(entry->message);
+                client->out_head = (client->out_head + 1) % client->out_capacity;
+                client->out_count--;
+                client->out_inflight--;
+            }
+        }
+    }
+    if (client->send_ops == 0) {
+        client->out_inflight = 0; // What a failed send left unsent goes out with the next chain
+        if (!client->dead && !client->closing) {
+            flushClient(client);
+        }
+    }
+}
+
+void uringRun(Reactor *reactor) {
+    Uring *ring = &reactor->uring;
+
+    if (uringInit(reactor) < 0) {
+        logAt(LOG_ERROR, "ERROR #23: cannot set up io_uring for reactor %d: %s\n", reactor->id, strerror(errno));
         exit(1);
     }
+    uringAccept(reactor);
+    uringWake(reactor);
+    for (;;) {
+        if (uringWait(reactor, tickTimeout(reactor)) < 0) {
+            logAt(LOG_ERROR, "io_uring error: %s\n", strerror(errno));
+            exit(1);
+        }
 
-    struct pollfd pfds[MAX_CONNECTED_CLIENTS + 1];
-    char usernames[MAX_CONNECTED_CLIENTS + 1][MAX_USERNAME_LENGTH];
-    memset(usernames, 0, sizeof(usernames));
-    nfds_t nfds = MAX_CONNECTED_CLIENTS;
+        reactor->corked = 1;
+        unsigned head = *ring->cq_head;
+        while (head != atomic_load_explicit((_Atomic unsigned*)ring->cq_tail, memory_order_acquire)) {
+            struct io_uring_cqe cqe = ring->cqes[head & ring->cq_mask];
+            atomic_store_explicit((_Atomic unsigned*)ring->cq_head, ++head, memory_order_release);
 
-#ifdef _WIN32
-    WSAStartup(MAKEWORD(2,2),&data);    
+            Client *client = (Client*)(uintptr_t)(cqe.user_data & ~(uint64_t)URING_OP_MASK);
+            switch (cqe.user_data & URING_OP_MASK) {
+            case URING_ACCEPT:
+                if (cqe.res >= 0) {
+                    setupClient(reactor, cqe.res);
+                } else {
+                    logAt(LOG_ERROR, "ERROR #5: error occured accepting connection.\n");
+                }
+                if (!(cqe.flags & IORING_CQE_F_MORE)) {
+                    uringAccept(reactor);
+                }
+                break;
+            case URING_WAKE:
+                uringWake(reactor);
+                break;
+            case URING_RECV:
+                uringReceived(reactor, client, &cqe);
+                uringRetire(client);
+                break;
+            case URING_SEND:
+                uringSent(client, &cqe);
+                uringRetire(client);
+                break;
+            }
+        }
+        reactorFinishIteration(reactor);
+    }
+}
+#endif
+
+void *reactorRun(void *arg) {
+    Reactor *reactor = (Reactor*)arg;
+    Event events[MAX_EVENTS];
+
+    snprintf(log_thread_name, sizeof(log_thread_name), "r%d", reactor->id);
+#ifdef USE_URING
+    if (event_backend == BACKEND_URING) {
+        uringRun(reactor);
+        return NULL;
+    }
 #endif
+    for(;;){
+        int activity = eventWait(reactor, events, MAX_EVENTS, tickTimeout(reactor));
+        if (activity < 0)
+        {
+            if (errno == EINTR) {
+                continue;
+            }
+            logAt(LOG_ERROR, "poll error: %s\n", strerror(errno));
+            exit(1);
+        }
+
+        reactor->corked = 1;
+        for (int i = 0; i < activity; i++)
+        {
+            if (events[i].ptr == &listener_tag) {
+                acceptClients(reactor);
+            } else if (events[i].ptr == &wakeup_tag) {
+                unsigned long long count;
+                metricAdd(&reactor->metrics.syscalls, 1);
+                if (read(reactor->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                    logAt(LOG_ERROR, "wakeup: %s\n", strerror(errno));
+                }
+            } else {
+                Client *client = (Client*)events[i].ptr;
+                if (!client->dead && events[i].error && client->zerocopy_count > 0) {
+                    zerocopyReap(client);
+                }
+                if (!client->dead && events[i].writable) {
+                    flushClient(client);
+                }
+                if (!client->dead && (events[i].readable || events[i].hangup)) {
+                    // recv() reports both data and EOF/errors
+                    readFromClient(client);
+                }
+            }
+        }
+        reactorFinishIteration(reactor);
+    }
+    return NULL;
+}
+
+int createListener(unsigned int port, int reuse_port) {
+    int l_socket; // socket'as skirtas prisijungimų laukimui
+    struct sockaddr_in servaddr; // Serverio adreso struktūra
 
     /*
       * Sukuriamas serverio socket'as
@@ -180,7 +5333,20 @@ int main(int argc, char *argv []){
         fprintf(stderr,"ERROR #2: cannot create listening socket.\n");
         exit(1);
     }
-    
+
+    /*
+      * Keli reaktoriai klausosi to paties porto, branduolys paskirsto prisijungimus
+      */
+#ifdef SO_REUSEPORT
+    if (reuse_port) {
+        int one = 1;
+        if (setsockopt(l_socket, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+            fprintf(stderr, "ERROR #8: SO_REUSEPORT is not supported.\n");
+            exit(1);
+        }
+    }
+#endif
+
     /*
       * Išvaloma ir užpildoma serverio adreso struktūra
       */
@@ -188,12 +5354,12 @@ int main(int argc, char *argv []){
      servaddr.sin_family = AF_INET; // nurodomas protokolas (IP)
 
     /*
-      * Nurodomas IP adresas, kuriuo bus laukiama klientų, šiuo atveju visi 
+      * Nurodomas IP adresas, kuriuo bus laukiama klientų, šiuo atveju visi
       * esami sistemos IP adresai (visi interfeis'ai)
       */
-    servaddr.sin_addr.s_addr = htonl(INADDR_ANY); 
+    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
      servaddr.sin_port = htons(port); // nurodomas portas
-    
+
     /*
       * Serverio adresas susiejamas su socket'u
       */
@@ -204,151 +5370,254 @@ int main(int argc, char *argv []){
 
     /*
       * Nurodoma, kad socket'u l_socket bus laukiama klientų prisijungimo,
-      * eilėje ne daugiau kaip 5 aptarnavimo laukiantys klientai
+      * eilėje iki SOMAXCONN aptarnavimo laukiančių klientų
       */
-    if (listen(l_socket, 5) <0){
+    if (listen(l_socket, SOMAXCONN) <0){
         fprintf(stderr,"ERROR #4: error in listen().\n");
         exit(1);
     }
 
-    pfds[0].fd = l_socket;
-    pfds[0].events = POLLIN;
+    if (setNonBlocking(l_socket) < 0) {
+        fprintf(stderr, "ERROR #7: cannot set up event loop.\n");
+        exit(1);
+    }
+    return l_socket;
+}
+
+void reactorInit(Reactor *reactor, int id, unsigned int port) {
+    memset(reactor, 0, sizeof(*reactor));
+    reactor->id = id;
+    reactor->wake_fd = -1;
+    pthread_mutex_init(&reactor->mailbox_lock, NULL);
+    reactor->view_buckets = (ClientList*)calloc((size_t)view_buckets_across * view_buckets_down, sizeof(ClientList));
+    if (reactor->view_buckets == NULL) {
+        fprintf(stderr, "ERROR #7: cannot set up event loop.\n");
+        exit(1);
+    }
+    reactor->listen_fd = createListener(port, reactor_count > 1);
+    if (event_backend == BACKEND_URING) {
+        // A non-blocking listener makes io_uring fail accepts with EAGAIN instead of waiting
+        fcntl(reactor->listen_fd, F_SETFL, fcntl(reactor->listen_fd, F_GETFL, 0) & ~O_NONBLOCK);
+    }
 
-    for (int i = 1; i <= MAX_CONNECTED_CLIENTS; i++)
-    {
-        pfds[i].fd = -1;
+    if (eventInit(reactor) < 0 || eventAdd(reactor, reactor->listen_fd, &listener_tag, 0) < 0) {
+        fprintf(stderr, "ERROR #7: cannot set up event loop.\n");
+        exit(1);
     }
+#ifdef __linux__
+    reactor->wake_fd = eventfd(0, event_backend == BACKEND_URING ? 0 : EFD_NONBLOCK);
+    if (reactor->wake_fd < 0 || eventAdd(reactor, reactor->wake_fd, &wakeup_tag, 0) < 0) {
+        fprintf(stderr, "ERROR #7: cannot set up event loop.\n");
+        exit(1);
+    }
+#endif
+}
 
-    for(;;){
-            printf("Polling...\n");
-            int activity = poll(pfds, nfds, -1);
-            if (activity < 0)
-            {
-                fprintf(stderr, "poll error");
+int main(int argc, char *argv []){
+#ifdef _WIN32
+    WSADATA data;
+#endif
+    unsigned int port;
+    int opt;
+
+    int tick_rate = DEFAULT_TICK_RATE;
+    int width = DEFAULT_BOARD_WIDTH, height = DEFAULT_BOARD_HEIGHT;
+    const char *map_path = NULL;
+    int history_mb = DEFAULT_HISTORY_MB;
+    int metrics_port = 0;
+
+    if (logInit() < 0) {
+        printf("ERROR #21: cannot start the log writer.\n");
+        exit(1);
+    }
+
+    while ((opt = getopt(argc, argv, "t:s:w:r:d:p:i:m:j:l:M:z:b:")) != -1) {
+        switch (opt) {
+        case 't':
+            reactor_count = atoi(optarg);
+            break;
+        case 's':
+            if (strcmp(optarg, "coalesce") == 0) {
+                slow_policy = SLOW_COALESCE;
+            } else if (strcmp(optarg, "disconnect") == 0) {
+                slow_policy = SLOW_DISCONNECT;
+            } else {
+                printf("ERROR #11: slow consumer policy must be coalesce or disconnect.\n");
                 exit(1);
             }
-    
-            if (pfds[0].revents & POLLIN)
-            {
-                printf("Trying to connect client.\n");
-                if ((c_socket = accept(l_socket, (struct sockaddr *)&clientaddr,
-                                        &clientaddrlen)) < 0)
-                {
-                    fprintf(stderr,
-                            "ERROR #5: error occured accepting connection.\n");
-                    exit(1);
-                }
-    
-                for (int i = 1; i <= MAX_CONNECTED_CLIENTS; i++)
-                {
-                    if (pfds[i].fd == -1)
-                    {
-                        pfds[i].fd = c_socket;
-                        pfds[i].events = POLLIN;
-                        printf("Client %d fd: %d.\n", i, pfds[i].fd);
-                        break;
-                    }
-                }
-                printf("Client connected.\n");
-            }
-    
-            for (int i = 1; i <= MAX_CONNECTED_CLIENTS; i++)
-            {
-                if (pfds[i].fd == -1)
-                    continue;
-    
-                if (pfds[i].revents & POLLIN)
-                {
-                    if (usernames[i][0] == '\0')
-                    {
-                        send(pfds[i].fd, "Enter your username: ", 21, 0);
-                        s_len =
-                            recv(pfds[i].fd, usernames[i], sizeof(usernames[i]), 0);
-                        if (s_len <= 0)
-                        {
-                            printf("Client %s disconnected.\n", usernames[i]);
-                            close(pfds[i].fd);
-                            usernames[i][0] = '\0';
-                            pfds[i].fd = -1;
-                        }
-                        else
-                        {
-                            usernames[i][s_len] = '\0';
-                            for (int j = 0; j < s_len; j++)
-                            {
-                                if (usernames[i][j] == '\n')
-                                {
-                                    usernames[i][j] = '\0';
-                                }
-                            }
-                            printf("Client %d is now called %s.\n", i,
-                                    usernames[i]);
-                            
-                            char str[MAX_USERNAME_LENGTH + 20];
-                            sprintf(str, "%s connected.", usernames[i]);
-                            send(pfds[i].fd, "Welcome to the server!\n", 23, 0);
-                            for (int j = 1; j <= MAX_CONNECTED_CLIENTS; j++)
-                            {
-                                if (pfds[j].fd != -1 && i != j)
-                                {
-                                    send(pfds[j].fd, str, strlen(str), 0);
-                                }
-                            }
-                        }
-                    }
-                    else
-                    {
-                    printf("Trying to read from client %d (%d).\n", i, pfds[i].fd);
-                    size_t uname_length = strlen(usernames[i]);
-                    strcpy(buffer, usernames[i]);
-                    strcpy(buffer + uname_length, ": ");
-                    s_len = recv(pfds[i].fd, buffer + (uname_length + 2),
-                    sizeof(buffer) - (uname_length + 2), 0);
-                    buffer[s_len + (uname_length + 2)] = '\0';
-
-                    if (s_len <= 0)
-                    {
-                        char str[MAX_USERNAME_LENGTH + 20];
-                        char *client_name =
-                            usernames[i][0] == '\0' ? "Anon" : usernames[i];
-                        sprintf(str, "%s disconnected.", client_name);
-                        for (int j = 1; j <= MAX_CONNECTED_CLIENTS; j++)
-                        {
-                            if (pfds[j].fd != -1 && i != j)
-                            {
-                                r_len = send(pfds[j].fd, str, strlen(str), 0);
-                            }
-                        }
-                        printf("Client disconnected.\n");
-                        close(pfds[i].fd);
-                        usernames[i][0] = '\0';
-                        pfds[i].fd = -1;
-                    }
-                    else
-                    {
-                        printf("Received from client %d: \"%s\".\n", i, buffer);
-                        if (buffer[uname_length + 2] == '/')
-                        {
-                            printf("Command detected: \"%s\"\n", buffer + uname_length + 2);
-                            commandParse(buffer + uname_length + 2, pfds[i].fd, pfds);
-                            // sendBoardToClients(pfds[i].fd, pfds);
-                        }
-                        else
-                        {
-                            printf("Broadcasting message to all clients.\n");
-                            for (int j = 1; j <= MAX_CONNECTED_CLIENTS; j++)
-                            {
-                                if (pfds[j].fd != -1)
-                                {
-                                    r_len =
-                                        send(pfds[j].fd, buffer, strlen(buffer), 0);
-                                }
-                            }
-                        }
-                    }
-                }
+            break;
+        case 'w':
+            high_water = strtoul(optarg, NULL, 10);
+            if (high_water < MIN_HIGH_WATER) {
+                printf("ERROR #24: high water mark must be at least %d bytes.\n", MIN_HIGH_WATER);
+                exit(1);
+            }
+            break;
+        case 'r':
+            tick_rate = atoi(optarg);
+            break;
+        case 'p':
+            persist_dir = optarg;
+            break;
+        case 'm':
+            map_path = optarg;
+            break;
+        case 'j':
+            history_mb = atoi(optarg);
+            if (history_mb < 0 || history_mb > 65536) {
+                printf("ERROR #18: history budget must be 0 (off) to 65536 MB.\n");
+                exit(1);
+            }
+            break;
+        case 'l':
+            if (parseLogLevel(optarg) < 0) {
+                printf("ERROR #19: log level must be error, warn, info or debug.\n");
+                exit(1);
+            }
+            atomic_store(&log_level, parseLogLevel(optarg));
+            break;
+        case 'z':
+            zerocopy_threshold = strtoul(optarg, NULL, 10);
+#ifndef USE_ZEROCOPY
+            if (zerocopy_threshold > 0) {
+                printf("ERROR #22: MSG_ZEROCOPY is not available on this system.\n");
+                exit(1);
+            }
+#endif
+            break;
+        case 'b':
+            if (strcmp(optarg, "poll") == 0) {
+                event_backend = BACKEND_POLL;
+#ifdef USE_EPOLL
+            } else if (strcmp(optarg, "epoll") == 0) {
+                event_backend = BACKEND_EPOLL;
+#endif
+#ifdef USE_URING
+            } else if (strcmp(optarg, "uring") == 0) {
+                event_backend = BACKEND_URING;
+#endif
+            } else {
+                printf("ERROR #23: event backend must be poll, epoll or uring, as far as this system supports them.\n");
+                exit(1);
+            }
+            break;
+        case 'M':
+            metrics_port = atoi(optarg);
+            if (metrics_port < 1 || metrics_port > 65535) {
+                printf("ERROR #20: invalid metrics port specified.\n");
+                exit(1);
+            }
+            break;
+        case 'i':
+            snapshot_interval = atoi(optarg);
+            if (snapshot_interval < 1) {
+                printf("ERROR #15: snapshot interval must be at least 1 second.\n");
+                exit(1);
+            }
+            break;
+        case 'd':
+            if (sscanf(optarg, "%dx%d", &width, &height) != 2 ||
+                width < 1 || height < 1 || width > MAX_BOARD_SIZE || height > MAX_BOARD_SIZE) {
+                printf("ERROR #13: board size must be <width>x<height>, each 1 to %d.\n", MAX_BOARD_SIZE);
+                exit(1);
             }
+            break;
+        default:
+            printf("USAGE: %s [-t threads] [-s coalesce|disconnect] [-w high_water_bytes] [-r tick_hz] [-d WIDTHxHEIGHT] [-p data_dir] [-i snapshot_secs] [-m board_file] [-j history_mb] [-l error|warn|info|debug] [-M metrics_port] [-z zerocopy_bytes] [-b poll|epoll|uring] <port>\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    if (argc - optind != 1){
+        printf("USAGE: %s [-t threads] [-s coalesce|disconnect] [-w high_water_bytes] [-r tick_hz] [-d WIDTHxHEIGHT] [-p data_dir] [-i snapshot_secs] [-m board_file] [-j history_mb] [-l error|warn|info|debug] [-M metrics_port] [-z zerocopy_bytes] [-b poll|epoll|uring] <port>\n", argv[0]);
+        exit(1);
+    }
+
+    port = atoi(argv[optind]);
+
+    if ((port < 1) || (port > 65535)){
+        printf("ERROR #1: invalid port specified.\n");
+        exit(1);
+    }
+
+    if (reactor_count < 1 || reactor_count > MAX_REACTORS) {
+        printf("ERROR #9: thread count must be between 1 and %d.\n", MAX_REACTORS);
+        exit(1);
+    }
+    if (tick_rate < 0 || tick_rate > 1000) {
+        printf("ERROR #12: tick rate must be between 0 (off) and 1000 Hz.\n");
+        exit(1);
+    }
+    tick_interval = tick_rate == 0 ? 0 : 1000 / tick_rate;
+#ifdef USE_URING
+    if (event_backend == BACKEND_URING) {
+        // Containers often filter io_uring out; find out now rather than in every reactor
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        int probe = (int)syscall(__NR_io_uring_setup, 1, &params);
+        if (probe < 0) {
+            printf("ERROR #23: io_uring is not available: %s.\n", strerror(errno));
+            exit(1);
+        }
+        close(probe);
+        if (zerocopy_threshold > 0) {
+            printf("ERROR #22: MSG_ZEROCOPY is not available with the io_uring backend.\n");
+            exit(1);
+        }
+    }
+#endif
+#ifndef __linux__
+    reactor_count = 1; // Cross-thread wakeups need eventfd
+#endif
+
+#ifdef _WIN32
+    WSAStartup(MAKEWORD(2,2),&data);
+#else
+    signal(SIGPIPE, SIG_IGN); // Dead peers are reported by send() instead
+#endif
+
+    if (boardInit(width, height) < 0) {
+        printf("ERROR #14: cannot allocate a %dx%d board.\n", width, height);
+        exit(1);
+    }
+    if (map_path != NULL && boardMapOpen(map_path) < 0) {
+        printf("ERROR #17: cannot map the board file %s.\n", map_path);
+        exit(1);
+    }
+    if (persist_dir != NULL) {
+        pthread_t writer;
+        if (recoverBoard() < 0) {
+            printf("ERROR #16: cannot restore the board from %s.\n", persist_dir);
+            exit(1);
+        }
+        if (pthread_create(&writer, NULL, walWriter, NULL) != 0) {
+            printf("ERROR #16: cannot start the log writer.\n");
+            exit(1);
+        }
+    }
+
+    if (historyInit(history_mb) < 0) {
+        printf("ERROR #18: cannot allocate %d MB of history.\n", history_mb);
+        exit(1);
+    }
+
+    for (int i = 0; i < reactor_count; i++) {
+        reactorInit(&reactors[i], i, port);
+    }
+    if (metrics_port != 0 && metricsStart(metrics_port) < 0) {
+        printf("ERROR #20: cannot serve metrics on port %d.\n", metrics_port);
+        exit(1);
+    }
+
+    // Reactor 0 runs on the main thread
+    for (int i = 1; i < reactor_count; i++) {
+        if (pthread_create(&reactors[i].thread, NULL, reactorRun, &reactors[i]) != 0) {
+            fprintf(stderr, "ERROR #10: cannot start reactor thread %d.\n", i);
+            exit(1);
         }
     }
+    logAt(LOG_INFO, "Serving a %dx%d board on port %u with %d %s reactor thread(s), %d Hz board ticks.\n",
+           board_width, board_height, port, reactor_count, backend_names[event_backend], tick_rate);
+    reactorRun(&reactors[0]);
     return 0;
 }